@@ -0,0 +1,336 @@
+// Benchmark of the decoder feed path
+// sweeps input chunk sizes over a file and reports throughput and call latency for each of them,
+// and measures CPU stages of the feed path (NAL scanning, indexing, copying) with hardware counters
+
+#include "decoder.hpp"
+#include "source.hpp"
+#include "lazy.hpp"
+#include <iostream>
+#include <algorithm>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+using namespace std;
+
+// default settings
+const string defaultInputPath = "video.h264";
+const int benchmarkRuns = 3; // runs per chunk size, best one is reported
+const int stageChunkSize = 64 * 1024; // input chunk size for CPU stages
+
+/*
+    note for hardware counters:
+
+    PerfCounters counts cycles, instructions, cache misses and stalled cycles of the calling thread
+    (user space only, which is allowed with default perf_event_paranoid) through perf_event_open
+    counters which the CPU or kernel doesn't provide (or without permission) are left out of the report,
+    backend stalls are counted where available, frontend stalls otherwise (for example on Cortex-A53)
+
+    decode timing includes waiting for the device, so its counters show CPU cost of the feed path only
+*/
+
+struct PerfCounters {
+    enum Counter {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        STALLED_CYCLES,
+        COUNTERS
+    };
+
+    int descriptors[COUNTERS];
+    long long values[COUNTERS] = {}; // accumulated between start and stop, -1 if not available
+
+    PerfCounters() {
+        const unsigned long long configs[COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+        };
+
+        for(int i = 0; i < COUNTERS; i++) {
+            descriptors[i] = open(configs[i]);
+            if(descriptors[i] < 0 && i == STALLED_CYCLES) {
+                descriptors[i] = open(PERF_COUNT_HW_STALLED_CYCLES_FRONTEND);
+            }
+
+            values[i] = descriptors[i] < 0 ? -1 : 0;
+        }
+    }
+
+    ~PerfCounters() {
+        for(const int descriptor : descriptors) {
+            if(descriptor >= 0) close(descriptor);
+        }
+    }
+
+    bool available() {
+        return values[CYCLES] >= 0 || values[INSTRUCTIONS] >= 0;
+    }
+
+    void reset() {
+        for(int i = 0; i < COUNTERS; i++) {
+            values[i] = descriptors[i] < 0 ? -1 : 0;
+        }
+    }
+
+    void start() {
+        for(const int descriptor : descriptors) {
+            if(descriptor >= 0) {
+                ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+                ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // adds counts since start, scaled up if the kernel multiplexed counters
+    void stop() {
+        for(int i = 0; i < COUNTERS; i++) {
+            if(descriptors[i] < 0) continue;
+            ioctl(descriptors[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            unsigned long long data[3]; // value, time enabled, time running
+            if(read(descriptors[i], data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+                values[i] += (long long)((double)data[0] * data[1] / data[2]);
+            }
+        }
+    }
+private:
+    static int open(const unsigned long long config) {
+        perf_event_attr attributes = {};
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = config;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+};
+
+struct BenchmarkResult {
+    int chunkSize = 0;
+    double seconds = 0;
+    long long bytes = 0;
+    long long frames = 0;
+    vector<double> calls; // decode call durations in seconds
+    long long counters[PerfCounters::COUNTERS] = {};
+};
+
+// CSV columns of counters: cycles, instructions, ipc, cache misses (total, per byte, per frame), stalled cycles
+const string counterColumns = "cycles,instructions,ipc,cache_misses,misses_per_byte,misses_per_frame,stalled_cycles";
+
+string counterFields(const long long *counters, const long long bytes, const long long frames) {
+    const auto field = [](const double value, const bool valid) {
+        return valid ? to_string(value) : string();
+    };
+
+    const long long cycles = counters[PerfCounters::CYCLES];
+    const long long instructions = counters[PerfCounters::INSTRUCTIONS];
+    const long long misses = counters[PerfCounters::CACHE_MISSES];
+    const long long stalls = counters[PerfCounters::STALLED_CYCLES];
+
+    return (cycles >= 0 ? to_string(cycles) : "") + "," +
+           (instructions >= 0 ? to_string(instructions) : "") + "," +
+           field((double)instructions / cycles, cycles > 0 && instructions >= 0) + "," +
+           (misses >= 0 ? to_string(misses) : "") + "," +
+           field((double)misses / bytes, misses >= 0 && bytes > 0) + "," +
+           field((double)misses / frames, misses >= 0 && frames > 0) + "," +
+           (stalls >= 0 ? to_string(stalls) : "");
+}
+
+bool runBenchmark(const string &path, const pair<int, int> &imageSize, const string &device, const int chunkSize, PerfCounters &counters, BenchmarkResult &result) {
+    Decoder decoder;
+    if(decoder.initializeDecoder(imageSize.first, imageSize.second, -1, device) != Decoder::InitStatus::OK) {
+        return false;
+    }
+
+    FileSource source;
+    if(!source.open(path, chunkSize)) {
+        return false;
+    }
+
+    result = {};
+    result.chunkSize = chunkSize;
+
+    const char *chunk;
+    int size;
+    const auto start = chrono::steady_clock::now();
+    counters.reset();
+
+    while(source.read(chunk, size)) {
+        const bool isLast = source.last();
+
+        // counter ioctls stay outside of the measured call
+        counters.start();
+        const auto callStart = chrono::steady_clock::now();
+        auto decodedFrame = decoder.decode(chunk, size, isLast);
+        const auto callEnd = chrono::steady_clock::now();
+        counters.stop();
+        result.calls.push_back(chrono::duration<double>(callEnd - callStart).count());
+
+        if(decodedFrame.status != Decoder::Status::OK) {
+            return false;
+        }
+
+        result.bytes += size;
+        result.frames += decodedFrame.frames;
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    copy(counters.values, counters.values + PerfCounters::COUNTERS, result.counters);
+    return true;
+}
+
+// runs a CPU stage over the whole input in chunks, best of benchmarkRuns runs is kept
+template<typename Stage>
+void runStage(const string &name, const vector<char> &input, const long long frames, PerfCounters &counters, Stage stage) {
+    BenchmarkResult best;
+
+    for(int run = 0; run < benchmarkRuns; run++) {
+        BenchmarkResult result;
+        counters.reset();
+
+        counters.start();
+        const auto start = chrono::steady_clock::now();
+        for(size_t position = 0; position < input.size(); position += stageChunkSize) {
+            const size_t size = min<size_t>(stageChunkSize, input.size() - position);
+            stage(input.data() + position, size, position + size == input.size());
+        }
+        const auto end = chrono::steady_clock::now();
+        counters.stop();
+
+        result.seconds = chrono::duration<double>(end - start).count();
+        copy(counters.values, counters.values + PerfCounters::COUNTERS, result.counters);
+
+        if(run == 0 || result.seconds < best.seconds) {
+            best = move(result);
+        }
+    }
+
+    cout << name << "," << best.seconds << "," << (best.seconds > 0 ? input.size() / best.seconds / 1e6 : 0) << ","
+         << counterFields(best.counters, input.size(), frames) << "\n";
+}
+
+double percentile(vector<double> values, const double fraction) {
+    if(values.empty()) return 0;
+
+    sort(values.begin(), values.end());
+    return values[min<size_t>(values.size() - 1, values.size() * fraction)];
+}
+
+int main(int argc, char **argv) {
+    const string path = argc > 1 ? argv[1] : defaultInputPath;
+    const string device = argc > 2 ? argv[2] : decoderDev;
+
+    vector<char> input;
+    {
+        ifstream file(path, ios::binary);
+        if(!file) {
+            cout << "Failed to open video file\n";
+            return 2;
+        }
+
+        input.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+
+    const pair<int, int> imageSize = Decoder::probeImageSize(vector<char>(input.begin(), input.begin() + min<size_t>(input.size(), 1024 * 1024)));
+    if(imageSize.first <= 0) {
+        cout << "No SPS found in video file\n";
+        return 2;
+    }
+
+    PerfCounters counters;
+    if(!counters.available()) {
+        cerr << "Hardware counters are not available (perf_event_open failed), only wall time is reported\n";
+    }
+
+    // CPU stages of the feed path, without the device
+    long long frames = 0;
+    {
+        StreamIndex index;
+        index.ingest(input.data(), input.size(), true);
+        frames = index.getFrames();
+    }
+
+    cout << "stage,seconds,mbytes_per_second," << counterColumns << "\n";
+
+    long long nals = 0;
+    NALSplitter splitter;
+    runStage("nal_scan", input, frames, counters, [&](const char *data, size_t size, bool last) {
+        const auto output = [&](const uint8_t *, size_t, int, long long) { nals++; };
+        splitter.push(reinterpret_cast<const uint8_t *>(data), size, output);
+        if(last) {
+            splitter.flush(output);
+            splitter.reset();
+        }
+    });
+
+    unique_ptr<StreamIndex> index(new StreamIndex());
+    runStage("index", input, frames, counters, [&](const char *data, size_t size, bool last) {
+        index->ingest(data, size, last);
+        if(last) {
+            index.reset(new StreamIndex());
+        }
+    });
+
+    // as copy into mapped input buffers
+    vector<char> inputBuffer(stageChunkSize);
+    runStage("copy_in", input, frames, counters, [&](const char *data, size_t size, bool) {
+        memcpy(inputBuffer.data(), data, size);
+        asm volatile("" : : "r"(inputBuffer.data()) : "memory");
+    });
+
+    // chunk size curve
+    cout << "chunk_bytes,seconds,fps,mbps,call_avg_ms,call_p95_ms,call_max_ms," << counterColumns << "\n";
+
+    for(int chunkSize = 1024; chunkSize <= 1024 * 1024; chunkSize *= 2) {
+        BenchmarkResult best;
+
+        for(int run = 0; run < benchmarkRuns; run++) {
+            BenchmarkResult result;
+            if(!runBenchmark(path, imageSize, device, chunkSize, counters, result)) {
+                cout << "Failed decoding with chunk size " << chunkSize << "\n";
+                return 4;
+            }
+
+            if(run == 0 || result.seconds < best.seconds) {
+                best = move(result);
+            }
+        }
+
+        double callSum = 0;
+        for(const double call : best.calls) {
+            callSum += call;
+        }
+
+        cout << best.chunkSize << "," << best.seconds << ","
+             << (best.seconds > 0 ? best.frames / best.seconds : 0) << ","
+             << (best.seconds > 0 ? best.bytes * 8 / best.seconds / 1e6 : 0) << ","
+             << (best.calls.empty() ? 0 : callSum / best.calls.size() * 1000) << ","
+             << percentile(best.calls, 0.95) * 1000 << ","
+             << percentile(best.calls, 1.0) * 1000 << ","
+             << counterFields(best.counters, best.bytes, best.frames) << "\n";
+    }
+
+    // what autotuner settles on for the same file
+    {
+        Decoder decoder;
+        FileSource source;
+        if(decoder.initializeDecoder(imageSize.first, imageSize.second, -1, device) == Decoder::InitStatus::OK && source.open(path, 0, decoder.getInputBufferSize())) {
+            const char *chunk;
+            int size;
+            while(!source.autotuned() && source.read(chunk, size)) {
+                const bool isLast = source.last();
+                const auto callStart = chrono::steady_clock::now();
+                if(decoder.decode(chunk, size, isLast).status != Decoder::Status::OK) break;
+                source.report(chrono::duration<double>(chrono::steady_clock::now() - callStart).count());
+            }
+
+            cout << "autotuned_chunk_bytes," << source.chunkSize() << (source.autotuned() ? "" : " (not settled, file too short)") << "\n";
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,523 @@
+// Composition of multiple decoded streams into one canvas (video wall)
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#include <linux/udmabuf.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+using namespace std;
+
+// default settings
+const string udmabufDev = "/dev/udmabuf"; // exports memfd memory as dmabuf
+const double compositorOutputRate = 25; // canvas frames per second
+const uint8_t compositorBlackLuma = 16;
+const uint8_t compositorBlackChroma = 128;
+
+/*
+    note for row kernels:
+
+    tiles are scaled row by row, each output row is the average of two source rows (averageRows),
+    which is then resampled horizontally (halveRow for exact 2:1, otherwise by a table of columns)
+    rounding is (a + b + 1) / 2 in all variants, so SIMD (AVX2 or NEON) and scalar output are identical
+*/
+
+inline void averageRowsScalar(const uint8_t *first, const uint8_t *second, uint8_t *output, const int width) {
+    for(int x = 0; x < width; x++) {
+        output[x] = (first[x] + second[x] + 1) >> 1;
+    }
+}
+
+inline void halveRowScalar(const uint8_t *input, uint8_t *output, const int outputWidth) {
+    for(int x = 0; x < outputWidth; x++) {
+        output[x] = (input[2 * x] + input[2 * x + 1] + 1) >> 1;
+    }
+}
+
+inline void averageRows(const uint8_t *first, const uint8_t *second, uint8_t *output, const int width) {
+    int x = 0;
+
+#if defined(__AVX2__)
+    for(; x + 32 <= width; x += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + x));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(second + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + x), _mm256_avg_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for(; x + 16 <= width; x += 16) {
+        vst1q_u8(output + x, vrhaddq_u8(vld1q_u8(first + x), vld1q_u8(second + x)));
+    }
+#endif
+
+    averageRowsScalar(first + x, second + x, output + x, width - x);
+}
+
+inline void halveRow(const uint8_t *input, uint8_t *output, const int outputWidth) {
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i rounding = _mm256_set1_epi16(1);
+
+    for(; x + 32 <= outputWidth; x += 32) {
+        // pair sums as 16 bit, packing interleaves 128 bit lanes, so they are put back in order
+        const __m256i a = _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 2 * x)), ones);
+        const __m256i b = _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 2 * x + 32)), ones);
+        const __m256i packed = _mm256_packus_epi16(
+            _mm256_srli_epi16(_mm256_add_epi16(a, rounding), 1),
+            _mm256_srli_epi16(_mm256_add_epi16(b, rounding), 1)
+        );
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + x), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+#elif defined(__ARM_NEON)
+    for(; x + 16 <= outputWidth; x += 16) {
+        const uint8x16x2_t pairs = vld2q_u8(input + 2 * x);
+        vst1q_u8(output + x, vrhaddq_u8(pairs.val[0], pairs.val[1]));
+    }
+#endif
+
+    halveRowScalar(input + 2 * x, output + x, outputWidth - x);
+}
+
+/*
+    note for compositing:
+
+    Compositor keeps a single YU12 canvas, split into tiles (a grid by default, or set by setTile),
+    frames of each stream are scaled straight into their tile when they are submitted, so a tile
+    is updated only when its stream has a new frame (dirty tile), and other tiles are left untouched
+
+    output is decoupled from input rates: the canvas is passed on at its own rate by startOutput
+    (from an output thread, with dirty tiles since the previous output), or copied by getFrame
+    submitting and output exclude each other per tile, so a tile is never passed half written
+
+    canvas is kept in memfd memory, so it can be exported as dmabuf (udmabuf) to a display or encoder
+    without copying, if memfd or udmabuf isn't available, canvas is in ordinary memory and export fails
+
+    frames can also be scaled by the ISP (Scaler in encoder.hpp) to getTileSize first, then submit only copies rows
+*/
+
+class Compositor {
+public:
+    struct CanvasFrame {
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        pair<int, int> imageSize;
+        int dmabuf = -1; // exported canvas (see exportCanvas), -1 if not exported
+        vector<int> dirtyTiles; // tiles updated since the previous output
+        long long sequence = 0;
+    };
+
+    // called from output thread, canvas must not be used after it returns
+    using Output = function<void(const CanvasFrame &)>;
+private:
+    struct Tile {
+        int x = 0, y = 0; // position in canvas (luma, even)
+        int width = 0, height = 0;
+
+        mutex tileMutex;
+        bool dirty = false;
+        long long frames = 0;
+
+        // scaling state, reused while source size doesn't change
+        pair<int, int> sourceSize;
+        vector<uint8_t> row;
+        vector<int> columns[2]; // source column of each output column (luma, chroma)
+    };
+
+    pair<int, int> canvasSize;
+    uint8_t *canvas = nullptr;
+    size_t canvasBytes = 0; // YU12 data
+    size_t mappedBytes = 0; // page aligned memfd size
+    vector<uint8_t> heapCanvas; // when memfd isn't available
+    int memfd = -1;
+    int dmabuf = -1;
+
+    vector<unique_ptr<Tile>> tiles;
+    bool initialized = false;
+
+    // output thread
+    thread outputThread;
+    mutex outputMutex;
+    condition_variable outputCondition;
+    bool stopOutputThread = false;
+    atomic<long long> outputFrames{0};
+    atomic<long long> lateOutputs{0};
+
+    uint8_t *plane(const int index) {
+        const size_t lumaSize = (size_t)canvasSize.first * canvasSize.second;
+        return canvas + (index == 0 ? 0 : lumaSize + (index - 1) * (lumaSize / 4));
+    }
+
+    void fill(Tile &tile) {
+        for(int p = 0; p < 3; p++) {
+            const int shift = p == 0 ? 0 : 1;
+            const int stride = canvasSize.first >> shift;
+            uint8_t *origin = plane(p) + (size_t)(tile.y >> shift) * stride + (tile.x >> shift);
+
+            for(int y = 0; y < tile.height >> shift; y++) {
+                memset(origin + (size_t)y * stride, p == 0 ? compositorBlackLuma : compositorBlackChroma, tile.width >> shift);
+            }
+        }
+    }
+
+    static vector<int> columnTable(const int sourceWidth, const int outputWidth) {
+        vector<int> table(outputWidth);
+        for(int x = 0; x < outputWidth; x++) {
+            table[x] = min((int)((long long)x * sourceWidth / outputWidth), sourceWidth - 2);
+        }
+
+        return table;
+    }
+
+    // scales a single plane into tile area of canvas plane
+    static void scalePlane(const uint8_t *source, const int sourceStride, const pair<int, int> &sourceSize, uint8_t *output, const int outputStride, const pair<int, int> &outputSize, const vector<int> &columns, vector<uint8_t> &row) {
+        const int sourceWidth = sourceSize.first, sourceHeight = sourceSize.second;
+        const int outputWidth = outputSize.first, outputHeight = outputSize.second;
+
+        for(int y = 0; y < outputHeight; y++) {
+            uint8_t *outputRow = output + (size_t)y * outputStride;
+            const int sourceY = (long long)y * sourceHeight / outputHeight;
+            const uint8_t *first = source + (size_t)sourceY * sourceStride;
+
+            // same size (pre-scaled frame) is only copied
+            const uint8_t *line = first;
+            if(sourceHeight != outputHeight) {
+                const uint8_t *second = source + (size_t)min(sourceY + 1, sourceHeight - 1) * sourceStride;
+                averageRows(first, second, row.data(), sourceWidth);
+                line = row.data();
+            }
+
+            if(sourceWidth == outputWidth) {
+                memcpy(outputRow, line, outputWidth);
+            } else if(sourceWidth == outputWidth * 2) {
+                halveRow(line, outputRow, outputWidth);
+            } else {
+                for(int x = 0; x < outputWidth; x++) {
+                    outputRow[x] = (line[columns[x]] + line[columns[x] + 1] + 1) >> 1;
+                }
+            }
+        }
+    }
+
+    void outputLoop(const double rate, Output output) {
+        const auto period = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1 / rate));
+        auto deadline = chrono::steady_clock::now();
+
+        while(true) {
+            {
+                unique_lock<mutex> lock(outputMutex);
+                if(outputCondition.wait_until(lock, deadline, [this] { return stopOutputThread; })) {
+                    return;
+                }
+            }
+
+            compose(output);
+
+            // output which missed its slot isn't caught up, schedule continues from now
+            deadline += period;
+            if(deadline < chrono::steady_clock::now()) {
+                lateOutputs++;
+                deadline = chrono::steady_clock::now() + period;
+            }
+        }
+    }
+
+    // passes canvas to output with all tiles locked
+    void compose(const Output &output) {
+        vector<unique_lock<mutex>> locks;
+        CanvasFrame frame;
+
+        for(int i = 0; i < (int)tiles.size(); i++) {
+            locks.emplace_back(tiles[i]->tileMutex);
+            if(tiles[i]->dirty) {
+                frame.dirtyTiles.push_back(i);
+                tiles[i]->dirty = false;
+            }
+        }
+
+        frame.data = canvas;
+        frame.size = canvasBytes;
+        frame.imageSize = canvasSize;
+        frame.dmabuf = dmabuf;
+        frame.sequence = outputFrames++;
+        output(frame);
+    }
+public:
+    ~Compositor() { unload(); }
+
+    // canvas size must be even, tiles are laid out in a grid of columns x rows
+    Decoder::InitStatus initialize(const pair<int, int> &size, const int columns, const int rows) {
+        unload();
+
+        if(size.first <= 0 || size.second <= 0 || size.first % 2 || size.second % 2 || columns <= 0 || rows <= 0) {
+            return Decoder::InitStatus::FAILED;
+        }
+
+        canvasSize = size;
+        canvasBytes = (size_t)size.first * size.second * 3 / 2;
+
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        mappedBytes = (canvasBytes + pageSize - 1) / pageSize * pageSize;
+
+        // udmabuf needs memfd which can't shrink
+        memfd = memfd_create("compositor", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if(memfd >= 0 && ftruncate(memfd, mappedBytes) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+            void *mapped = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+            canvas = mapped == MAP_FAILED ? nullptr : static_cast<uint8_t *>(mapped);
+        }
+
+        if(!canvas) {
+            if(memfd >= 0) {
+                close(memfd);
+                memfd = -1;
+            }
+
+            try {
+                heapCanvas.resize(canvasBytes);
+            } catch(const bad_alloc &) {
+                return Decoder::InitStatus::INSUFFICIENT_MEMORY;
+            }
+
+            canvas = heapCanvas.data();
+        }
+
+        for(int i = 0; i < columns * rows; i++) {
+            tiles.emplace_back(new Tile());
+        }
+
+        initialized = true;
+
+        // grid cells rounded down to even size
+        const int cellWidth = size.first / columns / 2 * 2, cellHeight = size.second / rows / 2 * 2;
+        for(int i = 0; i < columns * rows; i++) {
+            setTile(i, (i % columns) * cellWidth, (i / columns) * cellHeight, cellWidth, cellHeight);
+        }
+
+        memset(canvas, compositorBlackLuma, (size_t)size.first * size.second);
+        memset(canvas + (size_t)size.first * size.second, compositorBlackChroma, canvasBytes - (size_t)size.first * size.second);
+        return Decoder::InitStatus::OK;
+    }
+
+    // moves tile to a rectangle of canvas (rounded to even), for layouts other than grid
+    bool setTile(const int tile, const int x, const int y, const int width, const int height) {
+        if(!initialized || tile < 0 || tile >= (int)tiles.size()) {
+            return false;
+        }
+
+        const int left = x / 2 * 2, top = y / 2 * 2;
+        const int right = min(x + width, canvasSize.first) / 2 * 2, bottom = min(y + height, canvasSize.second) / 2 * 2;
+        if(left < 0 || top < 0 || right - left < 2 || bottom - top < 2) {
+            return false;
+        }
+
+        Tile &target = *tiles[tile];
+        lock_guard<mutex> lock(target.tileMutex);
+
+        target.x = left;
+        target.y = top;
+        target.width = right - left;
+        target.height = bottom - top;
+        target.sourceSize = {};
+        target.dirty = true;
+        fill(target);
+        return true;
+    }
+
+    /*
+        scales YU12 frame (stride is luma bytes per line, width by default) into tile,
+        frame can be unloaded right after it returns
+    */
+    bool submit(const int tile, const uint8_t *frame, const pair<int, int> &imageSize, const int stride = 0) {
+        if(!initialized || tile < 0 || tile >= (int)tiles.size() || imageSize.first < 4 || imageSize.second < 4) {
+            return false;
+        }
+
+        const int lumaStride = stride > 0 ? stride : imageSize.first;
+        Tile &target = *tiles[tile];
+        lock_guard<mutex> lock(target.tileMutex);
+
+        if(target.sourceSize != imageSize) {
+            target.sourceSize = imageSize;
+            target.row.resize(imageSize.first);
+            target.columns[0] = columnTable(imageSize.first, target.width);
+            target.columns[1] = columnTable(imageSize.first / 2, target.width / 2);
+        }
+
+        const uint8_t *source = frame;
+        for(int p = 0; p < 3; p++) {
+            const int shift = p == 0 ? 0 : 1;
+            const int sourceStride = lumaStride >> shift;
+            const pair<int, int> sourceSize = {imageSize.first >> shift, imageSize.second >> shift};
+            const int canvasStride = canvasSize.first >> shift;
+
+            scalePlane(
+                source, sourceStride, sourceSize,
+                plane(p) + (size_t)(target.y >> shift) * canvasStride + (target.x >> shift), canvasStride,
+                {target.width >> shift, target.height >> shift},
+                target.columns[shift], target.row
+            );
+
+            source += (size_t)sourceStride * sourceSize.second;
+        }
+
+        target.dirty = true;
+        target.frames++;
+        return true;
+    }
+
+    // takes the newest frame of decoded output (older ones would be overwritten before output anyway)
+    bool submit(const int tile, const Decoder::DecodedFrame &decodedFrame) {
+        if(decodedFrame.status != Decoder::Status::OK || decodedFrame.frames == 0 || decodedFrame.output.empty()) {
+            return decodedFrame.status == Decoder::Status::OK;
+        }
+
+        const size_t frameSize = decodedFrame.output.size() / decodedFrame.frames;
+        return submit(tile, decodedFrame.output.data() + (decodedFrame.frames - 1) * frameSize, decodedFrame.imageSize);
+    }
+
+    // held capture buffer (see note for holding frames), which can be released right after
+    bool submit(const int tile, const Decoder::HeldFrame &frame, const int stride) {
+        return submit(tile, frame.data, frame.imageSize, stride);
+    }
+
+    // clears tile to black (for example when its stream is lost)
+    bool clearTile(const int tile) {
+        if(!initialized || tile < 0 || tile >= (int)tiles.size()) {
+            return false;
+        }
+
+        lock_guard<mutex> lock(tiles[tile]->tileMutex);
+        fill(*tiles[tile]);
+        tiles[tile]->dirty = true;
+        return true;
+    }
+
+    // copies canvas into frame (frames = 1)
+    bool getFrame(Decoder::DecodedFrame &frame) {
+        if(!initialized) {
+            frame.status = Decoder::Status::NOT_INITIALIZED;
+            return false;
+        }
+
+        compose([&](const CanvasFrame &canvasFrame) {
+            frame.output.assign(canvasFrame.data, canvasFrame.data + canvasFrame.size);
+            frame.imageSize = canvasFrame.imageSize;
+            frame.frames = 1;
+        });
+
+        return true;
+    }
+
+    // passes canvas to output at rate (frames per second) from an output thread, until stopOutput
+    bool startOutput(Output output, const double rate = compositorOutputRate) {
+        if(!initialized || outputThread.joinable() || rate <= 0) {
+            return false;
+        }
+
+        stopOutputThread = false;
+        outputThread = thread(&Compositor::outputLoop, this, rate, move(output));
+        return true;
+    }
+
+    void stopOutput() {
+        if(!outputThread.joinable()) {
+            return;
+        }
+
+        {
+            lock_guard<mutex> lock(outputMutex);
+            stopOutputThread = true;
+        }
+
+        outputCondition.notify_all();
+        outputThread.join();
+    }
+
+    // exports canvas as dmabuf (owned by compositor, closed on unload), -1 if it isn't possible
+    int exportCanvas() {
+        if(dmabuf >= 0 || memfd < 0) {
+            return dmabuf;
+        }
+
+        const int device = open(udmabufDev.c_str(), O_RDWR | O_CLOEXEC);
+        if(device < 0) {
+            return -1;
+        }
+
+        udmabuf_create create = {};
+        create.memfd = memfd;
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.offset = 0;
+        create.size = mappedBytes;
+
+        dmabuf = ioctl(device, UDMABUF_CREATE, &create);
+        close(device);
+        return dmabuf = dmabuf < 0 ? -1 : dmabuf;
+    }
+
+    // size of tile area, for scaling frames before submitting
+    pair<int, int> getTileSize(const int tile) {
+        if(tile < 0 || tile >= (int)tiles.size()) {
+            return {0, 0};
+        }
+
+        lock_guard<mutex> lock(tiles[tile]->tileMutex);
+        return {tiles[tile]->width, tiles[tile]->height};
+    }
+
+    pair<int, int> getCanvasSize() {
+        return canvasSize;
+    }
+
+    int getTiles() {
+        return tiles.size();
+    }
+
+    // frames submitted to a tile
+    long long getTileFrames(const int tile) {
+        if(tile < 0 || tile >= (int)tiles.size()) {
+            return 0;
+        }
+
+        lock_guard<mutex> lock(tiles[tile]->tileMutex);
+        return tiles[tile]->frames;
+    }
+
+    // canvas frames passed to output
+    long long getOutputFrames() {
+        return outputFrames;
+    }
+
+    // outputs which missed their time slot (output callback or submitting was too slow)
+    long long getLateOutputs() {
+        return lateOutputs;
+    }
+
+    void unload() {
+        stopOutput();
+
+        if(dmabuf >= 0) {
+            close(dmabuf);
+            dmabuf = -1;
+        }
+
+        if(memfd >= 0) {
+            munmap(canvas, mappedBytes);
+            close(memfd);
+            memfd = -1;
+        }
+
+        canvas = nullptr;
+        heapCanvas.clear();
+        heapCanvas.shrink_to_fit();
+        tiles.clear();
+        initialized = false;
+    }
+};
@@ -10,6 +10,7 @@
 // https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/v4l2.html
 
 #pragma once
+#include "trace.hpp"
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/videodev2.h>
@@ -22,12 +23,632 @@
 #include <cstdint>
 #include <poll.h>
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <memory>
 using namespace std;
 
 const string decoderDev = "/dev/video10"; // default decoder device path
 const int eventTimeout = 10;
+const int drainTimeout = 1000; // maximal wait for a frame while draining (ms)
 const int memoryThreshold = 25600; // minimal free ram in KiB
 const int frameMemCheck = 10; // memory check on every n-th frame
+const int decoderBufferCount = 4; // requested buffers per queue
+const int minDecoderBufferCount = 2; // buffers per queue we can shrink down to
+const int overloadLatency = 100; // decode call duration (ms) considered as overload
+const int overloadEscalate = 3; // consecutive overloaded calls before stepping a level down
+const int overloadRecover = 50; // consecutive healthy calls before stepping a level up
+
+/*
+    splits Annex-B input (passed in chunks of any size) into complete NALs
+
+    NAL is complete once the start code of the next one is found, so the last NAL
+    of each chunk is kept until more data comes (or until flush at the end of stream)
+*/
+struct NALSplitter {
+private:
+    // data after the last complete NAL (starting with start code, if hasStart)
+    vector<uint8_t> partial;
+    bool hasStart = false;
+    size_t scanned = 0; // partial is already searched for start codes up to here
+
+    // stream offset of the end of all pushed data
+    long long offset = 0;
+public:
+    /*
+        finds start code at or after start, returns its position and length ({-1, 0} if there is none)
+        memchr jumps between 0x01 bytes (vectorized by libc), which are then checked for zeros before them
+    */
+    static pair<int, int> find(const uint8_t *data, const size_t size, size_t start) {
+        size_t position = start + 2;
+
+        while(position < size) {
+            const uint8_t *one = static_cast<const uint8_t *>(memchr(data + position, 0x01, size - position));
+            if(!one) {
+                break;
+            }
+
+            position = one - data;
+            if(data[position - 1] == 0x00 && data[position - 2] == 0x00) {
+                if(position >= start + 3 && data[position - 3] == 0x00) {
+                    return {position - 3, 4};
+                }
+
+                return {position - 2, 3};
+            }
+
+            position++;
+        }
+
+        return {-1, 0};
+    }
+
+    /*
+        calls output(nal, size, startCodeLength, offset) for every complete NAL (with its start code)
+        data before the first start code is dropped
+
+        kept data is searched only once, so passing big NALs in small chunks stays linear
+    */
+    template<typename Output>
+    void push(const uint8_t *input, const size_t size, Output &&output) {
+        // stream offset of the first byte in partial
+        const long long dataOffset = offset - partial.size();
+        offset += size;
+
+        partial.insert(partial.end(), input, input + size);
+
+        // start code may begin in the last 3 already searched bytes
+        const size_t searchFrom = scanned > 3 ? scanned - 3 : 0;
+
+        pair<int, int> start;
+        if(hasStart) {
+            start = {0, partial[2] == 0x01 ? 3 : 4};
+        } else {
+            start = find(partial.data(), partial.size(), searchFrom);
+            if(start.first < 0) {
+                scanned = partial.size();
+                return;
+            }
+        }
+
+        size_t nextSearch = start.first + start.second;
+        if(hasStart && searchFrom > nextSearch) {
+            nextSearch = searchFrom;
+        }
+
+        while(true) {
+            auto next = find(partial.data(), partial.size(), nextSearch);
+            if(next.first < 0) {
+                break;
+            }
+
+            output(&partial[start.first], next.first - start.first, start.second, dataOffset + start.first);
+            start = next;
+            nextSearch = start.first + start.second;
+        }
+
+        // keep only the incomplete NAL
+        partial.erase(partial.begin(), partial.begin() + start.first);
+        hasStart = true;
+        scanned = partial.size();
+    }
+
+    // gives data kept at the end of stream as the last NAL
+    template<typename Output>
+    void flush(Output &&output) {
+        if(!partial.empty()) {
+            output(partial.data(), partial.size(), hasStart ? (partial[2] == 0x01 ? 3 : 4) : 0, offset - partial.size());
+        }
+
+        partial.clear();
+        hasStart = false;
+        scanned = 0;
+    }
+
+    // incomplete data kept for the next chunk
+    const vector<uint8_t> &getPartial() {
+        return partial;
+    }
+
+    // stream offset of the end of all pushed data
+    long long getOffset() {
+        return offset;
+    }
+
+    // continues splitting from stream offset, with previously kept data
+    void restore(const long long streamOffset, const vector<uint8_t> &kept = {}) {
+        partial = kept;
+        offset = streamOffset;
+        hasStart = find(partial.data(), partial.size(), 0).first == 0; // kept NAL keeps its start code on flush
+        scanned = 0;
+    }
+
+    void reset() {
+        restore(0);
+    }
+};
+
+// compressed formats decoder can be initialized with
+enum class Codec {
+    H264,
+    HEVC,
+    MJPEG,
+    VP8, // in IVF container
+    VP9, // in IVF container
+    FWHT // vicodec test driver format
+};
+
+/*
+    note for framing:
+
+    Framer splits input of a codec (passed in chunks of any size) into units for the device
+    H.264 and HEVC are split into NALs (Annex-B, with start codes), which are joined in device buffers,
+    other codecs are split into whole frames, and each frame is passed in its own buffer
+
+    output(unit, size, startCodeLength, offset) is called for every complete unit,
+    startCodeLength is 0 for frames (container headers are already stripped)
+*/
+class Framer {
+public:
+    using Output = function<void(const uint8_t *unit, size_t size, int startCode, long long offset)>;
+
+    virtual ~Framer() = default;
+
+    virtual void push(const uint8_t *input, const size_t size, const Output &output) = 0;
+
+    // gives data kept at the end of stream (incomplete frames are dropped)
+    virtual void flush(const Output &output) = 0;
+
+    // incomplete data kept for the next chunk
+    virtual const vector<uint8_t> &getPartial() = 0;
+
+    // stream offset of the end of all pushed data
+    virtual long long getOffset() = 0;
+
+    // continues splitting from stream offset, with previously kept data
+    virtual void restore(const long long streamOffset, const vector<uint8_t> &kept) = 0;
+
+    void reset() {
+        restore(0, {});
+    }
+
+    // units are NALs, not whole frames
+    virtual bool annexB() {
+        return false;
+    }
+
+    static unique_ptr<Framer> create(const Codec codec);
+};
+
+// H.264 and HEVC (Annex-B byte stream)
+class AnnexBFramer : public Framer {
+private:
+    NALSplitter splitter;
+public:
+    void push(const uint8_t *input, const size_t size, const Output &output) override {
+        splitter.push(input, size, output);
+    }
+
+    void flush(const Output &output) override {
+        splitter.flush(output);
+    }
+
+    const vector<uint8_t> &getPartial() override {
+        return splitter.getPartial();
+    }
+
+    long long getOffset() override {
+        return splitter.getOffset();
+    }
+
+    void restore(const long long streamOffset, const vector<uint8_t> &kept) override {
+        splitter.restore(streamOffset, kept);
+    }
+
+    bool annexB() override {
+        return true;
+    }
+};
+
+// base of framers for codecs where each frame is a separate unit
+class FrameFramer : public Framer {
+protected:
+    vector<uint8_t> partial;
+    long long offset = 0;
+
+    /*
+        length of the frame at the beginning of data (with its header, which has headerLength bytes),
+        0 if more data is needed, negative count of bytes to skip if data doesn't start with a frame
+    */
+    virtual long long frameLength(const uint8_t *data, const size_t size, int &headerLength) = 0;
+
+    // frame parsing state is reset (framer continues from another position)
+    virtual void resetFrame() {}
+
+    static uint32_t readBigEndian(const uint8_t *data) {
+        return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+    }
+
+    static uint32_t readLittleEndian(const uint8_t *data, const int bytes) {
+        uint32_t value = 0;
+        for(int i = bytes - 1; i >= 0; i--) {
+            value = value << 8 | data[i];
+        }
+
+        return value;
+    }
+public:
+    void push(const uint8_t *input, const size_t size, const Output &output) override {
+        const long long dataOffset = offset - partial.size();
+        offset += size;
+
+        partial.insert(partial.end(), input, input + size);
+
+        size_t position = 0;
+        while(position < partial.size()) {
+            int headerLength = 0;
+            const long long length = frameLength(partial.data() + position, partial.size() - position, headerLength);
+
+            if(length == 0) {
+                break;
+            }
+
+            if(length < 0) {
+                position += -length;
+                continue;
+            }
+
+            output(partial.data() + position + headerLength, length - headerLength, 0, dataOffset + position + headerLength);
+            position += length;
+        }
+
+        partial.erase(partial.begin(), partial.begin() + min(position, partial.size()));
+    }
+
+    void flush(const Output &) override {
+        partial.clear();
+        resetFrame();
+    }
+
+    const vector<uint8_t> &getPartial() override {
+        return partial;
+    }
+
+    long long getOffset() override {
+        return offset;
+    }
+
+    void restore(const long long streamOffset, const vector<uint8_t> &kept) override {
+        partial = kept;
+        offset = streamOffset;
+        resetFrame();
+    }
+};
+
+// JPEG frames (SOI to EOI, segments are followed so embedded thumbnails don't end a frame)
+class JPEGFramer : public FrameFramer {
+private:
+    // scanning state of the incomplete frame
+    size_t position = 0;
+    bool entropyData = false;
+protected:
+    long long frameLength(const uint8_t *data, const size_t size, int &headerLength) override {
+        if(size < 2) {
+            return 0;
+        }
+
+        // skip to the next SOI (last byte may be start of it)
+        if(data[0] != 0xFF || data[1] != 0xD8) {
+            const uint8_t *marker = static_cast<const uint8_t *>(memchr(data + 1, 0xFF, size - 1));
+            return marker ? -(marker - data) : -(long long)size;
+        }
+
+        if(position < 2) {
+            position = 2;
+            entropyData = false;
+        }
+
+        while(position + 1 < size) {
+            if(entropyData) {
+                // entropy coded data ends with a marker, other than stuffed byte (FF 00) or restart marker
+                const uint8_t *marker = static_cast<const uint8_t *>(memchr(data + position, 0xFF, size - position));
+                if(!marker) {
+                    position = size;
+                    break;
+                }
+
+                position = marker - data;
+                if(position + 1 >= size) {
+                    break;
+                }
+
+                const uint8_t next = data[position + 1];
+                if(next == 0x00 || (next >= 0xD0 && next <= 0xD7)) {
+                    position += 2;
+                    continue;
+                }
+
+                entropyData = false;
+                continue;
+            }
+
+            if(data[position] != 0xFF) {
+                // corrupted segment, look for the next marker
+                entropyData = true;
+                continue;
+            }
+
+            const uint8_t marker = data[position + 1];
+            if(marker == 0xFF) {
+                // fill byte
+                position++;
+            } else if(marker == 0xD9) {
+                // EOI
+                const long long length = position + 2;
+                resetFrame();
+                headerLength = 0;
+                return length;
+            } else if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+                // markers without segment
+                position += 2;
+            } else {
+                if(position + 3 >= size) {
+                    break;
+                }
+
+                // entropy coded data follows SOS segment
+                entropyData = marker == 0xDA;
+                position += 2 + (data[position + 2] << 8 | data[position + 3]);
+            }
+        }
+
+        return 0;
+    }
+
+    void resetFrame() override {
+        position = 0;
+        entropyData = false;
+    }
+};
+
+// IVF container (VP8, VP9), 32 byte file header and 12 byte header of every frame
+class IVFFramer : public FrameFramer {
+protected:
+    long long frameLength(const uint8_t *data, const size_t size, int &headerLength) override {
+        if(size < 12) {
+            return 0;
+        }
+
+        // file header is skipped once it is complete
+        if(memcmp(data, "DKIF", 4) == 0) {
+            const long long fileHeader = max<uint32_t>(readLittleEndian(data + 6, 2), 32);
+            return fileHeader <= (long long)size ? -fileHeader : 0;
+        }
+
+        headerLength = 12;
+        const long long length = 12 + (long long)readLittleEndian(data, 4);
+        return length <= (long long)size ? length : 0;
+    }
+};
+
+// vicodec FWHT frames, each starts with a header (magic and big-endian fields, the last is payload size)
+class FWHTFramer : public FrameFramer {
+private:
+    static constexpr uint8_t magic[8] = {0x4F, 0x4F, 0x4F, 0x4F, 0xFF, 0xFF, 0xFF, 0xFF};
+    static const int headerSize = 44;
+protected:
+    long long frameLength(const uint8_t *data, const size_t size, int &headerLength) override {
+        if(size < headerSize) {
+            return 0;
+        }
+
+        if(memcmp(data, magic, sizeof(magic)) != 0) {
+            const uint8_t *next = static_cast<const uint8_t *>(memchr(data + 1, magic[0], size - 1));
+            return next ? -(next - data) : -(long long)size;
+        }
+
+        // header is passed to device as a part of the frame
+        headerLength = 0;
+        const long long length = headerSize + (long long)readBigEndian(data + headerSize - 4);
+        return length <= (long long)size ? length : 0;
+    }
+};
+
+inline unique_ptr<Framer> Framer::create(const Codec codec) {
+    switch(codec) {
+        case Codec::H264:
+        case Codec::HEVC:
+            return unique_ptr<Framer>(new AnnexBFramer());
+        case Codec::MJPEG:
+            return unique_ptr<Framer>(new JPEGFramer());
+        case Codec::VP8:
+        case Codec::VP9:
+            return unique_ptr<Framer>(new IVFFramer());
+        case Codec::FWHT:
+            return unique_ptr<Framer>(new FWHTFramer());
+    }
+
+    return nullptr;
+}
+
+/*
+    note for NAL types:
+
+    H.264 has 1 byte NAL header (type in 5 low bits, nal_ref_idc in bits 5 - 6),
+    HEVC has 2 byte header (type in bits 1 - 6 of the first byte, then layer and temporal id)
+
+    in HEVC, IRAP pictures (types 16 - 23: BLA, IDR and CRA) are keyframes, and even types
+    below 16 are sub-layer non-reference pictures (no other frame of the same sub-layer references them)
+    RASL pictures (types 8 and 9) which follow a CRA in decode order reference frames before it,
+    so they can't be decoded when decoding starts at that CRA
+*/
+
+// properties of a NAL needed for filtering and access unit assembly, parsed from its header
+struct NALHeader {
+    int type = -1;
+    bool slice = false; // coded slice of a picture
+    bool firstSlice = false; // first slice of a picture (starts a new frame)
+    bool keyframe = false; // IDR in H.264, IRAP in HEVC
+    bool openGOP = false; // keyframe which can be followed by undecodable leading pictures (HEVC CRA, BLA)
+    bool leading = false; // HEVC RASL
+    bool reference = false; // other frames may reference the picture
+    bool prefix = false; // starts a new access unit if it follows a slice
+    bool sei = false;
+    bool vps = false;
+    bool sps = false;
+    bool pps = false;
+
+    // nal starts at NAL header (after start code), only H.264 and HEVC are parsed
+    static NALHeader parse(const Codec codec, const uint8_t *nal, const size_t size) {
+        NALHeader header;
+
+        if(codec == Codec::H264 && size >= 1) {
+            const int type = nal[0] & 0x1F;
+
+            header.type = type;
+            header.slice = type == 1 || type == 5;
+            header.firstSlice = header.slice && size > 1 && (nal[1] & 0x80); // first_mb_in_slice = 0 (ue(v) coded as single 1 bit)
+            header.keyframe = type == 5;
+            header.reference = (nal[0] & 0x60) != 0;
+            header.prefix = type == 9 || type == 7 || type == 8 || type == 6 || (type >= 14 && type <= 18);
+            header.sei = type == 6;
+            header.sps = type == 7;
+            header.pps = type == 8;
+        } else if(codec == Codec::HEVC && size >= 2) {
+            const int type = (nal[0] >> 1) & 0x3F;
+
+            header.type = type;
+            header.slice = type <= 31;
+            header.firstSlice = header.slice && size > 2 && (nal[2] & 0x80); // first_slice_segment_in_pic_flag
+            header.keyframe = type >= 16 && type <= 23;
+            header.openGOP = (type >= 16 && type <= 18) || type == 21;
+            header.leading = type == 8 || type == 9;
+            header.reference = header.slice && !(type <= 14 && type % 2 == 0);
+            header.prefix = (type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+            header.sei = type == 39 || type == 40;
+            header.vps = type == 32;
+            header.sps = type == 33;
+            header.pps = type == 34;
+        }
+
+        return header;
+    }
+};
+
+// access unit (all NALs of a single frame) in Annex-B form
+struct AccessUnit {
+    vector<uint8_t> data;
+
+    // stream offset of the first byte (-1 if unknown)
+    long long offset = -1;
+
+    // contains IDR (H.264) or IRAP (HEVC) slice
+    bool keyframe = false;
+
+    // other frames may reference it (nal_ref_idc of slices isn't 0 in H.264, it isn't a sub-layer non-reference picture in HEVC)
+    bool reference = false;
+
+    // contains SPS and PPS (and VPS in HEVC), so a keyframe with them can be decoded on its own
+    bool parameterSets = false;
+};
+
+/*
+    groups NALs into access units (H.264 specification 7.4.1.2.3, HEVC specification 7.4.2.4.4)
+
+    AU ends before a NAL which can only start an AU (access unit delimiter, parameter sets, prefix SEI
+    and some reserved types) that follows a slice, or before the first slice of a picture
+    (first_mb_in_slice = 0 in H.264, first_slice_segment_in_pic_flag in HEVC)
+
+    parameter sets of completed AUs are kept, so a keyframe of a stream which sends them only once
+    (for example rpicam-vid without --inline) can be made decodable on its own (getParameterSets)
+*/
+struct AccessUnitAssembler {
+private:
+    Codec codec;
+    AccessUnit current;
+    bool hasSlice = false;
+
+    // parameter sets (with start codes) of completed AUs, and of the one being assembled
+    vector<uint8_t> lastVPS, lastSPS, lastPPS;
+    vector<uint8_t> unitVPS, unitSPS, unitPPS;
+
+    static int headerPosition(const uint8_t *nal, const size_t size) {
+        size_t position = 0;
+        while(position < size && nal[position] == 0x00) {
+            position++;
+        }
+
+        return (position < size && nal[position] == 0x01) ? position + 1 : -1;
+    }
+public:
+    AccessUnitAssembler(const Codec streamCodec = Codec::H264) : codec(streamCodec) {}
+
+    // adds NAL (with start code), returns true if it completed previous AU (stored to completed)
+    bool push(const uint8_t *nal, const size_t size, const long long offset, AccessUnit &completed) {
+        const int header = headerPosition(nal, size);
+        bool finished = false;
+
+        if(header >= 0 && (size_t)header < size) {
+            const NALHeader nalHeader = NALHeader::parse(codec, nal + header, size - header);
+
+            if(hasSlice && (nalHeader.prefix || nalHeader.firstSlice)) {
+                finished = flush(completed);
+            }
+
+            if(nalHeader.slice) {
+                hasSlice = true;
+                current.keyframe |= nalHeader.keyframe;
+                current.reference |= nalHeader.reference;
+            } else if(nalHeader.vps || nalHeader.sps || nalHeader.pps) {
+                vector<uint8_t> &parameterSet = nalHeader.vps ? unitVPS : nalHeader.sps ? unitSPS : unitPPS;
+                parameterSet.assign(nal, nal + size);
+            }
+        }
+
+        if(current.data.empty()) {
+            current.offset = offset;
+        }
+
+        current.data.insert(current.data.end(), nal, nal + size);
+        return finished;
+    }
+
+    // gives the AU being assembled (at the end of stream), returns false if it is empty
+    bool flush(AccessUnit &completed) {
+        if(current.data.empty()) {
+            return false;
+        }
+
+        current.parameterSets = !unitSPS.empty() && !unitPPS.empty() && (codec != Codec::HEVC || !unitVPS.empty());
+
+        // parameter sets of this AU become the latest ones
+        if(!unitVPS.empty()) lastVPS.swap(unitVPS);
+        if(!unitSPS.empty()) lastSPS.swap(unitSPS);
+        if(!unitPPS.empty()) lastPPS.swap(unitPPS);
+        unitVPS.clear();
+        unitSPS.clear();
+        unitPPS.clear();
+
+        completed = move(current);
+        current = AccessUnit();
+        hasSlice = false;
+        return true;
+    }
+
+    // the latest parameter sets of completed AUs (VPS, SPS and PPS with start codes), empty until both SPS and PPS were seen
+    vector<uint8_t> getParameterSets() {
+        if(lastSPS.empty() || lastPPS.empty()) {
+            return {};
+        }
+
+        vector<uint8_t> parameterSets = lastVPS;
+        parameterSets.insert(parameterSets.end(), lastSPS.begin(), lastSPS.end());
+        parameterSets.insert(parameterSets.end(), lastPPS.begin(), lastPPS.end());
+        return parameterSets;
+    }
+};
 
 struct Decoder {
     enum class InitStatus {
@@ -45,6 +666,125 @@ struct Decoder {
         FAILED
     };
 
+    // degradation levels of overload controller, from least to most degraded
+    enum class OverloadLevel {
+        NORMAL,
+        DROP_NON_REFERENCE,
+        KEYFRAMES_ONLY,
+        PAUSED
+    };
+
+    /*
+        parser state for checkpointed processing
+
+        it can be serialized, stored, and later restored in new decoder to resume decoding
+        from the last IDR before checkpoint (input needs to be seeked to resumeOffset)
+    */
+    struct ParserState {
+        // incomplete NAL kept at checkpoint
+        vector<uint8_t> partial;
+
+        // parameter sets active at last keyframe, with start codes (for HEVC, sps also holds VPS)
+        vector<uint8_t> sps;
+        vector<uint8_t> pps;
+
+        // input bytes consumed and frames parsed
+        long long byteOffset = 0;
+        long long frameCount = 0;
+
+        // input offset and frame number of last IDR (-1 if there was no IDR yet)
+        long long keyframeOffset = -1;
+        long long keyframeFrame = -1;
+
+        long long resumeOffset() const {
+            return keyframeOffset < 0 ? 0 : keyframeOffset;
+        }
+
+        vector<uint8_t> serialize() const {
+            vector<uint8_t> output = {'V', '4', 'P', 'S'};
+
+            appendInteger(output, parserStateVersion);
+            appendInteger(output, byteOffset);
+            appendInteger(output, frameCount);
+            appendInteger(output, keyframeOffset);
+            appendInteger(output, keyframeFrame);
+            appendBytes(output, partial);
+            appendBytes(output, sps);
+            appendBytes(output, pps);
+
+            return output;
+        }
+
+        bool deserialize(const vector<uint8_t> &input) {
+            size_t position = 4;
+            long long version;
+
+            if(input.size() < 4 || memcmp(input.data(), "V4PS", 4) != 0) {
+                return false;
+            }
+
+            ParserState state;
+            if(
+                !readInteger(input, position, version) || version != parserStateVersion ||
+                !readInteger(input, position, state.byteOffset) ||
+                !readInteger(input, position, state.frameCount) ||
+                !readInteger(input, position, state.keyframeOffset) ||
+                !readInteger(input, position, state.keyframeFrame) ||
+                !readBytes(input, position, state.partial) ||
+                !readBytes(input, position, state.sps) ||
+                !readBytes(input, position, state.pps)
+            ) {
+                return false;
+            }
+
+            *this = move(state);
+            return true;
+        }
+    private:
+        static const long long parserStateVersion = 1;
+
+        // integers are stored as 8 bytes little endian
+        static void appendInteger(vector<uint8_t> &output, long long value) {
+            for(int i = 0; i < 8; i++) {
+                output.push_back((unsigned long long)value >> (i * 8));
+            }
+        }
+
+        static void appendBytes(vector<uint8_t> &output, const vector<uint8_t> &bytes) {
+            appendInteger(output, bytes.size());
+            output.insert(output.end(), bytes.begin(), bytes.end());
+        }
+
+        static bool readInteger(const vector<uint8_t> &input, size_t &position, long long &value) {
+            if(input.size() - position < 8) {
+                return false;
+            }
+
+            unsigned long long result = 0;
+            for(int i = 0; i < 8; i++) {
+                result |= (unsigned long long)input[position + i] << (i * 8);
+            }
+
+            position += 8;
+            value = result;
+            return true;
+        }
+
+        static bool readBytes(const vector<uint8_t> &input, size_t &position, vector<uint8_t> &bytes) {
+            long long size;
+            if(!readInteger(input, position, size) || size < 0 || input.size() - position < (size_t)size) {
+                return false;
+            }
+
+            bytes.assign(input.begin() + position, input.begin() + position + size);
+            position += size;
+            return true;
+        }
+    };
+
+    // receives every complete NAL (including start code) in input order, before any filtering
+    using NALObserver = function<void(const uint8_t *nal, size_t size, long long offset)>;
+
     struct DecodedFrame {
         // decode status
         Status status = Status::OK;
@@ -54,34 +794,81 @@ struct Decoder {
 
         // provided output size
         pair<int, int> imageSize;
+
+        // number of frames stored in output (each takes output.size() / frames bytes)
+        int frames = 0;
+
+        // field layout (V4L2_FIELD_*) of each frame, see note for interlaced video
+        vector<uint32_t> fields;
     };
 private:
     struct MemoryBuffer {
         vector<void *> start;
         vector<v4l2_plane> planes;
+        vector<int> dmabuf; // exported planes (empty if not exported)
+        uint32_t field = V4L2_FIELD_NONE; // of the decoded frame
     };
 
     int memoryLimit; // in KiB
     int memoryFrame = frameMemCheck;
 
+    // device (CMA) memory held by mapped planes, in bytes
+    long long deviceMemory = 0;
+    inline static atomic<long long> totalDeviceMemory{0};
+
     // decoder variables
     int decoder;
     bool decoderInitialized = false;
     bool decodeStreamStarted = false;
+    bool drainStarted = false; // stop command is sent (or isn't supported)
+    bool drainCommand = false; // device marks the last buffer
+    bool drainFinished = false; // buffer marked as last is dequeued
     
     vector<MemoryBuffer> decoderOutputBuffer;
     vector<MemoryBuffer> decoderInputBuffer;
     
     pair<int, int> decoderOutputSize;
-    vector<uint8_t> partData;
-
-    bool waitEvent(int fd, short events) {
+    int decoderOutputStride = 0; // bytes per line of luma plane in capture buffers
+    uint32_t decoderOutputField = V4L2_FIELD_NONE; // negotiated field of capture format
+
+    Codec codec = Codec::H264;
+    unique_ptr<Framer> framer = Framer::create(Codec::H264);
+
+    // overload controller
+    bool overloadControl = false;
+    OverloadLevel overloadLevel = OverloadLevel::NORMAL;
+    int overloadStreak = 0;
+    int healthyStreak = 0;
+    bool waitKeyframe = false;
+    bool skipLeading = false; // decoding started at HEVC CRA, so its RASL pictures are dropped
+    bool keyframesOnly = false;
+
+    // parser state tracking (for checkpoints)
+    ParserState parserState;
+    vector<uint8_t> lastVPS;
+    vector<uint8_t> lastSPS;
+    vector<uint8_t> lastPPS;
+    vector<uint8_t> resumeHeaders;
+
+    // data passed to device, kept between calls to avoid allocating for every chunk
+    vector<uint8_t> feedData;
+    vector<size_t> feedUnits; // ends of frames in feedData (each frame goes to its own buffer), empty for NALs
+    vector<uint8_t> carryData; // NALs which didn't fit into input queue (with overload control), passed first in the next call
+
+    vector<NALObserver> nalObservers;
+
+    // capture buffers held by the caller instead of copying (see note for holding frames)
+    bool holdFrames = false;
+    deque<int> heldFrames; // decoded, not taken yet
+    vector<bool> bufferHeld;
+
+    bool waitEvent(int fd, short events, int timeout = eventTimeout) {
         pollfd descriptor;
         descriptor.fd = fd;
         descriptor.events = events;
         descriptor.revents = 0;
 
-        int ret = poll(&descriptor, 1, eventTimeout);
+        int ret = TRACE_CALL("poll", poll(&descriptor, 1, timeout));
         if(ret <= 0) {
             // poll timeout or fail
             return false;
@@ -104,7 +891,8 @@ private:
     void munmapBuffers(vector<MemoryBuffer> &output) {
         for(const auto &buffer : output) {
             for(int j = 0; j < buffer.start.size(); j++) {
-                if(buffer.start[j] != MAP_FAILED) {
+                // planes after a failed one aren't mapped
+                if(buffer.start[j] && buffer.start[j] != MAP_FAILED) {
                     munmap(buffer.start[j], buffer.planes[j].length);
                 }
             }
@@ -148,9 +936,13 @@ private:
             output[i].start.resize(planes);
 
             for(int j = 0; j < planes; j++) {
+                deviceMemory += buffer.m.planes[j].length;
+                totalDeviceMemory += buffer.m.planes[j].length;
+
                 output[i].start[j] = mmap(nullptr, buffer.m.planes[j].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.planes[j].m.mem_offset);
                 if(output[i].start[j] == MAP_FAILED) {
                     munmapBuffers(output);
+                    output.clear();
                     return InitStatus::FAILED;
                 }
             }
@@ -179,6 +971,32 @@ private:
         return -1;
     }
 
+    // expected device memory for a queue, from the plane sizes the driver reported on S_FMT
+    long long formatMemory(const v4l2_format &format, const int bufferCount) {
+        long long size = 0;
+        for(int j = 0; j < format.fmt.pix_mp.num_planes; j++) {
+            size += format.fmt.pix_mp.plane_fmt[j].sizeimage;
+        }
+
+        return size * bufferCount;
+    }
+
+    void releaseDeviceMemory() {
+        totalDeviceMemory -= deviceMemory;
+        deviceMemory = 0;
+    }
+
+    // undoes buffer setup of initialization which failed, and closes device
+    InitStatus abortInitialization(const InitStatus status) {
+        munmapBuffers(decoderInputBuffer);
+        munmapBuffers(decoderOutputBuffer);
+        decoderInputBuffer.clear();
+        decoderOutputBuffer.clear();
+        releaseDeviceMemory();
+        close(decoder);
+        return status;
+    }
+
     int getFreeMemory() {
         ifstream status("/proc/meminfo");
         if(!status) return -1;
@@ -206,6 +1024,8 @@ private:
             return true;
         }
 
+        TRACE_SCOPE("memory_check");
+
         if(memoryLimit == -1) {
             if(getFreeMemory() >= memoryThreshold) {
                 return true;
@@ -226,6 +1046,279 @@ private:
         }
     }
 
+    // V4L2 format of compressed input
+    static uint32_t pixelFormat(const Codec inputCodec) {
+        switch(inputCodec) {
+            case Codec::HEVC: return V4L2_PIX_FMT_HEVC;
+            case Codec::MJPEG: return V4L2_PIX_FMT_MJPEG;
+            case Codec::VP8: return V4L2_PIX_FMT_VP8;
+            case Codec::VP9: return V4L2_PIX_FMT_VP9;
+            case Codec::FWHT: return V4L2_PIX_FMT_FWHT;
+            default: return V4L2_PIX_FMT_H264;
+        }
+    }
+
+    // decides if NAL is passed to decoder, depending on current overload level
+    bool keepNAL(const NALHeader &header) {
+        // SEI is never needed for decoding
+        if(header.sei) {
+            return false;
+        }
+
+        if(!header.slice) {
+            return true;
+        }
+
+        if(overloadLevel == OverloadLevel::PAUSED) {
+            return false;
+        }
+
+        if(header.keyframe) {
+            // leading pictures of a CRA reference frames which were skipped
+            if(header.firstSlice) {
+                skipLeading = waitKeyframe && header.openGOP;
+            }
+
+            waitKeyframe = false;
+            return true;
+        }
+
+        // after keyframes only or pause, P frames are broken until next keyframe
+        if(waitKeyframe || keyframesOnly || overloadLevel == OverloadLevel::KEYFRAMES_ONLY) {
+            return false;
+        }
+
+        if(skipLeading && header.leading) {
+            return false;
+        }
+
+        if(overloadLevel == OverloadLevel::DROP_NON_REFERENCE && !header.reference) {
+            return false;
+        }
+
+        return true;
+    }
+
+    // steps through overload levels with hysteresis
+    void updateOverload(const bool overloaded) {
+        if(!overloadControl) {
+            return;
+        }
+
+        if(overloaded) {
+            healthyStreak = 0;
+            if(++overloadStreak >= overloadEscalate && overloadLevel != OverloadLevel::PAUSED) {
+                overloadLevel = static_cast<OverloadLevel>(static_cast<int>(overloadLevel) + 1);
+                overloadStreak = 0;
+            }
+        } else {
+            overloadStreak = 0;
+            if(++healthyStreak >= overloadRecover && overloadLevel != OverloadLevel::NORMAL) {
+                if(overloadLevel >= OverloadLevel::KEYFRAMES_ONLY) {
+                    waitKeyframe = true;
+                }
+
+                overloadLevel = static_cast<OverloadLevel>(static_cast<int>(overloadLevel) - 1);
+                healthyStreak = 0;
+            }
+        }
+    }
+
+    // reads bits of RBSP (NAL payload without emulation prevention bytes)
+    struct BitReader {
+        vector<uint8_t> data;
+        size_t position = 0;
+
+        BitReader(const uint8_t *nal, const size_t size) {
+            for(size_t i = 0; i < size; i++) {
+                if(i >= 2 && nal[i] == 0x03 && nal[i - 1] == 0x00 && nal[i - 2] == 0x00) {
+                    continue;
+                }
+
+                data.push_back(nal[i]);
+            }
+        }
+
+        bool overflow() {
+            return position > data.size() * 8;
+        }
+
+        unsigned int bits(const int count) {
+            unsigned int value = 0;
+            for(int i = 0; i < count; i++) {
+                value <<= 1;
+                if(position < data.size() * 8) {
+                    value |= (data[position / 8] >> (7 - position % 8)) & 1;
+                }
+                position++;
+            }
+
+            return value;
+        }
+
+        // exp-golomb codes
+        unsigned int ue() {
+            int zeros = 0;
+            while(bits(1) == 0) {
+                if(++zeros > 31 || overflow()) return 0;
+            }
+
+            return ((1u << zeros) - 1) + bits(zeros);
+        }
+
+        int se() {
+            const unsigned int value = ue();
+            return (value & 1) ? (int)((value + 1) / 2) : -(int)(value / 2);
+        }
+    };
+
+    // parses H.264 SPS (starting at NAL header) for cropped image size
+    static bool parseSPSSize(const uint8_t *nal, const size_t size, pair<int, int> &imageSize) {
+        BitReader reader(nal + 1, size - 1);
+
+        const int profile = reader.bits(8);
+        reader.bits(16); // constraint flags and level
+        reader.ue(); // seq_parameter_set_id
+
+        int chromaFormat = 1;
+        if(
+            profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+            profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+            profile == 139 || profile == 134 || profile == 135
+        ) {
+            chromaFormat = reader.ue();
+            if(chromaFormat == 3) {
+                reader.bits(1); // separate_colour_plane_flag
+            }
+
+            reader.ue(); // bit_depth_luma_minus8
+            reader.ue(); // bit_depth_chroma_minus8
+            reader.bits(1); // qpprime_y_zero_transform_bypass_flag
+
+            if(reader.bits(1)) {
+                // skip scaling lists
+                for(int i = 0; i < (chromaFormat != 3 ? 8 : 12); i++) {
+                    if(!reader.bits(1)) continue;
+
+                    int lastScale = 8, nextScale = 8;
+                    for(int j = 0; j < (i < 6 ? 16 : 64) && nextScale != 0; j++) {
+                        nextScale = (lastScale + reader.se() + 256) % 256;
+                        lastScale = nextScale == 0 ? lastScale : nextScale;
+                    }
+                }
+            }
+        }
+
+        reader.ue(); // log2_max_frame_num_minus4
+
+        const int pocType = reader.ue();
+        if(pocType == 0) {
+            reader.ue(); // log2_max_pic_order_cnt_lsb_minus4
+        } else if(pocType == 1) {
+            reader.bits(1);
+            reader.se();
+            reader.se();
+
+            const int cycle = reader.ue();
+            for(int i = 0; i < cycle && !reader.overflow(); i++) {
+                reader.se();
+            }
+        }
+
+        reader.ue(); // max_num_ref_frames
+        reader.bits(1); // gaps_in_frame_num_value_allowed_flag
+
+        const int widthMbs = reader.ue() + 1;
+        const int heightMapUnits = reader.ue() + 1;
+        const int frameMbsOnly = reader.bits(1);
+
+        if(!frameMbsOnly) {
+            reader.bits(1); // mb_adaptive_frame_field_flag
+        }
+        reader.bits(1); // direct_8x8_inference_flag
+
+        int width = widthMbs * 16;
+        int height = (2 - frameMbsOnly) * heightMapUnits * 16;
+
+        if(reader.bits(1)) {
+            const int left = reader.ue(), right = reader.ue(), top = reader.ue(), bottom = reader.ue();
+            const int cropX = (chromaFormat == 1 || chromaFormat == 2) ? 2 : 1;
+            const int cropY = (chromaFormat == 1 ? 2 : 1) * (2 - frameMbsOnly);
+
+            width -= (left + right) * cropX;
+            height -= (top + bottom) * cropY;
+        }
+
+        if(reader.overflow() || width <= 0 || height <= 0) {
+            return false;
+        }
+
+        imageSize = {width, height};
+        return true;
+    }
+
+    // parses HEVC SPS (starting at NAL header) for cropped image size
+    static bool parseHEVCSPSSize(const uint8_t *nal, const size_t size, pair<int, int> &imageSize) {
+        BitReader reader(nal + 2, size - 2);
+
+        reader.bits(4); // sps_video_parameter_set_id
+        const int subLayers = reader.bits(3); // sps_max_sub_layers_minus1
+        reader.bits(1); // sps_temporal_id_nesting_flag
+
+        // profile_tier_level: general profile (88 bits) and level (8 bits), then sub-layer ones
+        reader.bits(32);
+        reader.bits(32);
+        reader.bits(32);
+
+        vector<pair<bool, bool>> subLayerPresent(subLayers);
+        for(auto &present : subLayerPresent) {
+            present.first = reader.bits(1);
+            present.second = reader.bits(1);
+        }
+
+        if(subLayers > 0) {
+            reader.bits(2 * (8 - subLayers)); // reserved_zero_2bits
+        }
+
+        for(const auto &present : subLayerPresent) {
+            if(present.first) {
+                reader.bits(32);
+                reader.bits(32);
+                reader.bits(24);
+            }
+
+            if(present.second) {
+                reader.bits(8);
+            }
+        }
+
+        reader.ue(); // sps_seq_parameter_set_id
+
+        const int chromaFormat = reader.ue();
+        if(chromaFormat == 3) {
+            reader.bits(1); // separate_colour_plane_flag
+        }
+
+        int width = reader.ue();
+        int height = reader.ue();
+
+        if(reader.bits(1)) {
+            const int left = reader.ue(), right = reader.ue(), top = reader.ue(), bottom = reader.ue();
+            const int cropX = (chromaFormat == 1 || chromaFormat == 2) ? 2 : 1;
+            const int cropY = chromaFormat == 1 ? 2 : 1;
+
+            width -= (left + right) * cropX;
+            height -= (top + bottom) * cropY;
+        }
+
+        if(reader.overflow() || width <= 0 || height <= 0) {
+            return false;
+        }
+
+        imageSize = {width, height};
+        return true;
+    }
+
     int min(int a, int b) {
         if(a < b) {
             return a;
@@ -234,57 +1327,225 @@ private:
         }
     }
 
-    pair<int, int> findNAL(const vector<uint8_t> &data, int start) {
-        for(; start + 2 < data.size(); start++) {
-            if(data[start] == 0x00 && data[start + 1] == 0x00) {
-                if(data[start + 2] == 0x01) {
-                    return {start, 3};
-                } else if(start < data.size() - 3 && data[start + 2] == 0x00 && data[start + 3] == 0x01) {
-                    return {start, 4};
+    // records parameter sets, frames and keyframe position of complete NAL (nal includes start code)
+    void trackNAL(const uint8_t *nal, const int size, const NALHeader &header, const long long offset) {
+        if(header.vps) {
+            lastVPS.assign(nal, nal + size);
+        } else if(header.sps) {
+            // in HEVC, SPS is stored together with VPS it refers to
+            lastSPS = lastVPS;
+            lastSPS.insert(lastSPS.end(), nal, nal + size);
+        } else if(header.pps) {
+            lastPPS.assign(nal, nal + size);
+        } else if(header.firstSlice) {
+            if(header.keyframe) {
+                parserState.keyframeOffset = offset;
+                parserState.keyframeFrame = parserState.frameCount;
+                parserState.sps = lastSPS;
+                parserState.pps = lastPPS;
+            }
+
+            parserState.frameCount++;
+        }
+    }
+
+    // handles complete NAL from framer: tracks it, reports it, and passes it to device unless filtered
+    void handleNAL(const uint8_t *nal, const size_t size, const int startCode, const long long offset) {
+        const NALHeader header = NALHeader::parse(codec, nal + startCode, size - startCode);
+
+        if(size > (size_t)startCode) {
+            if(startCode > 0) {
+                trackNAL(nal, size, header, offset);
+            }
+
+            for(const NALObserver &observer : nalObservers) {
+                observer(nal, size, offset);
+            }
+        }
+
+        if(startCode == 0 || header.type < 0 || keepNAL(header)) {
+            feedData.insert(feedData.end(), nal, nal + size);
+        }
+    }
+
+    // handles complete frame from framer (codecs which aren't split into NALs)
+    void handleFrame(const uint8_t *frame, const size_t size, const long long offset) {
+        for(const NALObserver &observer : nalObservers) {
+            observer(frame, size, offset);
+        }
+
+        feedData.insert(feedData.end(), frame, frame + size);
+        feedUnits.push_back(feedData.size());
+    }
+
+    // TODO: for blocking mode do SPS/PPS/IDR
+    vector<uint8_t> &parseNAL(const char *input, const size_t size, const bool lastData) {
+        TRACE_SCOPE("parse");
+        feedData.clear();
+        feedUnits.clear();
+
+        // rest of the previous call goes first, so the device gets whole NALs
+        feedData.swap(carryData);
+
+        const Framer::Output output = [this](const uint8_t *unit, size_t unitSize, int startCode, long long offset) {
+            if(framer->annexB()) {
+                handleNAL(unit, unitSize, startCode, offset);
+            } else {
+                handleFrame(unit, unitSize, offset);
+            }
+        };
+
+        framer->push(reinterpret_cast<const uint8_t *>(input), size, output);
+
+        // last NAL has no following start code, so it is flushed at the end of stream
+        if(lastData) {
+            framer->flush(output);
+        }
+
+        // parameter sets restored from checkpoint go before everything
+        if(!resumeHeaders.empty() && !feedData.empty()) {
+            feedData.insert(feedData.begin(), resumeHeaders.begin(), resumeHeaders.end());
+            resumeHeaders.clear();
+        }
+
+        return feedData;
+    }
+
+    /*
+        dequeues decoded frames into output, when draining waits until the last frame is returned
+        without wait, only frames which are already decoded are taken
+    */
+    bool receiveFrames(DecodedFrame &returnedOutput, const bool draining, const bool wait = true) {
+        while(true) {
+            // get decoded output
+            v4l2_buffer outputBuffer = {};
+            outputBuffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            outputBuffer.memory = V4L2_MEMORY_MMAP;
+            
+            // temporary plane vector
+            vector<v4l2_plane> planeData(decoderOutputBuffer[0].planes.size());
+            outputBuffer.m.planes = planeData.data();
+            outputBuffer.length = planeData.size();
+
+            if(TRACE_CALL("capture_dqbuf", xioctl(decoder, VIDIOC_DQBUF, &outputBuffer)) < 0) {
+                if(errno == EAGAIN) {
+                    // didn't process new incoming task yet
+                    if(wait && waitEvent(decoder, POLLIN | POLLRDNORM, draining ? drainTimeout : eventTimeout)) {
+                        continue;
+                    } else {
+                        break;
+                    }
+                    // break;
+                }
+
+                if(errno == EPIPE) {
+                    // no more data to decode (last buffer was already dequeued)
+                    drainFinished = drainFinished || drainStarted;
+                    break;
+                }
+
+                returnedOutput.status = Status::FAILED;
+                return false;
+            }
+
+            if(!decodeMemoryAvailable()) {
+                returnedOutput.status = Status::INSUFFICIENT_MEMORY;
+                return false;
+            }
+
+            bool frameData = false;
+            const bool lastBuffer = outputBuffer.flags & V4L2_BUF_FLAG_LAST;
+            MemoryBuffer &buffer = decoderOutputBuffer[outputBuffer.index];
+
+            for(int j = 0; j < (int)outputBuffer.length; j++) {
+                buffer.planes[j].bytesused = planeData[j].bytesused;
+                frameData |= planeData[j].bytesused > 0;
+            }
+
+            // drivers which don't set field of buffers decode in negotiated one
+            buffer.field = outputBuffer.field == V4L2_FIELD_ANY ? decoderOutputField : outputBuffer.field;
+
+            if(holdFrames && frameData) {
+                // frame stays in capture buffer until it is released
+                heldFrames.push_back(outputBuffer.index);
+                bufferHeld[outputBuffer.index] = true;
+                returnedOutput.frames++;
+                returnedOutput.fields.push_back(buffer.field);
+            } else {
+                TRACE_SCOPE("copy_out");
+                for(int j = 0; j < (int)outputBuffer.length; j++) {
+                    if(buffer.planes[j].bytesused > 0) {
+                        const uint8_t *decodedData = static_cast<const uint8_t *>(buffer.start[j]);
+                        returnedOutput.output.insert(returnedOutput.output.end(), decodedData, decodedData + buffer.planes[j].bytesused);
+                    }
+
+                    buffer.planes[j].bytesused = 0;
+                }
+
+                if(frameData) {
+                    returnedOutput.frames++;
+                    returnedOutput.fields.push_back(buffer.field);
+                }
+
+                if(!requeueCapture(outputBuffer.index)) {
+                    returnedOutput.status = Status::FAILED;
+                    return false;
                 }
             }
+
+            // everything is decoded after the buffer marked as last
+            if(lastBuffer && drainStarted) {
+                drainFinished = true;
+                break;
+            }
         }
 
-        return {-1, 0};
+        return true;
     }
 
-    // TODO: for blocking mode do SPS/PPS/IDR
-    vector<uint8_t> parseNAL(const vector<char> &input) {
-        vector<uint8_t> data;
-        data.insert(data.end(), partData.begin(), partData.end());
-        partData.clear();
-        data.insert(data.end(), input.begin(), input.end());
-
-        vector<uint8_t> result;
-        int byte = 0;
+    // returns capture buffer to the device
+    bool requeueCapture(const int index) {
+        v4l2_buffer buffer = {};
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buffer.index = index;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.m.planes = decoderOutputBuffer[index].planes.data();
+        buffer.length = decoderOutputBuffer[index].planes.size();
+
+        for(auto &plane : decoderOutputBuffer[index].planes) {
+            plane.bytesused = 0;
+        }
 
-        auto start = findNAL(data, byte);
-        if(start.first < 0) {
-            partData = move(data);
-            return result;
+        if(TRACE_CALL("capture_qbuf", xioctl(decoder, VIDIOC_QBUF, &buffer)) < 0) {
+            // one maximal retry
+            return errno == EAGAIN && waitEvent(decoder, POLLOUT | POLLWRNORM) && xioctl(decoder, VIDIOC_QBUF, &buffer) >= 0;
         }
 
-        byte = start.first + start.second;
+        return true;
+    }
 
-        while(byte < data.size()) {
-            auto next = findNAL(data, byte);
-            if(next.first < 0) {
-                partData.insert(partData.end(), data.begin() + start.first, data.end());
-                break;
-            }
+    // queues all buffers of a queue again (as after initialization)
+    bool queueBuffers(const int type, vector<MemoryBuffer> &buffers) {
+        for(int i = 0; i < (int)buffers.size(); i++) {
+            v4l2_buffer buffer = {};
+            buffer.type = type;
+            buffer.index = i;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.m.planes = buffers[i].planes.data();
+            buffer.length = buffers[i].planes.size();
 
-            if((data[start.first + start.second] & 0x1F) != 6) {
-                if(next.first > start.first) {
-                    result.insert(result.end(), data.begin() + start.first, data.begin() + next.first);
-                }
+            for(auto &plane : buffers[i].planes) {
+                plane.bytesused = 0;
             }
 
-            start = next;
-            byte = start.first + start.second;
+            if(xioctl(decoder, VIDIOC_QBUF, &buffer) < 0) {
+                return false;
+            }
         }
 
-        return result;
+        return true;
     }
+
 public:
     ~Decoder() { unload(); }
 
@@ -296,23 +1557,55 @@ public:
             xioctl(decoder, VIDIOC_STREAMOFF, &outputType);
             decodeStreamStarted = false;
         }
+
+        drainStarted = drainCommand = drainFinished = false;
+
+        // stream off returns all buffers to the driver
+        heldFrames.clear();
+        bufferHeld.assign(bufferHeld.size(), false);
     }
 
     void unload() {
         stopDecoder();
 
         if(decoderInitialized) {
+            for(auto &buffer : decoderOutputBuffer) {
+                for(const int dmabuf : buffer.dmabuf) {
+                    close(dmabuf);
+                }
+            }
+
             munmapBuffers(decoderInputBuffer);
             munmapBuffers(decoderOutputBuffer);
             close(decoder);
             decoderInitialized = false;
         }
 
+        releaseDeviceMemory();
+
         decoderInputBuffer.clear();
         decoderOutputBuffer.clear();
-        partData.clear();
+        bufferHeld.clear();
+        framer->reset();
+        feedData.clear();
+        feedUnits.clear();
+        carryData.clear();
         decoderOutputSize = {};
+        decoderOutputStride = 0;
+        decoderOutputField = V4L2_FIELD_NONE;
         memoryFrame = frameMemCheck;
+
+        overloadLevel = OverloadLevel::NORMAL;
+        overloadStreak = 0;
+        healthyStreak = 0;
+        waitKeyframe = false;
+        skipLeading = false;
+
+        parserState = {};
+        lastVPS.clear();
+        lastSPS.clear();
+        lastPPS.clear();
+        resumeHeaders.clear();
     }
 
     /*
@@ -330,9 +1623,26 @@ public:
         INSUFFICIENT_MEMORY as Status from decoding function will be set in this case
 
         also, width and height of input image must be constant (does not change through decoding)
+
+        note for device memory:
+
+        decoder buffers are allocated by the driver from contiguous (CMA) memory, which is not
+        counted in process RSS or MemAvailable, so maxMemory does not cover them
+
+        cmaBudget (in KiB) limits device memory of all decoders in this process together
+        if buffers would exceed it, buffer count is shrunk (down to minDecoderBufferCount),
+        and if that is still not enough, INSUFFICIENT_MEMORY is returned on initialization
+        pass cmaBudget = -1 (default) to disable the limit
+
+        note for codecs:
+
+        input is H.264 by default, other compressed formats are selected by codec (see note for framing),
+        if device doesn't support it, INCOMPATIBLE_HARDWARE is returned
+        NAL filtering (overload control, keyframes only, checkpoints) is done for H.264 and HEVC,
+        other codecs are passed to device unfiltered
     */
 
-    InitStatus initializeDecoder(const int width, const int height, const int maxMemory = -1, const string videoDevice = decoderDev) {
+    InitStatus initializeDecoder(const int width, const int height, const int maxMemory = -1, const string videoDevice = decoderDev, const int cmaBudget = -1, const Codec inputCodec = Codec::H264) {
         if(decoderInitialized) {
             return InitStatus::OK;
         }
@@ -343,13 +1653,16 @@ public:
             return InitStatus::DEVICE_NOT_FOUND;
         }
 
-        // encoder input specification (H264)
+        codec = inputCodec;
+        framer = Framer::create(codec);
+
+        // decoder input specification (compressed)
         v4l2_format inputFmt = {};
         inputFmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
         inputFmt.fmt.pix_mp.width = width;
         inputFmt.fmt.pix_mp.height = height;
-        inputFmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
-        inputFmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        inputFmt.fmt.pix_mp.pixelformat = pixelFormat(inputCodec);
+        inputFmt.fmt.pix_mp.field = V4L2_FIELD_NONE; // coded data has no field layout
         inputFmt.fmt.pix_mp.num_planes = 1;
 
         // ioctl sets (programs) devices with certain options
@@ -361,13 +1674,13 @@ public:
             return InitStatus::FAILED;
         }
 
-        // encoder output specification (H264 -> YU12)
+        // decoder output specification (YU12)
         v4l2_format outputFmt = {};
         outputFmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
         outputFmt.fmt.pix_mp.width = width;
         outputFmt.fmt.pix_mp.height = height;
         outputFmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
-        outputFmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        outputFmt.fmt.pix_mp.field = V4L2_FIELD_ANY; // driver picks layout of the stream
         outputFmt.fmt.pix_mp.num_planes = 1;
 
         if(xioctl(decoder, VIDIOC_S_FMT, &outputFmt) < 0) {
@@ -385,24 +1698,396 @@ public:
         }
 
         decoderOutputSize = {(int)outputFmt.fmt.pix_mp.width, (int)outputFmt.fmt.pix_mp.height};
+        decoderOutputStride = outputFmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+        decoderOutputField = outputFmt.fmt.pix_mp.field == V4L2_FIELD_ANY ? (uint32_t)V4L2_FIELD_NONE : outputFmt.fmt.pix_mp.field;
+
+        // fit buffer counts into device memory budget, shrinking input side first
+        int inputCount = decoderBufferCount;
+        int outputCount = decoderBufferCount;
+
+        if(cmaBudget >= 0) {
+            const long long budget = (long long)cmaBudget * 1024 - totalDeviceMemory;
+
+            while(formatMemory(inputFmt, inputCount) + formatMemory(outputFmt, outputCount) > budget) {
+                if(inputCount > minDecoderBufferCount) {
+                    inputCount--;
+                } else if(outputCount > minDecoderBufferCount) {
+                    outputCount--;
+                } else {
+                    close(decoder);
+                    return InitStatus::INSUFFICIENT_MEMORY;
+                }
+            }
+        }
 
         // decoding input buffer request
-        InitStatus outputStatus = mmapBuffers(decoder, inputFmt.type, inputFmt.fmt.pix_mp.num_planes, 4, decoderInputBuffer);
+        InitStatus outputStatus = mmapBuffers(decoder, inputFmt.type, inputFmt.fmt.pix_mp.num_planes, inputCount, decoderInputBuffer);
         if(outputStatus != InitStatus::OK) {
-            return outputStatus;
+            return abortInitialization(outputStatus);
         }
 
         // decoding output buffer request
-        InitStatus inputStatus = mmapBuffers(decoder, outputFmt.type, outputFmt.fmt.pix_mp.num_planes, 4, decoderOutputBuffer);
+        InitStatus inputStatus = mmapBuffers(decoder, outputFmt.type, outputFmt.fmt.pix_mp.num_planes, outputCount, decoderOutputBuffer);
         if(inputStatus != InitStatus::OK) {
-            return inputStatus;
+            return abortInitialization(inputStatus);
+        }
+
+        // driver may allocate more or larger buffers than requested, check actual lengths
+        if(cmaBudget >= 0 && totalDeviceMemory > (long long)cmaBudget * 1024) {
+            return abortInitialization(InitStatus::INSUFFICIENT_MEMORY);
         }
 
         memoryLimit = maxMemory;
+        bufferHeld.assign(decoderOutputBuffer.size(), false);
         decoderInitialized = true;
         return InitStatus::OK;
     }
 
+    // size of a single input buffer (maximal data passed to device at once), 0 if not initialized
+    int getInputBufferSize() {
+        if(decoderInputBuffer.empty() || decoderInputBuffer[0].planes.empty()) {
+            return 0;
+        }
+
+        return decoderInputBuffer[0].planes[0].length;
+    }
+
+    // device (CMA) memory used by buffers of this decoder, in KiB
+    int getDeviceMemoryUsage() {
+        return deviceMemory / 1024;
+    }
+
+    // device (CMA) memory used by buffers of all decoders in this process, in KiB
+    static int getTotalDeviceMemoryUsage() {
+        return totalDeviceMemory / 1024;
+    }
+
+    /*
+        note for draining and seeking:
+
+        drain decodes everything passed so far and returns all remaining frames
+        (decode only returns frames which are ready, some may still be in the device)
+        the device needs free capture buffers for them, so while frames are held, drain may end (on
+        timeout, or right away without wait) before the last one, then it is called again after
+        releasing frames, until isDrained (the buffer marked as last is dequeued)
+
+        resetStream drops all queued data and starts a new stream position, for example
+        after seeking in input: data passed next should start at a keyframe, last known SPS/PPS
+        are passed before it, and frames before the next IDR are skipped
+        it is also needed to continue decoding after drain
+    */
+
+    DecodedFrame drain(const bool wait = true) {
+        DecodedFrame returnedOutput;
+
+        if(!decoderInitialized) {
+            returnedOutput.status = Status::NOT_INITIALIZED;
+            return returnedOutput;
+        }
+
+        if(!decodeStreamStarted || drainFinished) {
+            return returnedOutput;
+        }
+
+        // stop command is sent only once (a second one fails while draining)
+        if(!drainStarted) {
+            // pass remaining data
+            returnedOutput = decode(nullptr, 0, true);
+            if(returnedOutput.status != Status::OK) {
+                return returnedOutput;
+            }
+
+            v4l2_decoder_cmd command = {};
+            command.cmd = V4L2_DEC_CMD_STOP;
+            drainCommand = xioctl(decoder, VIDIOC_DECODER_CMD, &command) >= 0;
+            if(!drainCommand && errno != ENOTTY && errno != EINVAL) {
+                returnedOutput.status = Status::FAILED;
+                return returnedOutput;
+            }
+
+            drainStarted = true;
+        }
+
+        receiveFrames(returnedOutput, true, wait);
+
+        // without stop command no buffer is marked as last, so it's done when the device had space and gave nothing more
+        if(!drainCommand && wait && getFreeCaptureBuffers() > 0) {
+            drainFinished = true;
+        }
+
+        returnedOutput.imageSize = decoderOutputSize;
+        return returnedOutput;
+    }
+
+    // everything passed is decoded and dequeued (see note for draining and seeking), or nothing was passed
+    bool isDrained() {
+        return !decodeStreamStarted || drainFinished;
+    }
+
+    bool resetStream(const long long streamOffset = 0) {
+        if(!decoderInitialized) {
+            return false;
+        }
+
+        if(decodeStreamStarted) {
+            stopDecoder();
+
+            // stream off returns all buffers, so they are queued again as after initialization
+            if(
+                !queueBuffers(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, decoderInputBuffer) ||
+                !queueBuffers(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, decoderOutputBuffer)
+            ) {
+                return false;
+            }
+        }
+
+        framer->restore(streamOffset, {});
+        feedData.clear();
+        carryData.clear();
+        parserState = {};
+
+        resumeHeaders = lastSPS;
+        resumeHeaders.insert(resumeHeaders.end(), lastPPS.begin(), lastPPS.end());
+        waitKeyframe = true;
+        return true;
+    }
+
+    /*
+        note for holding frames:
+
+        with holding enabled, decoded frames are not copied to DecodedFrame::output (only counted in frames),
+        but stay in capture buffers of the device until they are released, so they can be passed on without
+        copying (for example exported as dmabuf to an encoder)
+
+        take them in decode order with takeFrame, and return each of them with releaseFrame when done
+        while all capture buffers are held, device can't decode, so they need to be released promptly
+        held frames become invalid after stopDecoder, resetStream or unload
+    */
+
+    // decoded frame kept in a capture buffer
+    struct HeldFrame {
+        int index = -1; // capture buffer, passed to releaseFrame
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        int dmabuf = -1; // exported capture buffer (see exportBuffers), -1 if not exported
+        pair<int, int> imageSize;
+        uint32_t field = V4L2_FIELD_NONE; // see note for interlaced video
+    };
+
+    void setHoldFrames(const bool enabled) {
+        holdFrames = enabled;
+    }
+
+    // oldest decoded frame which isn't taken yet
+    bool takeFrame(HeldFrame &frame) {
+        if(heldFrames.empty()) {
+            return false;
+        }
+
+        const MemoryBuffer &buffer = decoderOutputBuffer[heldFrames.front()];
+        frame.index = heldFrames.front();
+        frame.data = static_cast<const uint8_t *>(buffer.start[0]);
+        frame.size = buffer.planes[0].bytesused;
+        frame.dmabuf = buffer.dmabuf.empty() ? -1 : buffer.dmabuf[0];
+        frame.imageSize = decoderOutputSize;
+        frame.field = buffer.field;
+
+        heldFrames.pop_front();
+        return true;
+    }
+
+    bool releaseFrame(const int index) {
+        if(index < 0 || index >= (int)bufferHeld.size() || !bufferHeld[index]) {
+            return false;
+        }
+
+        bufferHeld[index] = false;
+        return requeueCapture(index);
+    }
+
+    // size of decoded frames (may be bigger than requested, see note for decoding)
+    pair<int, int> getImageSize() {
+        return decoderOutputSize;
+    }
+
+    // codec of compressed input
+    Codec getCodec() {
+        return codec;
+    }
+
+    // bytes per line of decoded frames (consumers of held frames need the same layout)
+    int getCaptureStride() {
+        return decoderOutputStride;
+    }
+
+    /*
+        note for interlaced video:
+
+        field layout of capture format is negotiated with the driver (V4L2_FIELD_ANY is requested),
+        getField returns the one it picked, and every decoded frame reports its own (DecodedFrame::fields,
+        HeldFrame::field), as a stream may switch between progressive and interlaced pictures
+
+        V4L2_FIELD_NONE is a progressive frame, V4L2_FIELD_INTERLACED(_TB/_BT) has both fields
+        in alternate lines, and V4L2_FIELD_SEQ_TB/BT has them one after another in each plane
+        such frames can be made progressive by Deinterlacer (see deinterlace.hpp)
+    */
+
+    uint32_t getField() {
+        return decoderOutputField;
+    }
+
+    // capture buffers which aren't held (frames can be decoded into them)
+    int getFreeCaptureBuffers() {
+        int free = 0;
+        for(const bool held : bufferHeld) {
+            free += !held;
+        }
+
+        return free;
+    }
+
+    // exports capture buffers as dmabuf file descriptors (owned by decoder, closed on unload)
+    bool exportBuffers() {
+        if(!decoderInitialized) {
+            return false;
+        }
+
+        for(int i = 0; i < (int)decoderOutputBuffer.size(); i++) {
+            MemoryBuffer &buffer = decoderOutputBuffer[i];
+            if(!buffer.dmabuf.empty()) {
+                continue;
+            }
+
+            for(int j = 0; j < (int)buffer.planes.size(); j++) {
+                v4l2_exportbuffer exportBuffer = {};
+                exportBuffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+                exportBuffer.index = i;
+                exportBuffer.plane = j;
+                exportBuffer.flags = O_CLOEXEC | O_RDWR;
+
+                if(xioctl(decoder, VIDIOC_EXPBUF, &exportBuffer) < 0) {
+                    return false;
+                }
+
+                buffer.dmabuf.push_back(exportBuffer.fd);
+            }
+        }
+
+        return true;
+    }
+
+    /*
+        note for overload control:
+
+        when input comes faster than the device decodes, input queue fills up and data is dropped
+        (with overload control enabled, H.264 and HEVC input isn't cut inside a NAL: the rest of it is passed
+        in the next call, and following frames are dropped until the next keyframe)
+        overload controller watches for input queue staying full (no free buffer within eventTimeout)
+        and decode latency (overloadLatency), and when device can't keep up,
+        steps down: drops non-reference frames, then everything except keyframes, and then pauses
+        stream (only parameter sets are passed) - once device catches up, it steps back up
+        (decode calls whose input is all filtered out count as caught up)
+
+        after keyframes only or pause, frames are passed again from the next IDR onwards
+        it is disabled by default
+    */
+
+    void setOverloadControl(const bool enabled) {
+        overloadControl = enabled;
+        if(!enabled && overloadLevel != OverloadLevel::NORMAL) {
+            waitKeyframe = overloadLevel >= OverloadLevel::KEYFRAMES_ONLY;
+            overloadLevel = OverloadLevel::NORMAL;
+        }
+    }
+
+    OverloadLevel getOverloadLevel() {
+        return overloadLevel;
+    }
+
+    // observers are called from decode, on the decoding thread, in order they were added
+    void addNALObserver(NALObserver observer) {
+        nalObservers.push_back(move(observer));
+    }
+
+    // replaces all observers (nullptr removes them)
+    void setNALObserver(NALObserver observer) {
+        nalObservers.clear();
+        if(observer) {
+            nalObservers.push_back(move(observer));
+        }
+    }
+
+    // passes only keyframes (IDR, or IRAP in HEVC) to decoder, for example for thumbnails or fast preview
+    void setKeyframesOnly(const bool enabled) {
+        if(keyframesOnly && !enabled) {
+            waitKeyframe = true;
+        }
+
+        keyframesOnly = enabled;
+    }
+
+    // detects image size from the first SPS in H.264 or HEVC input, returns {0, 0} if there is none
+    static pair<int, int> probeImageSize(const vector<char> &input, const Codec codec = Codec::H264) {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(input.data());
+        pair<int, int> imageSize = {0, 0};
+
+        auto start = NALSplitter::find(data, input.size(), 0);
+        while(start.first >= 0) {
+            const int header = start.first + start.second;
+            auto next = NALSplitter::find(data, input.size(), header);
+            const int end = next.first < 0 ? input.size() : next.first;
+
+            if(header < end && NALHeader::parse(codec, &data[header], end - header).sps) {
+                if(codec == Codec::HEVC ? parseHEVCSPSSize(&data[header], end - header, imageSize) : parseSPSSize(&data[header], end - header, imageSize)) {
+                    return imageSize;
+                }
+            }
+
+            start = next;
+        }
+
+        return {0, 0};
+    }
+
+    /*
+        note for checkpoints:
+
+        getParserState returns current parser state, which can be serialized and stored
+        to resume, initialize a new decoder, restore the state, seek input to state.resumeOffset()
+        and continue passing data to decode from there - decoding continues from the last IDR
+        before checkpoint, with the same frame counters
+
+        if fromKeyframe is false, input needs to be seeked to state.byteOffset instead
+        (nothing is decoded twice, but frames until the next IDR are lost)
+    */
+
+    ParserState getParserState() {
+        ParserState state = parserState;
+        state.byteOffset = framer->getOffset();
+        state.partial = framer->getPartial();
+        return state;
+    }
+
+    void restoreParserState(const ParserState &state, const bool fromKeyframe = true) {
+        parserState = state;
+
+        if(fromKeyframe) {
+            framer->restore(state.resumeOffset(), {});
+            parserState.frameCount = state.keyframeFrame < 0 ? 0 : state.keyframeFrame;
+        } else {
+            framer->restore(state.byteOffset, state.partial);
+        }
+
+        parserState.partial.clear();
+        lastSPS = state.sps;
+        lastPPS = state.pps;
+
+        // decoder has no reference frames, so everything before next IDR is skipped
+        resumeHeaders = state.sps;
+        resumeHeaders.insert(resumeHeaders.end(), state.pps.begin(), state.pps.end());
+        waitKeyframe = true;
+    }
+
     /* 
        notes for decoding:
     
@@ -423,6 +2108,12 @@ public:
     */
     
     DecodedFrame decode(const vector<char> &input, bool lastData) {
+        return decode(input.data(), input.size(), lastData);
+    }
+
+    // same as above, for input which isn't stored in vector (input is only read during the call)
+    DecodedFrame decode(const char *input, const size_t size, bool lastData) {
+        TRACE_SCOPE("decode");
         DecodedFrame returnedOutput;
 
         if(!decoderInitialized) {
@@ -438,6 +2129,10 @@ public:
         int inputType = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
         int outputType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
+        const auto decodeStart = chrono::steady_clock::now();
+        bool inputDropped = false;
+        bool inputFed = false;
+
         // turn on stream
         if(!decodeStreamStarted) {
             if(
@@ -455,18 +2150,13 @@ public:
         // TODO: crop image to original values
         // feeding input buffers
         {
-            vector<uint8_t> data = parseNAL(input);
-            if(data.empty()) {
-                return returnedOutput;
-            }
-
-            if(lastData && !partData.empty()) {
-                data.insert(data.end(), partData.begin(), partData.end());
-                partData.clear();
-            }
+            // all of input may be filtered out (paused, keyframes only), frames are still received then
+            vector<uint8_t> &data = parseNAL(input, size, lastData);
+            inputFed = !data.empty();
 
             int remaining = data.size();
             const uint8_t *dataPtr = reinterpret_cast<const uint8_t *>(data.data());
+            size_t unit = 0; // frame being passed (frames aren't joined in a buffer)
 
             while(remaining > 0) {
                 // input buffer handling
@@ -478,11 +2168,12 @@ public:
                 inputBuffer.m.planes = planeData.data();
                 inputBuffer.length = planeData.size();
 
-                if(xioctl(decoder, VIDIOC_DQBUF, &inputBuffer) < 0) {
+                if(TRACE_CALL("output_dqbuf", xioctl(decoder, VIDIOC_DQBUF, &inputBuffer)) < 0) {
                     if(errno == EAGAIN) {
                         if(waitEvent(decoder, POLLOUT | POLLWRNORM)) {
                             continue;
                         } else {
+                            inputDropped = true;
                             break;
                         }
                     }
@@ -492,10 +2183,19 @@ public:
                 }
 
                 // take maximal size currently from input buffer chunk
-                const int copySize = min((int)decoderInputBuffer[inputBuffer.index].planes[0].length, remaining);
+                int copySize = min((int)decoderInputBuffer[inputBuffer.index].planes[0].length, remaining);
+
+                if(unit < feedUnits.size()) {
+                    const int unitRemaining = feedUnits[unit] - (data.size() - remaining);
+                    copySize = min(copySize, unitRemaining);
+
+                    if(copySize == unitRemaining) {
+                        unit++;
+                    }
+                }
 
                 // set the decode data
-                memcpy(decoderInputBuffer[inputBuffer.index].start[0], dataPtr, copySize);
+                TRACE_CALL("copy_in", memcpy(decoderInputBuffer[inputBuffer.index].start[0], dataPtr, copySize));
                 decoderInputBuffer[inputBuffer.index].planes[0].bytesused = copySize;
 
                 if(remaining - copySize == 0 && lastData) {
@@ -508,12 +2208,15 @@ public:
                 remaining -= copySize;
                 dataPtr += copySize;
 
-                if(xioctl(decoder, VIDIOC_QBUF, &inputBuffer) < 0) {
+                if(TRACE_CALL("output_qbuf", xioctl(decoder, VIDIOC_QBUF, &inputBuffer)) < 0) {
                     if(errno == EAGAIN) {
                         if(waitEvent(decoder, POLLOUT | POLLWRNORM)) {
                             // one maximal retry
                             if(xioctl(decoder, VIDIOC_QBUF, &inputBuffer) >= 0) continue;
                         } else {
+                            // this chunk isn't queued either
+                            remaining += copySize;
+                            inputDropped = true;
                             break;
                         }
                     }
@@ -522,73 +2225,25 @@ public:
                     return returnedOutput;
                 }
             }
-        }
-
-        // getting output buffers
-        while(true) {
-            // get decoded output
-            v4l2_buffer outputBuffer = {};
-            outputBuffer.type = outputType;
-            outputBuffer.memory = V4L2_MEMORY_MMAP;
-            
-            // temporary plane vector
-            vector<v4l2_plane> planeData(decoderOutputBuffer[0].planes.size());
-            outputBuffer.m.planes = planeData.data();
-            outputBuffer.length = planeData.size();
-
-            if(xioctl(decoder, VIDIOC_DQBUF, &outputBuffer) < 0) {
-                if(errno == EAGAIN) {
-                    // didn't process new incoming task yet
-                    if(waitEvent(decoder, POLLIN | POLLRDNORM)) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                    // break;
-                }
-
-                if(errno == EPIPE) {
-                    // no more data to decode
-                    break;
-                }
-
-                returnedOutput.status = Status::FAILED;
-                return returnedOutput;
-            }
-
-            if(!decodeMemoryAvailable()) {
-                returnedOutput.status = Status::INSUFFICIENT_MEMORY;
-                return returnedOutput;
-            }
-
-            for(int j = 0; j < outputBuffer.length; j++) {
-                decoderOutputBuffer[outputBuffer.index].planes[j].bytesused = planeData[j].bytesused;
 
-                if(decoderOutputBuffer[outputBuffer.index].planes[j].bytesused > 0) {
-                    const uint8_t *decodedData = static_cast<const uint8_t *>(decoderOutputBuffer[outputBuffer.index].start[j]);
-                    returnedOutput.output.insert(returnedOutput.output.end(), decodedData, decodedData + decoderOutputBuffer[outputBuffer.index].planes[j].bytesused);
-                }
-
-                decoderOutputBuffer[outputBuffer.index].planes[j].bytesused = 0;
+            // with overload control, NALs aren't cut: the rest waits for the next call, and new frames are
+            // passed again from the next keyframe (frames of other codecs are dropped whole, each has its buffer)
+            if(inputDropped && overloadControl && framer->annexB()) {
+                carryData.assign(data.end() - remaining, data.end());
+                waitKeyframe = true;
             }
+        }
 
-            outputBuffer.m.planes = decoderOutputBuffer[outputBuffer.index].planes.data();
-
-            if(xioctl(decoder, VIDIOC_QBUF, &outputBuffer) < 0) {
-                if(errno == EAGAIN) {
-                    if(waitEvent(decoder, POLLOUT | POLLWRNORM)) {
-                        // one maximal retry
-                        if(xioctl(decoder, VIDIOC_QBUF, &outputBuffer)) continue;
-                    } else {
-                        break;
-                    }
-                }
-
-                returnedOutput.status = Status::FAILED;
-                return returnedOutput;
-            }
+        // getting output buffers
+        if(!receiveFrames(returnedOutput, false, inputFed)) {
+            return returnedOutput;
         }
 
+        // overloaded if input queue stayed full (data was dropped), or decoding took too long
+        // calls with nothing to feed count as healthy, so filtering levels can recover
+        const auto decodeDuration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - decodeStart).count();
+        updateOverload(inputFed && (inputDropped || decodeDuration > overloadLatency));
+
         returnedOutput.imageSize = decoderOutputSize;
         return returnedOutput;
     }
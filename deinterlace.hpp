@@ -0,0 +1,307 @@
+// Deinterlacing of decoded frames (bob, linear blend and motion adaptive)
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+using namespace std;
+
+// default settings
+const int deinterlaceMotionThreshold = 12; // difference of a pixel between frames which counts as motion
+
+/*
+    note for deinterlacing kernels:
+
+    frames are processed row by row, missing rows of a field are interpolated as the average of
+    the rows above and below (interpolateRow), blend filters every row as (above + 2 * row + below) / 4
+    (blendRow), and motion adaptive interpolates only pixels which differ from the previous frame by at
+    least threshold, and keeps the others (motionRow)
+
+    rounding is the same in all variants, so SIMD (AVX2 or NEON) and scalar output are identical
+*/
+
+inline void interpolateRowScalar(const uint8_t *above, const uint8_t *below, uint8_t *output, const int width) {
+    for(int x = 0; x < width; x++) {
+        output[x] = (above[x] + below[x] + 1) >> 1;
+    }
+}
+
+inline void blendRowScalar(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *output, const int width) {
+    for(int x = 0; x < width; x++) {
+        output[x] = (above[x] + 2 * row[x] + below[x] + 2) >> 2;
+    }
+}
+
+inline void motionRowScalar(const uint8_t *above, const uint8_t *row, const uint8_t *below, const uint8_t *previous, uint8_t *output, const int width, const int threshold) {
+    for(int x = 0; x < width; x++) {
+        const int difference = row[x] > previous[x] ? row[x] - previous[x] : previous[x] - row[x];
+        output[x] = difference >= threshold ? (above[x] + below[x] + 1) >> 1 : row[x];
+    }
+}
+
+inline void interpolateRow(const uint8_t *above, const uint8_t *below, uint8_t *output, const int width) {
+    int x = 0;
+
+#if defined(__AVX2__)
+    for(; x + 32 <= width; x += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(above + x));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(below + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + x), _mm256_avg_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for(; x + 16 <= width; x += 16) {
+        vst1q_u8(output + x, vrhaddq_u8(vld1q_u8(above + x), vld1q_u8(below + x)));
+    }
+#endif
+
+    interpolateRowScalar(above + x, below + x, output + x, width - x);
+}
+
+inline void blendRow(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *output, const int width) {
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i rounding = _mm256_set1_epi16(2);
+
+    for(; x + 16 <= width; x += 16) {
+        // 16 pixels widened to 16 bit, packing puts results into both 128 bit lanes, the low one is stored
+        const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(above + x)));
+        const __m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x)));
+        const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(below + x)));
+        const __m256i sum = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(_mm256_slli_epi16(r, 1), rounding)), 2);
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + x), _mm256_castsi256_si128(packed));
+    }
+#elif defined(__ARM_NEON)
+    for(; x + 16 <= width; x += 16) {
+        const uint8x16_t a = vld1q_u8(above + x), r = vld1q_u8(row + x), b = vld1q_u8(below + x);
+        const uint16x8_t low = vaddq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)), vshll_n_u8(vget_low_u8(r), 1));
+        const uint16x8_t high = vaddq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)), vshll_n_u8(vget_high_u8(r), 1));
+
+        // rounding shift, (sum + 2) >> 2
+        vst1q_u8(output + x, vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2)));
+    }
+#endif
+
+    blendRowScalar(above + x, row + x, below + x, output + x, width - x);
+}
+
+inline void motionRow(const uint8_t *above, const uint8_t *row, const uint8_t *below, const uint8_t *previous, uint8_t *output, const int width, const int threshold) {
+    int x = 0;
+
+#if defined(__AVX2__)
+    const __m256i limit = _mm256_set1_epi8((char)threshold);
+
+    for(; x + 32 <= width; x += 32) {
+        const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x));
+        const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(previous + x));
+        const __m256i difference = _mm256_or_si256(_mm256_subs_epu8(r, p), _mm256_subs_epu8(p, r));
+
+        // difference >= threshold where max(difference, threshold) is the difference
+        const __m256i moving = _mm256_cmpeq_epi8(_mm256_max_epu8(difference, limit), difference);
+        const __m256i interpolated = _mm256_avg_epu8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(above + x)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(below + x))
+        );
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + x), _mm256_blendv_epi8(r, interpolated, moving));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t limit = vdupq_n_u8(threshold);
+
+    for(; x + 16 <= width; x += 16) {
+        const uint8x16_t r = vld1q_u8(row + x);
+        const uint8x16_t moving = vcgeq_u8(vabdq_u8(r, vld1q_u8(previous + x)), limit);
+        const uint8x16_t interpolated = vrhaddq_u8(vld1q_u8(above + x), vld1q_u8(below + x));
+
+        vst1q_u8(output + x, vbslq_u8(moving, interpolated, r));
+    }
+#endif
+
+    motionRowScalar(above + x, row + x, below + x, previous + x, output + x, width - x, threshold);
+}
+
+// frame holds both fields (in alternate lines, or one after another)
+inline bool interlacedField(const uint32_t field) {
+    return field == V4L2_FIELD_INTERLACED || field == V4L2_FIELD_INTERLACED_TB || field == V4L2_FIELD_INTERLACED_BT ||
+        field == V4L2_FIELD_SEQ_TB || field == V4L2_FIELD_SEQ_BT;
+}
+
+/*
+    note for deinterlacing:
+
+    Deinterlacer turns interlaced YU12 frames (see note for interlaced video) into progressive ones
+    of the same size and layout, one output frame for each input frame:
+    - BOB keeps lines of the first field (by field order, top for V4L2_FIELD_INTERLACED) and
+      interpolates the other field, so it has no combing, but only half of vertical resolution
+    - BLEND filters both fields together, keeping full resolution of static parts, but moving
+      edges are blurred into each other
+    - MOTION_ADAPTIVE keeps lines of the second field where they didn't change from the previous
+      frame, and interpolates them (like BOB) where they did, the first frame is deinterlaced as BOB
+
+    frames which are already progressive are passed unchanged
+    motion adaptive keeps a copy of the previous frame, call reset after seeking
+*/
+
+class Deinterlacer {
+public:
+    enum class Method {
+        BOB,
+        BLEND,
+        MOTION_ADAPTIVE
+    };
+private:
+    Method method;
+    int threshold;
+
+    vector<uint8_t> previous; // previous input frame (motion adaptive only)
+    pair<int, int> previousSize = {0, 0};
+    vector<uint8_t> scratch;
+    long long frames = 0;
+
+    // rows of a plane in interleaved order, whatever layout the fields are stored in
+    struct PlaneRows {
+        const uint8_t *data;
+        int stride;
+        int height;
+        bool sequential;
+        bool bottomStored; // bottom field is stored first (SEQ_BT)
+
+        const uint8_t *operator()(int y) const {
+            // lines outside of the plane are mirrored (so neighbours of an edge line are the same line)
+            y = y < 0 ? -y : y >= height ? 2 * (height - 1) - y : y;
+            if(!sequential) {
+                return data + (size_t)y * stride;
+            }
+
+            const bool bottom = y & 1;
+            const int fieldHeight = (height + 1) / 2;
+            const int first = bottom == bottomStored ? 0 : (bottomStored ? height / 2 : fieldHeight);
+            return data + (size_t)(first + y / 2) * stride;
+        }
+    };
+
+    void processPlane(const PlaneRows &rows, const PlaneRows &previousRows, uint8_t *output, const int width, const int stride, const int keptParity, const bool hasPrevious) {
+        for(int y = 0; y < rows.height; y++) {
+            uint8_t *target = output + (size_t)y * stride;
+
+            if(method == Method::BLEND) {
+                blendRow(rows(y - 1), rows(y), rows(y + 1), target, width);
+            } else if((y & 1) == keptParity) {
+                memcpy(target, rows(y), width);
+            } else if(method == Method::MOTION_ADAPTIVE && hasPrevious) {
+                motionRow(rows(y - 1), rows(y), rows(y + 1), previousRows(y), target, width, threshold);
+            } else {
+                interpolateRow(rows(y - 1), rows(y + 1), target, width);
+            }
+        }
+    }
+public:
+    // bytes of YU12 frame with luma stride (width by default)
+    static size_t frameBytes(const pair<int, int> &imageSize, const int stride = 0) {
+        const int lumaStride = stride > 0 ? stride : imageSize.first;
+        return (size_t)lumaStride * imageSize.second + 2 * (size_t)(lumaStride / 2) * (imageSize.second / 2);
+    }
+
+    Deinterlacer(const Method deinterlaceMethod = Method::MOTION_ADAPTIVE, const int motionThreshold = deinterlaceMotionThreshold) : method(deinterlaceMethod), threshold(min(max(motionThreshold, 1), 255)) {}
+
+    /*
+        deinterlaces YU12 frame (stride is luma bytes per line, width by default) into output of the same
+        layout (which must not overlap the frame), progressive frames are copied, returns false on bad size
+    */
+    bool process(const uint8_t *frame, const pair<int, int> &imageSize, const uint32_t field, uint8_t *output, const int stride = 0) {
+        const int width = imageSize.first, height = imageSize.second;
+        const int lumaStride = stride > 0 ? stride : width;
+        if(width < 2 || height < 4 || lumaStride < width) {
+            return false;
+        }
+
+        const size_t frameSize = frameBytes(imageSize, lumaStride);
+        if(!interlacedField(field)) {
+            memcpy(output, frame, frameSize);
+            return true;
+        }
+
+        const bool sequential = field == V4L2_FIELD_SEQ_TB || field == V4L2_FIELD_SEQ_BT;
+        const bool bottomFirst = field == V4L2_FIELD_INTERLACED_BT || field == V4L2_FIELD_SEQ_BT;
+        const int keptParity = bottomFirst ? 1 : 0; // lines of the first field
+
+        const bool hasPrevious = method == Method::MOTION_ADAPTIVE && frames > 0 && previousSize == imageSize && previous.size() == frameSize;
+
+        const uint8_t *source = frame;
+        const uint8_t *previousSource = previous.data();
+        uint8_t *target = output;
+        for(int p = 0; p < 3; p++) {
+            const int shift = p == 0 ? 0 : 1;
+            const int planeStride = lumaStride >> shift;
+            const int planeHeight = height >> shift;
+
+            const PlaneRows rows = {source, planeStride, planeHeight, sequential, field == V4L2_FIELD_SEQ_BT};
+            const PlaneRows previousRows = {previousSource, planeStride, planeHeight, sequential, field == V4L2_FIELD_SEQ_BT};
+            processPlane(rows, previousRows, target, width >> shift, planeStride, keptParity, hasPrevious);
+
+            source += (size_t)planeStride * planeHeight;
+            previousSource += (size_t)planeStride * planeHeight;
+            target += (size_t)planeStride * planeHeight;
+        }
+
+        if(method == Method::MOTION_ADAPTIVE) {
+            previous.assign(frame, frame + frameSize);
+            previousSize = imageSize;
+        }
+
+        frames++;
+        return true;
+    }
+
+    // deinterlaces interlaced frames of decoded output in place (fields of them become V4L2_FIELD_NONE)
+    bool process(Decoder::DecodedFrame &decodedFrame, const int stride = 0) {
+        if(decodedFrame.frames == 0 || decodedFrame.fields.size() != (size_t)decodedFrame.frames) {
+            return true;
+        }
+
+        // frames may be padded after the planes
+        const size_t frameSize = decodedFrame.output.size() / decodedFrame.frames;
+        const size_t usedSize = frameBytes(decodedFrame.imageSize, stride);
+        if(usedSize > frameSize) {
+            return false;
+        }
+
+        for(int i = 0; i < decodedFrame.frames; i++) {
+            if(!interlacedField(decodedFrame.fields[i])) {
+                continue;
+            }
+
+            scratch.resize(usedSize);
+            uint8_t *frame = decodedFrame.output.data() + i * frameSize;
+            if(!process(frame, decodedFrame.imageSize, decodedFrame.fields[i], scratch.data(), stride)) {
+                return false;
+            }
+
+            memcpy(frame, scratch.data(), usedSize);
+            decodedFrame.fields[i] = V4L2_FIELD_NONE;
+        }
+
+        return true;
+    }
+
+    // forgets previous frame (for example after seeking)
+    void reset() {
+        previous.clear();
+        previousSize = {0, 0};
+        frames = 0;
+    }
+
+    Method getMethod() {
+        return method;
+    }
+
+    long long getFrames() {
+        return frames;
+    }
+};
@@ -0,0 +1,612 @@
+// V4L2 memory-to-memory encoder and scaler (counterparts of decoder)
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+using namespace std;
+
+// default settings
+const string encoderDev = "/dev/video11"; // default encoder device path
+const string scalerDev = "/dev/video12"; // default scaler (ISP) device path
+const int encoderBufferCount = 4; // requested buffers per queue
+const int encoderBitrate = 2000000; // bits per second
+const int encoderGOPSize = 60; // frames between IDRs
+
+/*
+    note for memory-to-memory devices:
+
+    M2MDevice handles a device which takes frames on OUTPUT queue and returns results on CAPTURE queue
+    (both multi-planar, with a single plane), as encoder and ISP (scaler) on Raspberry Pi
+
+    input is either copied into mapped buffers, or passed as dmabuf without copying
+    (for example held capture buffers of a decoder, see Decoder::exportBuffers)
+    each passed dmabuf has a tag (for example index of decoder capture buffer), which is returned by
+    reclaim once the device doesn't need it anymore, so the owner can reuse it
+
+    if all input slots are in use, submit returns false, and caller needs to wait (backpressure)
+*/
+
+class M2MDevice {
+protected:
+    struct Buffer {
+        void *start = MAP_FAILED;
+        size_t length = 0;
+        int dmabuf = -1; // exported (capture) buffer
+        int tag = -1; // owner tag of passed dmabuf (input)
+        bool queued = false;
+    };
+
+    int device = -1;
+    bool initialized = false;
+    bool streamStarted = false;
+    bool dmabufInput = false;
+
+    vector<Buffer> inputBuffers;
+    vector<Buffer> outputBuffers;
+    v4l2_format inputFormat = {};
+    v4l2_format outputFormat = {};
+    long long submitted = 0; // frame counter, used as timestamp
+
+    int xioctl(int fd, int request, void *arg) {
+        int status;
+
+        do {
+            status = ioctl(fd, request, arg);
+        } while (status == -1 && errno == EINTR);
+
+        return status;
+    }
+
+    bool waitEvent(short events, int timeout) {
+        pollfd descriptor = {device, events, 0};
+        return poll(&descriptor, 1, timeout) > 0 && (descriptor.revents & events) != 0;
+    }
+
+    Decoder::InitStatus setFormat(const int type, const int width, const int height, const uint32_t pixelFormat, const int stride, v4l2_format &format) {
+        format = {};
+        format.type = type;
+        format.fmt.pix_mp.width = width;
+        format.fmt.pix_mp.height = height;
+        format.fmt.pix_mp.pixelformat = pixelFormat;
+        format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        format.fmt.pix_mp.num_planes = 1;
+        format.fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+
+        if(xioctl(device, VIDIOC_S_FMT, &format) < 0) {
+            return errno == EINVAL ? Decoder::InitStatus::INCOMPATIBLE_HARDWARE : Decoder::InitStatus::FAILED;
+        }
+
+        // formats with more planes (or different layout) aren't handled
+        if(format.fmt.pix_mp.pixelformat != pixelFormat || format.fmt.pix_mp.num_planes != 1 || (stride > 0 && (int)format.fmt.pix_mp.plane_fmt[0].bytesperline != stride)) {
+            return Decoder::InitStatus::INCOMPATIBLE_HARDWARE;
+        }
+
+        return Decoder::InitStatus::OK;
+    }
+
+    // requests buffers, mapped ones are mapped (capture ones are also queued)
+    Decoder::InitStatus requestBuffers(const int type, const int memory, const int bufferCount, vector<Buffer> &output) {
+        v4l2_requestbuffers reqBuffer = {};
+        reqBuffer.count = bufferCount;
+        reqBuffer.type = type;
+        reqBuffer.memory = memory;
+
+        if(xioctl(device, VIDIOC_REQBUFS, &reqBuffer) < 0) {
+            return errno == EINVAL ? Decoder::InitStatus::INCOMPATIBLE_HARDWARE : Decoder::InitStatus::FAILED;
+        }
+
+        if(reqBuffer.count < 1) {
+            return Decoder::InitStatus::INSUFFICIENT_MEMORY;
+        }
+
+        output.resize(reqBuffer.count);
+        if(memory != V4L2_MEMORY_MMAP) {
+            return Decoder::InitStatus::OK;
+        }
+
+        for(int i = 0; i < (int)reqBuffer.count; i++) {
+            v4l2_plane plane = {};
+            v4l2_buffer buffer = {};
+            buffer.type = type;
+            buffer.index = i;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.m.planes = &plane;
+            buffer.length = 1;
+
+            if(xioctl(device, VIDIOC_QUERYBUF, &buffer) < 0) {
+                return Decoder::InitStatus::FAILED;
+            }
+
+            output[i].length = plane.length;
+            output[i].start = mmap(nullptr, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED, device, plane.m.mem_offset);
+            if(output[i].start == MAP_FAILED) {
+                return Decoder::InitStatus::FAILED;
+            }
+
+            if(type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && !requeueOutput(i)) {
+                return Decoder::InitStatus::FAILED;
+            }
+        }
+
+        return Decoder::InitStatus::OK;
+    }
+
+    /*
+        opens device and sets up both queues, with codedOutput the CAPTURE format is set first
+        (stateful encoders reset the raw OUTPUT format when the coded format is set)
+    */
+    Decoder::InitStatus initializeDevice(const string &videoDevice, const pair<int, int> &inputSize, const uint32_t inputPixelFormat, const int inputStride, const pair<int, int> &outputSize, const uint32_t outputPixelFormat, const bool dmabuf, const bool codedOutput = false) {
+        if(initialized) {
+            return Decoder::InitStatus::OK;
+        }
+
+        device = open(videoDevice.c_str(), O_RDWR | O_NONBLOCK);
+        if(device < 0) {
+            return Decoder::InitStatus::DEVICE_NOT_FOUND;
+        }
+
+        dmabufInput = dmabuf;
+        const auto setInputFormat = [&] {
+            return setFormat(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, inputSize.first, inputSize.second, inputPixelFormat, inputStride, inputFormat);
+        };
+
+        const auto setOutputFormat = [&] {
+            return setFormat(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, outputSize.first, outputSize.second, outputPixelFormat, 0, outputFormat);
+        };
+
+        Decoder::InitStatus status = codedOutput ? setOutputFormat() : setInputFormat();
+        if(status == Decoder::InitStatus::OK) {
+            status = codedOutput ? setInputFormat() : setOutputFormat();
+        }
+
+        if(status == Decoder::InitStatus::OK) {
+            status = requestBuffers(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, dmabuf ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP, encoderBufferCount, inputBuffers);
+        }
+
+        if(status == Decoder::InitStatus::OK) {
+            status = requestBuffers(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_MMAP, encoderBufferCount, outputBuffers);
+        }
+
+        initialized = true;
+        if(status != Decoder::InitStatus::OK) {
+            unload();
+        }
+
+        return status;
+    }
+
+    bool startStream() {
+        if(streamStarted) {
+            return true;
+        }
+
+        int inputType = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        int outputType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if(xioctl(device, VIDIOC_STREAMON, &inputType) < 0 || xioctl(device, VIDIOC_STREAMON, &outputType) < 0) {
+            return false;
+        }
+
+        streamStarted = true;
+        return true;
+    }
+
+    int freeInputSlot() {
+        for(int i = 0; i < (int)inputBuffers.size(); i++) {
+            if(!inputBuffers[i].queued) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    bool queueInput(const int slot, const size_t size, const int dmabuf, const int tag) {
+        if(!startStream()) {
+            return false;
+        }
+
+        v4l2_plane plane = {};
+        plane.bytesused = size;
+
+        v4l2_buffer buffer = {};
+        buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        buffer.index = slot;
+        buffer.m.planes = &plane;
+        buffer.length = 1;
+        buffer.timestamp.tv_sec = submitted / 1000000;
+        buffer.timestamp.tv_usec = submitted % 1000000;
+
+        if(dmabufInput) {
+            buffer.memory = V4L2_MEMORY_DMABUF;
+            plane.m.fd = dmabuf;
+            plane.length = size;
+        } else {
+            buffer.memory = V4L2_MEMORY_MMAP;
+            plane.length = inputBuffers[slot].length;
+        }
+
+        if(xioctl(device, VIDIOC_QBUF, &buffer) < 0) {
+            return false;
+        }
+
+        inputBuffers[slot].queued = true;
+        inputBuffers[slot].tag = tag;
+        submitted++;
+        return true;
+    }
+
+    // dequeues processed capture buffer, -1 if none is ready within timeout
+    int dequeueOutput(size_t &size, bool &last, const int timeout) {
+        while(true) {
+            v4l2_plane plane = {};
+            v4l2_buffer buffer = {};
+            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.m.planes = &plane;
+            buffer.length = 1;
+
+            if(xioctl(device, VIDIOC_DQBUF, &buffer) < 0) {
+                if(errno == EAGAIN && waitEvent(POLLIN | POLLRDNORM, timeout)) {
+                    continue;
+                }
+
+                return -1;
+            }
+
+            outputBuffers[buffer.index].queued = false;
+            size = plane.bytesused;
+            last = buffer.flags & V4L2_BUF_FLAG_LAST;
+            return buffer.index;
+        }
+    }
+
+    bool requeueOutput(const int index) {
+        v4l2_plane plane = {};
+        plane.length = outputBuffers[index].length;
+
+        v4l2_buffer buffer = {};
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buffer.index = index;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.m.planes = &plane;
+        buffer.length = 1;
+
+        if(xioctl(device, VIDIOC_QBUF, &buffer) < 0) {
+            return false;
+        }
+
+        outputBuffers[index].queued = true;
+        return true;
+    }
+
+    bool setControl(const uint32_t id, const int value) {
+        v4l2_control control = {};
+        control.id = id;
+        control.value = value;
+        return initialized && xioctl(device, VIDIOC_S_CTRL, &control) >= 0;
+    }
+public:
+    ~M2MDevice() { unload(); }
+
+    // free input slot exists (submit won't fail for lack of it)
+    bool canSubmit() {
+        return initialized && freeInputSlot() >= 0;
+    }
+
+    // passes dmabuf (with size bytes of frame) to the device, false if there is no free slot
+    bool submit(const int dmabuf, const size_t size, const int tag) {
+        if(!initialized || !dmabufInput) {
+            return false;
+        }
+
+        const int slot = freeInputSlot();
+        return slot >= 0 && queueInput(slot, size, dmabuf, tag);
+    }
+
+    // dequeues consumed input, tags of passed dmabufs are appended to tags
+    bool reclaim(vector<int> &tags) {
+        if(!streamStarted) {
+            return true;
+        }
+
+        while(true) {
+            v4l2_plane plane = {};
+            v4l2_buffer buffer = {};
+            buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            buffer.memory = dmabufInput ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+            buffer.m.planes = &plane;
+            buffer.length = 1;
+
+            if(xioctl(device, VIDIOC_DQBUF, &buffer) < 0) {
+                return errno == EAGAIN || errno == EPIPE;
+            }
+
+            Buffer &input = inputBuffers[buffer.index];
+            if(input.tag >= 0) {
+                tags.push_back(input.tag);
+            }
+
+            input.queued = false;
+            input.tag = -1;
+        }
+    }
+
+    // input passed to device, which isn't consumed yet
+    int getQueuedInput() {
+        int queued = 0;
+        for(const auto &buffer : inputBuffers) {
+            queued += buffer.queued;
+        }
+
+        return queued;
+    }
+
+    // waits until device has any progress (consumed input or ready output)
+    bool wait(const int timeout = eventTimeout) {
+        return initialized && waitEvent(POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM, timeout);
+    }
+
+    void unload() {
+        if(streamStarted) {
+            int inputType = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            int outputType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            xioctl(device, VIDIOC_STREAMOFF, &inputType);
+            xioctl(device, VIDIOC_STREAMOFF, &outputType);
+            streamStarted = false;
+        }
+
+        for(auto *buffers : {&inputBuffers, &outputBuffers}) {
+            for(auto &buffer : *buffers) {
+                if(buffer.dmabuf >= 0) {
+                    close(buffer.dmabuf);
+                }
+
+                if(buffer.start != MAP_FAILED) {
+                    munmap(buffer.start, buffer.length);
+                }
+            }
+
+            buffers->clear();
+        }
+
+        if(initialized) {
+            close(device);
+            initialized = false;
+        }
+
+        submitted = 0;
+    }
+};
+
+/*
+    note for encoding:
+
+    Encoder is stateful H.264 encoder (by default, other compressed formats can be passed as codec,
+    for example V4L2_PIX_FMT_FWHT for vicodec test driver)
+    input is YU12 (YUV 4:2:0) with the same size, and stride given on initialization (0 for driver default)
+
+    with dmabufInput, frames are passed by submit (see note for memory-to-memory devices),
+    otherwise they are copied by encode
+    encoded data is returned by receive (and by encode), and remaining data by drain at the end
+
+    bitrate and GOP size are set on initialization, and they can be changed while encoding
+    controls which aren't supported by the device are skipped on initialization
+*/
+
+class Encoder : public M2MDevice {
+public:
+    struct EncodedData {
+        Decoder::Status status = Decoder::Status::OK;
+
+        // compressed data (Annex-B for H.264)
+        vector<uint8_t> output;
+
+        // number of encoded frames in output
+        int frames = 0;
+    };
+
+    Decoder::InitStatus initializeEncoder(const int width, const int height, const int bitrate = encoderBitrate, const int gopSize = encoderGOPSize, const string videoDevice = encoderDev, const bool dmabufInput = false, const int stride = 0, const uint32_t codec = V4L2_PIX_FMT_H264) {
+        Decoder::InitStatus status = initializeDevice(videoDevice, {width, height}, V4L2_PIX_FMT_YUV420, stride, {width, height}, codec, dmabufInput, true);
+        if(status != Decoder::InitStatus::OK) {
+            return status;
+        }
+
+        setBitrate(bitrate);
+        setGOPSize(gopSize);
+
+        // SPS and PPS with every IDR, so output can be cut or joined on IDRs
+        setControl(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1);
+        return Decoder::InitStatus::OK;
+    }
+
+    bool setBitrate(const int bitrate) {
+        return setControl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate);
+    }
+
+    bool setGOPSize(const int gopSize) {
+        const bool period = setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, gopSize);
+        const bool size = setControl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, gopSize);
+        return period || size;
+    }
+
+    // next frame is encoded as IDR
+    bool forceKeyframe() {
+        return setControl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1);
+    }
+
+    // bytes per line of input frames
+    int getInputStride() {
+        return inputFormat.fmt.pix_mp.plane_fmt[0].bytesperline;
+    }
+
+    // copies a frame into device (waits for a free input buffer) and returns data encoded so far
+    EncodedData encode(const uint8_t *frame, const size_t size) {
+        EncodedData returnedOutput;
+
+        if(!initialized || dmabufInput) {
+            returnedOutput.status = Decoder::Status::NOT_INITIALIZED;
+            return returnedOutput;
+        }
+
+        vector<int> tags;
+        int slot = freeInputSlot();
+        while(slot < 0) {
+            if(!reclaim(tags)) {
+                returnedOutput.status = Decoder::Status::FAILED;
+                return returnedOutput;
+            }
+
+            slot = freeInputSlot();
+            if(slot < 0 && !waitEvent(POLLOUT | POLLWRNORM, drainTimeout)) {
+                returnedOutput.status = Decoder::Status::FAILED;
+                return returnedOutput;
+            }
+        }
+
+        const size_t copySize = min(size, inputBuffers[slot].length);
+        memcpy(inputBuffers[slot].start, frame, copySize);
+
+        if(!queueInput(slot, copySize, -1, -1)) {
+            returnedOutput.status = Decoder::Status::FAILED;
+            return returnedOutput;
+        }
+
+        return receive();
+    }
+
+    // returns encoded data which is ready (when draining, waits until the last buffer)
+    EncodedData receive(const bool draining = false) {
+        EncodedData returnedOutput;
+
+        if(!initialized) {
+            returnedOutput.status = Decoder::Status::NOT_INITIALIZED;
+            return returnedOutput;
+        }
+
+        // input buffers are reused as soon as they are consumed
+        vector<int> tags;
+        if(!dmabufInput && !reclaim(tags)) {
+            returnedOutput.status = Decoder::Status::FAILED;
+            return returnedOutput;
+        }
+
+        while(streamStarted) {
+            size_t size = 0;
+            bool last = false;
+
+            const int index = dequeueOutput(size, last, draining ? drainTimeout : 0);
+            if(index < 0) {
+                break;
+            }
+
+            if(size > 0) {
+                const uint8_t *data = static_cast<const uint8_t *>(outputBuffers[index].start);
+                returnedOutput.output.insert(returnedOutput.output.end(), data, data + size);
+                returnedOutput.frames++;
+            }
+
+            if(!requeueOutput(index)) {
+                returnedOutput.status = Decoder::Status::FAILED;
+                return returnedOutput;
+            }
+
+            if(draining && last) {
+                break;
+            }
+        }
+
+        return returnedOutput;
+    }
+
+    // encodes all passed frames and returns remaining data
+    EncodedData drain() {
+        if(!streamStarted) {
+            return receive();
+        }
+
+        v4l2_encoder_cmd command = {};
+        command.cmd = V4L2_ENC_CMD_STOP;
+        if(xioctl(device, VIDIOC_ENCODER_CMD, &command) < 0 && errno != ENOTTY && errno != EINVAL) {
+            EncodedData returnedOutput;
+            returnedOutput.status = Decoder::Status::FAILED;
+            return returnedOutput;
+        }
+
+        return receive(true);
+    }
+};
+
+/*
+    note for scaling:
+
+    Scaler is ISP (or other memory-to-memory scaler) taking YU12 frames as dmabufs, and returning
+    scaled YU12 frames in its own capture buffers, which are exported as dmabufs, so they can be
+    passed on to an encoder
+    scaled frames are taken with takeFrame and returned with releaseFrame (as held decoder frames)
+*/
+
+class Scaler : public M2MDevice {
+public:
+    struct ScaledFrame {
+        int index = -1; // capture buffer, passed to releaseFrame
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        int dmabuf = -1;
+    };
+
+    Decoder::InitStatus initializeScaler(const pair<int, int> &inputSize, const int inputStride, const pair<int, int> &outputSize, const string videoDevice = scalerDev) {
+        Decoder::InitStatus status = initializeDevice(videoDevice, inputSize, V4L2_PIX_FMT_YUV420, inputStride, outputSize, V4L2_PIX_FMT_YUV420, true);
+        if(status != Decoder::InitStatus::OK) {
+            return status;
+        }
+
+        // exported for the next device
+        for(int i = 0; i < (int)outputBuffers.size(); i++) {
+            v4l2_exportbuffer exportBuffer = {};
+            exportBuffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            exportBuffer.index = i;
+            exportBuffer.flags = O_CLOEXEC | O_RDWR;
+
+            if(xioctl(device, VIDIOC_EXPBUF, &exportBuffer) < 0) {
+                unload();
+                return Decoder::InitStatus::FAILED;
+            }
+
+            outputBuffers[i].dmabuf = exportBuffer.fd;
+        }
+
+        return Decoder::InitStatus::OK;
+    }
+
+    pair<int, int> getOutputSize() {
+        return {(int)outputFormat.fmt.pix_mp.width, (int)outputFormat.fmt.pix_mp.height};
+    }
+
+    int getOutputStride() {
+        return outputFormat.fmt.pix_mp.plane_fmt[0].bytesperline;
+    }
+
+    // scaled frame, if one is ready
+    bool takeFrame(ScaledFrame &frame) {
+        if(!streamStarted) {
+            return false;
+        }
+
+        size_t size = 0;
+        bool last = false;
+        const int index = dequeueOutput(size, last, 0);
+        if(index < 0) {
+            return false;
+        }
+
+        frame.index = index;
+        frame.data = static_cast<const uint8_t *>(outputBuffers[index].start);
+        frame.size = size;
+        frame.dmabuf = outputBuffers[index].dmabuf;
+        return true;
+    }
+
+    bool releaseFrame(const int index) {
+        return index >= 0 && index < (int)outputBuffers.size() && !outputBuffers[index].queued && requeueOutput(index);
+    }
+};
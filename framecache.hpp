@@ -0,0 +1,175 @@
+// Cache of decoded frames for random access
+// Written by ukicomputers
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <climits>
+using namespace std;
+
+/*
+    note for frame cache:
+
+    FrameCache keeps decoded frames (or downscaled proxies of them) in memory, keyed by stream and frame number
+    when stored frames exceed memory limit (in bytes) or frame limit, least recently used ones are removed
+
+    it is shared between threads (for example a foreground decoder and a background prefetch session),
+    and it can be shared by multiple streams (each with its own stream number)
+
+    hit ratio is counted from get only (unless disabled), contains doesn't change it
+*/
+
+class FrameCache {
+private:
+    using Key = pair<int, long long>; // stream, frame
+
+    struct Entry {
+        Key key;
+        vector<uint8_t> data;
+        pair<int, int> imageSize;
+    };
+
+    // most recently used first
+    list<Entry> entries;
+    map<Key, list<Entry>::iterator> index;
+
+    size_t maxBytes;
+    size_t maxFrames;
+    size_t bytes = 0;
+
+    long long hits = 0;
+    long long misses = 0;
+
+    mutex cacheMutex;
+
+    void erase(list<Entry>::iterator entry) {
+        bytes -= entry->data.size();
+        index.erase(entry->key);
+        entries.erase(entry);
+    }
+public:
+    FrameCache(const size_t memoryLimit, const size_t frameLimit = SIZE_MAX) : maxBytes(memoryLimit), maxFrames(frameLimit) {}
+
+    // stores frame as the most recently used one (replacing already stored one)
+    void put(const int stream, const long long frame, vector<uint8_t> &&data, const pair<int, int> &imageSize) {
+        lock_guard<mutex> lock(cacheMutex);
+
+        auto found = index.find({stream, frame});
+        if(found != index.end()) {
+            erase(found->second);
+        }
+
+        // frame which can't fit at all isn't stored
+        if(data.size() > maxBytes || maxFrames == 0) {
+            return;
+        }
+
+        bytes += data.size();
+        entries.push_front({{stream, frame}, move(data), imageSize});
+        index[{stream, frame}] = entries.begin();
+
+        while(bytes > maxBytes || entries.size() > maxFrames) {
+            erase(prev(entries.end()));
+        }
+    }
+
+    // copies frame to data if it is stored, and marks it as the most recently used (counted in hit ratio if counted)
+    bool get(const int stream, const long long frame, vector<uint8_t> &data, pair<int, int> &imageSize, const bool counted = true) {
+        lock_guard<mutex> lock(cacheMutex);
+
+        auto found = index.find({stream, frame});
+        if(found == index.end()) {
+            misses += counted;
+            return false;
+        }
+
+        hits += counted;
+        entries.splice(entries.begin(), entries, found->second);
+        data = found->second->data;
+        imageSize = found->second->imageSize;
+        return true;
+    }
+
+    bool contains(const int stream, const long long frame) {
+        lock_guard<mutex> lock(cacheMutex);
+        return index.count({stream, frame}) > 0;
+    }
+
+    // removes all frames of a stream
+    void clear(const int stream) {
+        lock_guard<mutex> lock(cacheMutex);
+
+        for(auto entry = entries.begin(); entry != entries.end();) {
+            auto next = std::next(entry);
+            if(entry->key.first == stream) {
+                erase(entry);
+            }
+            entry = next;
+        }
+    }
+
+    double getHitRatio() {
+        lock_guard<mutex> lock(cacheMutex);
+        return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+    }
+
+    long long getHits() {
+        lock_guard<mutex> lock(cacheMutex);
+        return hits;
+    }
+
+    long long getMisses() {
+        lock_guard<mutex> lock(cacheMutex);
+        return misses;
+    }
+
+    size_t getFrames() {
+        lock_guard<mutex> lock(cacheMutex);
+        return entries.size();
+    }
+
+    size_t getMemoryUsage() {
+        lock_guard<mutex> lock(cacheMutex);
+        return bytes;
+    }
+};
+
+// box filter downscale of a single YU12 frame by integer factor (for proxies and thumbnails), stride is
+// luma bytes per line of the frame (width by default), output is packed
+inline vector<uint8_t> downscaleFrame(const uint8_t *frame, const pair<int, int> &size, const int factor, const int stride = 0) {
+    const int width = size.first, height = size.second;
+    const int lumaStride = stride > 0 ? stride : width;
+    const int scaledWidth = width / factor, scaledHeight = height / factor;
+
+    vector<uint8_t> output;
+    output.reserve(scaledWidth * scaledHeight * 3 / 2);
+
+    // Y, U and V planes
+    const uint8_t *plane = frame;
+    for(int p = 0; p < 3; p++) {
+        const int planeStride = p == 0 ? lumaStride : lumaStride / 2;
+        const int planeHeight = p == 0 ? height : height / 2;
+        const int outWidth = p == 0 ? scaledWidth : scaledWidth / 2;
+        const int outHeight = p == 0 ? scaledHeight : scaledHeight / 2;
+
+        for(int y = 0; y < outHeight; y++) {
+            for(int x = 0; x < outWidth; x++) {
+                int sum = 0;
+                for(int dy = 0; dy < factor; dy++) {
+                    for(int dx = 0; dx < factor; dx++) {
+                        sum += plane[(size_t)(y * factor + dy) * planeStride + x * factor + dx];
+                    }
+                }
+
+                output.push_back(sum / (factor * factor));
+            }
+        }
+
+        plane += (size_t)planeStride * planeHeight;
+    }
+
+    return output;
+}
@@ -0,0 +1,246 @@
+// Fuzzing harness of the NAL splitter, framers and bitstream parsers
+// splits input at random chunk boundaries and checks that results are the same as from a reference splitter
+
+#include "harness.hpp"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <sys/stat.h>
+using namespace std;
+
+// default settings
+const string defaultInputPath = "video.h264";
+const int seedBytes = 4; // bytes at the start of fuzz input which seed chunk boundaries
+const size_t corpusUnitSize = 4096; // bytes of video in each generated corpus file
+const int corpusFiles = 64;
+
+/*
+    note for fuzzing:
+
+    with libFuzzer (clang), corpus is created by the build without it (below):
+        clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address,undefined -DV4L2_LIBFUZZER fuzz.cpp -o fuzz-libfuzzer
+        ./fuzz-libfuzzer corpus
+
+    with AFL, or without a fuzzer, the built-in main runs every input file once:
+        g++ -std=c++17 -g -O1 -fsanitize=address,undefined fuzz.cpp -o fuzz
+        ./fuzz --corpus corpus [video.h264]     # seed corpus from windows of video
+        ./fuzz --random 100000 [video.h264]     # random mutations of video windows
+        ./fuzz crash-file ...                   # reproduce
+        afl-fuzz -i corpus -o findings -- ./fuzz @@
+
+    every input is checked as:
+    - NALSplitter in random chunks (with checkpoint restore in the middle) against referenceSplit of the whole input
+    - Annex-B framer the same way, and access units of H.264 and HEVC, which must contain exactly the split NALs
+    - JPEG, IVF and FWHT framers in random chunks against the same framer given the whole input
+    - probeImageSize of H.264 and HEVC, which must not fail on any input
+*/
+
+[[noreturn]] void fail(const string &what) {
+    cerr << "fuzz check failed: " << what << "\n";
+    abort();
+}
+
+// chunk boundaries from seed, mostly small chunks so boundaries fall into start codes and headers
+vector<size_t> chunkSizes(const uint32_t seed, const size_t size) {
+    mt19937 random(seed);
+    vector<size_t> sizes;
+
+    for(size_t total = 0; total < size;) {
+        const size_t chunk = min<size_t>(size - total, random() % 4 == 0 ? random() % 4096 + 1 : random() % 8 + 1);
+        sizes.push_back(chunk);
+        total += chunk;
+    }
+
+    return sizes;
+}
+
+void checkSplitter(const uint8_t *data, const size_t size, const vector<size_t> &sizes, const size_t restoreAt) {
+    const vector<Unit> reference = referenceSplit(data, size);
+    const vector<Unit> units = splitChunked(data, sizes, restoreAt);
+
+    if(units != reference) {
+        fail("NALSplitter differs from reference (" + to_string(units.size()) + " NALs, reference " + to_string(reference.size()) + ")");
+    }
+
+    if(frameChunked(Codec::H264, data, sizes, restoreAt) != reference) {
+        fail("Annex-B framer differs from reference");
+    }
+
+    // access units hold exactly the NALs, in order
+    for(const Codec codec : {Codec::H264, Codec::HEVC}) {
+        AccessUnitAssembler assembler(codec);
+        AccessUnit unit;
+        vector<uint8_t> joined;
+        long long lastOffset = -1;
+
+        const auto take = [&]() {
+            if(unit.data.empty() || unit.offset <= lastOffset) {
+                fail("access unit is empty or out of order");
+            }
+
+            lastOffset = unit.offset;
+            joined.insert(joined.end(), unit.data.begin(), unit.data.end());
+        };
+
+        for(const Unit &nal : reference) {
+            if(assembler.push(nal.data.data(), nal.data.size(), nal.offset, unit)) {
+                take();
+            }
+        }
+
+        if(assembler.flush(unit)) {
+            take();
+        }
+
+        vector<uint8_t> expected;
+        for(const Unit &nal : reference) {
+            expected.insert(expected.end(), nal.data.begin(), nal.data.end());
+        }
+
+        if(joined != expected) {
+            fail("access units don't contain all NALs");
+        }
+    }
+}
+
+void checkFramers(const uint8_t *data, const size_t size, const vector<size_t> &sizes, const size_t restoreAt) {
+    for(const Codec codec : {Codec::MJPEG, Codec::VP8, Codec::FWHT}) {
+        const vector<Unit> whole = frameChunked(codec, data, {size});
+        if(frameChunked(codec, data, sizes, restoreAt) != whole) {
+            fail("framer of codec " + to_string(static_cast<int>(codec)) + " differs between chunked and whole input");
+        }
+
+        for(const Unit &unit : whole) {
+            if(unit.offset < 0 || unit.offset + (long long)unit.data.size() > (long long)size) {
+                fail("frame outside of input");
+            }
+        }
+    }
+}
+
+void checkParsers(const uint8_t *data, const size_t size) {
+    const vector<char> input(data, data + size);
+
+    for(const Codec codec : {Codec::H264, Codec::HEVC}) {
+        const pair<int, int> imageSize = Decoder::probeImageSize(input, codec);
+        if(imageSize.first < 0 || imageSize.second < 0 || (imageSize.first == 0) != (imageSize.second == 0)) {
+            fail("probeImageSize returned invalid size");
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size) {
+    if(size < seedBytes) {
+        return 0;
+    }
+
+    uint32_t seed = 0;
+    memcpy(&seed, input, seedBytes);
+
+    const uint8_t *data = input + seedBytes;
+    const size_t dataSize = size - seedBytes;
+
+    const vector<size_t> sizes = chunkSizes(seed, dataSize);
+    const size_t restoreAt = sizes.empty() ? 0 : seed % sizes.size();
+
+    checkSplitter(data, dataSize, sizes, restoreAt);
+    checkFramers(data, dataSize, sizes, restoreAt);
+    checkParsers(data, dataSize);
+    return 0;
+}
+
+#ifndef V4L2_LIBFUZZER
+// window of video starting at a start code (so it begins like real input), with seed in front
+vector<uint8_t> videoWindow(const vector<uint8_t> &video, mt19937 &random, const size_t length) {
+    size_t start = video.size() > length ? random() % (video.size() - length) : 0;
+    const pair<int, int> startCode = NALSplitter::find(video.data(), video.size(), start);
+    if(startCode.first >= 0 && random() % 4 != 0) {
+        start = startCode.first;
+    }
+
+    vector<uint8_t> input(seedBytes);
+    for(auto &byte : input) {
+        byte = random();
+    }
+
+    input.insert(input.end(), video.begin() + min(start, video.size()), video.begin() + min(start + length, video.size()));
+    return input;
+}
+
+int main(int argc, char **argv) {
+    const string option = argc > 1 ? argv[1] : "";
+
+    if(option == "--corpus" && argc > 2) {
+        const string directory = argv[2];
+        const vector<uint8_t> video = readFile<uint8_t>(argc > 3 ? argv[3] : defaultInputPath);
+        if(video.empty()) {
+            cout << "Failed to open video file\n";
+            return 2;
+        }
+
+        mkdir(directory.c_str(), 0755);
+        mt19937 random(1);
+
+        for(int i = 0; i < corpusFiles; i++) {
+            const vector<uint8_t> input = videoWindow(video, random, i == 0 ? corpusUnitSize * 4 : corpusUnitSize);
+            ofstream file(directory + "/seed-" + to_string(i), ios::binary);
+            file.write(reinterpret_cast<const char *>(input.data()), input.size());
+        }
+
+        cout << "Wrote " << corpusFiles << " files to " << directory << "\n";
+        return 0;
+    }
+
+    if(option == "--random" && argc > 2) {
+        const long long iterations = atoll(argv[2]);
+        const vector<uint8_t> video = readFile<uint8_t>(argc > 3 ? argv[3] : defaultInputPath);
+        mt19937 random(random_device{}());
+
+        for(long long i = 0; i < iterations; i++) {
+            vector<uint8_t> input;
+            if(video.empty() || random() % 4 == 0) {
+                // short input of bytes which are significant to parsers, for other framers
+                input.resize(seedBytes + random() % 256);
+                const uint8_t values[] = {0x00, 0x01, 0x4F, 0xFF, 0xD8, 0xD9, 0xDA, 'D', 'K', 'I', 'F'};
+                for(auto &byte : input) {
+                    byte = random() % 2 ? values[random() % sizeof(values)] : random();
+                }
+            } else {
+                input = videoWindow(video, random, random() % corpusUnitSize + 1);
+            }
+
+            // flip, insert or remove some bytes (start codes and zeros are more likely than random bytes)
+            const int mutations = random() % 8;
+            for(int m = 0; m < mutations && input.size() > seedBytes; m++) {
+                const size_t position = seedBytes + random() % (input.size() - seedBytes);
+                const uint8_t values[] = {0x00, 0x01, 0xFF, 0xD8, 0xD9, (uint8_t)random()};
+                const uint8_t value = values[random() % sizeof(values)];
+
+                switch(random() % 3) {
+                    case 0: input[position] = value; break;
+                    case 1: input.insert(input.begin() + position, value); break;
+                    default: input.erase(input.begin() + position); break;
+                }
+            }
+
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+
+        cout << "Checked " << iterations << " random inputs\n";
+        return 0;
+    }
+
+    if(argc < 2) {
+        cout << "usage: fuzz [--corpus DIR [video]] [--random N [video]] [inputs...]\n";
+        return 1;
+    }
+
+    for(int i = 1; i < argc; i++) {
+        const vector<uint8_t> input = readFile<uint8_t>(argv[i]);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    cout << "Checked " << argc - 1 << " inputs\n";
+    return 0;
+}
+#endif
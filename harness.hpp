@@ -0,0 +1,133 @@
+// Reference splitting and helpers shared by the test tools (verify.cpp, fuzz.cpp)
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+/*
+    note for test tools:
+
+    optimized splitters are compared against referenceSplit, a byte by byte split of the whole
+    input, so both tools must agree on what the reference is - it lives only here
+
+    splitChunked and frameChunked pass input in given chunk sizes, and after chunk restoreAt they
+    continue from a checkpoint (getOffset and getPartial restored into a new splitter or framer)
+*/
+
+// NAL or frame as given by splitters and framers
+struct Unit {
+    vector<uint8_t> data;
+    int startCode;
+    long long offset;
+
+    bool operator==(const Unit &other) const {
+        return data == other.data && startCode == other.startCode && offset == other.offset;
+    }
+};
+
+// whole file as bytes (char or uint8_t), empty if it can't be read
+template<typename Byte>
+vector<Byte> readFile(const string &path) {
+    ifstream file(path, ios::binary);
+    return vector<Byte>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+// byte by byte search for 00 00 01, including a zero before it (reference of NALSplitter::find)
+inline pair<int, int> referenceFind(const uint8_t *data, const size_t size, const size_t from) {
+    for(size_t i = from; i + 3 <= size; i++) {
+        if(data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x01) {
+            return i > from && data[i - 1] == 0x00 ? make_pair((int)i - 1, 4) : make_pair((int)i, 3);
+        }
+    }
+
+    return {-1, 0};
+}
+
+// byte by byte split of the whole input (reference of NALSplitter and Annex-B framer)
+inline vector<Unit> referenceSplit(const uint8_t *data, const size_t size) {
+    vector<Unit> units;
+
+    pair<int, int> start = referenceFind(data, size, 0);
+    if(start.first < 0) {
+        // without any start code everything is given at the end as a single unit
+        if(size > 0) {
+            units.push_back({vector<uint8_t>(data, data + size), 0, 0});
+        }
+
+        return units;
+    }
+
+    while(true) {
+        const pair<int, int> next = referenceFind(data, size, start.first + start.second);
+        if(next.first < 0) {
+            break;
+        }
+
+        units.push_back({vector<uint8_t>(data + start.first, data + next.first), start.second, start.first});
+        start = next;
+    }
+
+    units.push_back({vector<uint8_t>(data + start.first, data + size), start.second, start.first});
+    return units;
+}
+
+// sizes of chunkSize byte chunks covering size bytes
+inline vector<size_t> fixedChunks(const size_t size, const size_t chunkSize) {
+    vector<size_t> sizes;
+    for(size_t position = 0; position < size; position += chunkSize) {
+        sizes.push_back(min(chunkSize, size - position));
+    }
+
+    return sizes;
+}
+
+// runs NALSplitter over input in chunks
+inline vector<Unit> splitChunked(const uint8_t *data, const vector<size_t> &sizes, const size_t restoreAt = SIZE_MAX) {
+    vector<Unit> units;
+    const auto output = [&](const uint8_t *nal, size_t size, int startCode, long long offset) {
+        units.push_back({vector<uint8_t>(nal, nal + size), startCode, offset});
+    };
+
+    NALSplitter splitter;
+    size_t position = 0;
+    for(size_t i = 0; i < sizes.size(); i++) {
+        splitter.push(data + position, sizes[i], output);
+        position += sizes[i];
+
+        if(i == restoreAt) {
+            NALSplitter restored;
+            restored.restore(splitter.getOffset(), splitter.getPartial());
+            splitter = move(restored);
+        }
+    }
+
+    splitter.flush(output);
+    return units;
+}
+
+// runs framer of codec over input in chunks
+inline vector<Unit> frameChunked(const Codec codec, const uint8_t *data, const vector<size_t> &sizes, const size_t restoreAt = SIZE_MAX) {
+    vector<Unit> units;
+    const Framer::Output output = [&](const uint8_t *unit, size_t size, int startCode, long long offset) {
+        units.push_back({vector<uint8_t>(unit, unit + size), startCode, offset});
+    };
+
+    unique_ptr<Framer> framer = Framer::create(codec);
+    size_t position = 0;
+    for(size_t i = 0; i < sizes.size(); i++) {
+        framer->push(data + position, sizes[i], output);
+        position += sizes[i];
+
+        if(i == restoreAt) {
+            unique_ptr<Framer> restored = Framer::create(codec);
+            restored->restore(framer->getOffset(), framer->getPartial());
+            framer = move(restored);
+        }
+    }
+
+    framer->flush(output);
+    return units;
+}
@@ -0,0 +1,383 @@
+// Decode-on-demand of H.264 (or HEVC) input
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#include "framecache.hpp"
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+const size_t lazyCacheFrames = 8; // decoded frames kept in cache (when it isn't shared)
+const int lazyPrefetchFrames = 15; // frames decoded ahead in direction of scrubbing
+
+/*
+    note for decode-on-demand:
+
+    StreamIndex parses input eagerly (which is cheap, done on CPU), and keeps every access unit
+    with its frame number and keyframe flag, while nothing is passed to the device
+
+    LazyDecoder decodes a frame only when it is requested: decoding starts from the last IDR
+    before it, goes up to the requested frame, and all decoded frames of that run (references
+    included) are kept in a small LRU cache, so following requests near the same position (also
+    stepping backwards) don't touch the device again - the requested frame is cached last, so
+    when the run doesn't fit, the oldest frames of it are evicted first
+
+    for scrubbing, LazyDecoder can use a shared, memory bounded FrameCache (see framecache.hpp),
+    optionally with downscaled proxies, and prefetch frames next to the requested one (in direction
+    of scrubbing) on a second decoder session in background
+
+    hardware time and copy-out then scale with requested frames, not with ingested input
+
+    frames are numbered in decode order, and it is expected to be the same as output order
+    (stream without B-frames, as from most camera encoders), otherwise request fails
+    for HEVC, keyframes are IRAP pictures (see note for NAL types)
+*/
+
+struct StreamIndex {
+private:
+    NALSplitter splitter;
+    AccessUnitAssembler assembler;
+    AccessUnit unit;
+
+    deque<AccessUnit> units; // references stay valid while it grows
+    vector<long long> keyframes; // frame numbers of IDRs, ascending
+    long long referenceFrames = 0;
+    size_t bytes = 0;
+
+    void store(AccessUnit &accessUnit) {
+        if(accessUnit.keyframe) {
+            keyframes.push_back(units.size());
+        }
+
+        referenceFrames += accessUnit.reference;
+        bytes += accessUnit.data.size();
+        units.push_back(move(accessUnit));
+    }
+public:
+    StreamIndex(const Codec codec = Codec::H264) : assembler(codec) {}
+
+    // parses next chunk of input, lastData closes the last access unit
+    void ingest(const char *data, const size_t size, const bool lastData = false) {
+        const auto output = [this](const uint8_t *nal, size_t nalSize, int, long long offset) {
+            push(nal, nalSize, offset);
+        };
+
+        splitter.push(reinterpret_cast<const uint8_t *>(data), size, output);
+
+        if(lastData) {
+            splitter.flush(output);
+            finish();
+        }
+    }
+
+    // adds NAL (with start code), for example from Decoder::addNALObserver
+    void push(const uint8_t *nal, const size_t size, const long long offset = -1) {
+        if(assembler.push(nal, size, offset, unit)) {
+            store(unit);
+        }
+    }
+
+    // closes the last access unit (at the end of stream)
+    void finish() {
+        if(assembler.flush(unit)) {
+            store(unit);
+        }
+    }
+
+    long long getFrames() {
+        return units.size();
+    }
+
+    const AccessUnit &getUnit(const long long frame) {
+        return units[frame];
+    }
+
+    // access units first..last (pointers stay valid while index grows)
+    vector<const AccessUnit *> getUnits(const long long first, const long long last) {
+        vector<const AccessUnit *> output;
+        for(long long i = first; i <= last; i++) {
+            output.push_back(&units[i]);
+        }
+
+        return output;
+    }
+
+    // frames which others may reference (non-reference ones can be dropped)
+    long long getReferenceFrames() {
+        return referenceFrames;
+    }
+
+    const vector<long long> &getKeyframes() {
+        return keyframes;
+    }
+
+    // frame number of the first IDR at or after frame (-1 if there is none)
+    long long keyframeAfter(const long long frame) {
+        auto position = lower_bound(keyframes.begin(), keyframes.end(), frame);
+        return position == keyframes.end() ? -1 : *position;
+    }
+
+    // frame number of the last IDR at or before frame (-1 if there is none)
+    long long keyframeBefore(const long long frame) {
+        auto position = upper_bound(keyframes.begin(), keyframes.end(), frame);
+        return position == keyframes.begin() ? -1 : *prev(position);
+    }
+
+    size_t getMemoryUsage() {
+        return bytes;
+    }
+};
+
+/*
+    decodes access units (the first one must be IDR) from a new stream position on a session,
+    and passes every decoded frame to output, frames is set to count of decoded frames
+*/
+inline Decoder::Status decodeUnits(Decoder &session, const vector<const AccessUnit *> &units, const function<void(const uint8_t *frame, size_t size, const pair<int, int> &imageSize)> &output, long long &frames) {
+    frames = 0;
+
+    if(units.empty() || !session.resetStream(units.front()->offset)) {
+        return Decoder::Status::FAILED;
+    }
+
+    const auto split = [&](Decoder::DecodedFrame &decodedFrame) {
+        if(decodedFrame.frames == 0) {
+            return;
+        }
+
+        const size_t frameSize = decodedFrame.output.size() / decodedFrame.frames;
+        for(int i = 0; i < decodedFrame.frames; i++) {
+            output(decodedFrame.output.data() + i * frameSize, frameSize, decodedFrame.imageSize);
+        }
+
+        frames += decodedFrame.frames;
+    };
+
+    for(const AccessUnit *unit : units) {
+        Decoder::DecodedFrame decodedFrame = session.decode(reinterpret_cast<const char *>(unit->data.data()), unit->data.size(), false);
+        if(decodedFrame.status != Decoder::Status::OK) {
+            return decodedFrame.status;
+        }
+
+        split(decodedFrame);
+    }
+
+    Decoder::DecodedFrame drained = session.drain();
+    if(drained.status != Decoder::Status::OK) {
+        return drained.status;
+    }
+
+    split(drained);
+    return Decoder::Status::OK;
+}
+
+class LazyDecoder {
+private:
+    Decoder &decoder;
+    StreamIndex index;
+    mutex indexMutex; // index is extended by ingest while prefetch session reads it (stored units don't move)
+
+    unique_ptr<FrameCache> ownCache;
+    FrameCache &cache;
+    int stream;
+    int proxyFactor;
+
+    long long requests = 0;
+    long long hits = 0; // requests of this stream returned from cache (cache may be shared)
+    long long decodedFrames = 0;
+    long long lastRequest = -1;
+
+    // prefetch session
+    Decoder *prefetchDecoder = nullptr;
+    int prefetchFrames = 0;
+    thread prefetchThread;
+    mutex prefetchMutex;
+    condition_variable prefetchCondition;
+    pair<long long, long long> prefetchRange = {-1, -1}; // pending range of frames (inclusive)
+    bool prefetchStop = false;
+    atomic<long long> prefetchedFrames{0};
+
+    // access units from the last IDR before first up to last (false if there is no such IDR)
+    bool collectUnits(const long long first, const long long last, long long &keyframe, vector<const AccessUnit *> &units) {
+        lock_guard<mutex> lock(indexMutex);
+
+        keyframe = first >= 0 && last < index.getFrames() && first <= last ? index.keyframeBefore(first) : -1;
+        if(keyframe < 0) {
+            return false;
+        }
+
+        units = index.getUnits(keyframe, last);
+        return true;
+    }
+
+    // decodes frames first..last on a session, from the last IDR before first, and caches the whole run
+    Decoder::Status decodeRange(Decoder &session, const long long first, const long long last, long long &decoded) {
+        decoded = 0;
+
+        long long keyframe;
+        vector<const AccessUnit *> units;
+        if(!collectUnits(first, last, keyframe, units)) {
+            return Decoder::Status::FAILED;
+        }
+
+        long long frame = keyframe;
+        const Decoder::Status status = decodeUnits(session, units, [&](const uint8_t *data, size_t frameSize, const pair<int, int> &imageSize) {
+            // frames cached before (for example by the other session) aren't copied again
+            if(frame >= first || !cache.contains(stream, frame)) {
+                if(proxyFactor > 1) {
+                    cache.put(stream, frame, downscaleFrame(data, imageSize, proxyFactor), {imageSize.first / proxyFactor, imageSize.second / proxyFactor});
+                } else {
+                    cache.put(stream, frame, vector<uint8_t>(data, data + frameSize), imageSize);
+                }
+            }
+
+            frame++;
+        }, decoded);
+
+        // output order didn't match decode order
+        return status == Decoder::Status::OK && frame != last + 1 ? Decoder::Status::FAILED : status;
+    }
+
+    void prefetchLoop() {
+        while(true) {
+            pair<long long, long long> range;
+            {
+                unique_lock<mutex> lock(prefetchMutex);
+                prefetchCondition.wait(lock, [this] { return prefetchStop || prefetchRange.first >= 0; });
+
+                if(prefetchStop) {
+                    return;
+                }
+
+                range = prefetchRange;
+                prefetchRange = {-1, -1};
+            }
+
+            {
+                lock_guard<mutex> lock(indexMutex);
+                range.second = min(range.second, index.getFrames() - 1);
+            }
+
+            // only frames which aren't cached yet
+            while(range.first <= range.second && cache.contains(stream, range.first)) range.first++;
+            while(range.first <= range.second && cache.contains(stream, range.second)) range.second--;
+
+            long long decoded = 0;
+            if(range.first <= range.second) {
+                decodeRange(*prefetchDecoder, range.first, range.second, decoded);
+                prefetchedFrames += decoded;
+            }
+        }
+    }
+public:
+    // decoder must be initialized, and it is used only by this object, decoded frames are kept in its own cache
+    LazyDecoder(Decoder &videoDecoder, const size_t cachedFrames = lazyCacheFrames) : decoder(videoDecoder), index(videoDecoder.getCodec()), ownCache(new FrameCache(SIZE_MAX, max<size_t>(cachedFrames, 1))), cache(*ownCache), stream(0), proxyFactor(1) {}
+
+    /*
+        decoded frames are kept in a shared cache as streamNumber, with proxyFactor > 1
+        they are downscaled by it (and requests return downscaled frames)
+    */
+    LazyDecoder(Decoder &videoDecoder, FrameCache &frameCache, const int streamNumber = 0, const int factor = 1) : decoder(videoDecoder), index(videoDecoder.getCodec()), cache(frameCache), stream(streamNumber), proxyFactor(max(factor, 1)) {}
+
+    ~LazyDecoder() { stopPrefetch(); }
+
+    // indexes next chunk of input (nothing is decoded)
+    void ingest(const char *data, const size_t size, const bool lastData = false) {
+        lock_guard<mutex> lock(indexMutex);
+        index.ingest(data, size, lastData);
+    }
+
+    void ingest(const vector<char> &data, const bool lastData = false) {
+        ingest(data.data(), data.size(), lastData);
+    }
+
+    // should be read on the thread which ingests
+    StreamIndex &getIndex() {
+        return index;
+    }
+
+    // returns a single decoded frame (frames = 1), decoding it (and its references) if it isn't cached
+    Decoder::DecodedFrame request(const long long frame) {
+        Decoder::DecodedFrame returnedOutput;
+        requests++;
+
+        if(cache.get(stream, frame, returnedOutput.output, returnedOutput.imageSize)) {
+            hits++;
+        } else {
+            // decode from IDR up to the requested frame
+            long long decoded = 0;
+            returnedOutput.status = decodeRange(decoder, frame, frame, decoded);
+            decodedFrames += decoded;
+            if(returnedOutput.status != Decoder::Status::OK || !cache.get(stream, frame, returnedOutput.output, returnedOutput.imageSize, false)) {
+                returnedOutput.output.clear();
+                returnedOutput.status = returnedOutput.status == Decoder::Status::OK ? Decoder::Status::FAILED : returnedOutput.status;
+                return returnedOutput;
+            }
+        }
+
+        // prefetch neighbours in the direction of scrubbing
+        if(prefetchDecoder && lastRequest >= 0 && frame != lastRequest) {
+            lock_guard<mutex> lock(prefetchMutex);
+            prefetchRange = frame > lastRequest ? make_pair(frame + 1, frame + prefetchFrames) : make_pair(max(frame - prefetchFrames, 0LL), frame - 1);
+            if(prefetchRange.first > prefetchRange.second) {
+                prefetchRange = {-1, -1};
+            }
+            prefetchCondition.notify_one();
+        }
+
+        lastRequest = frame;
+        returnedOutput.frames = 1;
+        return returnedOutput;
+    }
+
+    /*
+        starts background prefetch of frames following the requested ones (in direction of
+        previous requests) on another initialized decoder session
+    */
+    void startPrefetch(Decoder &session, const int frames = lazyPrefetchFrames) {
+        stopPrefetch();
+
+        prefetchDecoder = &session;
+        prefetchFrames = max(frames, 1);
+        prefetchStop = false;
+        prefetchThread = thread(&LazyDecoder::prefetchLoop, this);
+    }
+
+    void stopPrefetch() {
+        if(prefetchThread.joinable()) {
+            {
+                lock_guard<mutex> lock(prefetchMutex);
+                prefetchStop = true;
+            }
+
+            prefetchCondition.notify_one();
+            prefetchThread.join();
+        }
+
+        prefetchDecoder = nullptr;
+        prefetchRange = {-1, -1};
+    }
+
+    long long getRequests() {
+        return requests;
+    }
+
+    // share of requests of this stream returned from cache
+    double getHitRatio() {
+        return requests > 0 ? (double)hits / requests : 0;
+    }
+
+    // frames decoded by the device for requests (including references of requested frames)
+    long long getDecodedFrames() {
+        return decodedFrames;
+    }
+
+    // frames decoded by the prefetch session
+    long long getPrefetchedFrames() {
+        return prefetchedFrames;
+    }
+};
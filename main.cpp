@@ -1,73 +1,638 @@
 #include "decoder.hpp"
+#include "source.hpp"
+#include "framecache.hpp"
+#include "transcode.hpp"
+#include "deinterlace.hpp"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <glob.h>
 using namespace std;
 
-// required settings
-const int inputVideoWidth = 1920;
-const int inputVideoHeight = 1080;
-const string inputVideoPath = "video.h264";
-const int chunkSize = 20480; // 20 KiB
+// default settings
+const string defaultInputPath = "video.h264";
+const int probeSize = 1024 * 1024; // input read for detecting image size
+const int writerQueueSize = 8; // decoded chunks waiting to be written
+const int defaultThumbnailWidth = 320;
 
-const string outputPath = "video.yuv";
+struct Options {
+    vector<string> inputs;
+    string outputDirectory = ".";
+    bool writeOutput = true;
+    int jobs = 1;
+    int chunkSize = 0; // autotuned
+    int maxMemory = 256 * 1024;
+    string device = decoderDev;
+    bool keyframesOnly = false;
+    bool thumbnail = false;
+    int thumbnailWidth = defaultThumbnailWidth;
+    int encodeBitrate = 0; // kbit/s, 0 for decoding only
+    pair<int, int> scaledSize = {0, 0};
+    bool hevc = false; // all inputs are HEVC, otherwise detected from extension
+    bool deinterlace = false; // interlaced frames are made progressive before writing
+    Deinterlacer::Method deinterlaceMethod = Deinterlacer::Method::MOTION_ADAPTIVE;
+};
 
-int main() {
-    Decoder decoder;
+struct FileResult {
+    string path;
+    string status = "ok";
+    pair<int, int> imageSize;
+    long long inputBytes = 0;
+    long long frames = 0;
+    double seconds = 0;
+    int chunkSize = 0;
+};
 
+// writes decoded data on its own thread, so decoding doesn't wait for storage
+struct AsyncWriter {
+private:
+    ofstream output;
+    deque<vector<uint8_t>> queue;
+    mutex queueLock;
+    condition_variable queueChanged;
+    bool finished = false;
+    bool failed = false;
+    thread worker;
+
+    void run() {
+        while(true) {
+            vector<uint8_t> data;
+
+            {
+                unique_lock<mutex> lock(queueLock);
+                queueChanged.wait(lock, [&]() { return finished || !queue.empty(); });
+                if(queue.empty()) return;
+
+                data = move(queue.front());
+                queue.pop_front();
+            }
+
+            queueChanged.notify_all();
+
+            output.write(reinterpret_cast<const char *>(data.data()), data.size());
+            if(!output) {
+                lock_guard<mutex> lock(queueLock);
+                failed = true;
+            }
+        }
+    }
+public:
+    bool open(const string &path) {
+        output.open(path, ios::binary | ios::trunc);
+        if(!output) return false;
+
+        finished = false;
+        failed = false;
+        worker = thread(&AsyncWriter::run, this);
+        return true;
+    }
+
+    // blocks while queue is full (backpressure to decoder)
+    bool write(vector<uint8_t> &&data) {
+        unique_lock<mutex> lock(queueLock);
+        queueChanged.wait(lock, [&]() { return queue.size() < writerQueueSize; });
+        queue.push_back(move(data));
+        const bool writeFailed = failed;
+        lock.unlock();
+
+        queueChanged.notify_all();
+        return !writeFailed;
+    }
+
+    bool close() {
+        if(!worker.joinable()) return true;
+
+        {
+            lock_guard<mutex> lock(queueLock);
+            finished = true;
+        }
+
+        queueChanged.notify_all();
+        worker.join();
+        output.close();
+        return !failed;
+    }
+
+    ~AsyncWriter() { close(); }
+};
+
+string outputPathFor(const Options &options, const string &inputPath) {
+    string name = inputPath.substr(inputPath.find_last_of('/') + 1);
+    const size_t extension = name.find_last_of('.');
+    if(extension != string::npos) {
+        name = name.substr(0, extension);
+    }
+
+    if(options.encodeBitrate > 0) {
+        return options.outputDirectory + "/" + name + ".transcoded.h264";
+    }
+
+    return options.outputDirectory + "/" + name + (options.thumbnail ? ".thumb.yuv" : ".yuv");
+}
+
+// HEVC for .h265, .265 and .hevc files, H.264 otherwise
+Codec codecFor(const Options &options, const string &inputPath) {
+    const string extension = inputPath.substr(inputPath.find_last_of('.') + 1);
+    return options.hevc || extension == "h265" || extension == "265" || extension == "hevc" ? Codec::HEVC : Codec::H264;
+}
+
+// initializes decoder for the input, with video size detected from SPS in data
+bool startDecoding(Decoder &decoder, const Options &options, const vector<char> &data, FileResult &result) {
+    const Codec codec = codecFor(options, result.path);
+    result.imageSize = Decoder::probeImageSize(data, codec);
+    if(result.imageSize.first <= 0) {
+        result.status = "no_sps";
+        return false;
+    }
+
+    decoder.unload();
+    Decoder::InitStatus initStatus = decoder.initializeDecoder(result.imageSize.first, result.imageSize.second, options.maxMemory, options.device, -1, codec);
+    if(initStatus != Decoder::InitStatus::OK) {
+        result.status = "init_failed_" + to_string(static_cast<int>(initStatus));
+        return false;
+    }
+
+    decoder.setKeyframesOnly(options.keyframesOnly || options.thumbnail);
+    return true;
+}
+
+// stores decoded frames (stride is luma bytes per line of them), returns false when decoding should stop
+bool handleDecoded(Decoder::DecodedFrame &decodedFrame, const Options &options, AsyncWriter &writer, FileResult &result, Deinterlacer &deinterlacer, const int stride) {
+    if(decodedFrame.status != Decoder::Status::OK) {
+        result.status = "decode_failed_" + to_string(static_cast<int>(decodedFrame.status));
+        return false;
+    }
+
+    if(decodedFrame.frames == 0) {
+        return true;
+    }
+
+    if(options.deinterlace && !deinterlacer.process(decodedFrame, stride)) {
+        result.status = "deinterlace_failed";
+        return false;
+    }
+
+    result.imageSize = decodedFrame.imageSize;
+
+    if(options.thumbnail) {
+        // first decoded keyframe is enough
+        result.frames = 1;
+
+        int factor = 1;
+        while(decodedFrame.imageSize.first / (factor * 2) >= options.thumbnailWidth) {
+            factor *= 2;
+        }
+
+        if(options.writeOutput) {
+            writer.write(downscaleFrame(decodedFrame.output.data(), decodedFrame.imageSize, factor, stride));
+        }
+
+        result.imageSize = {decodedFrame.imageSize.first / factor, decodedFrame.imageSize.second / factor};
+        return false;
+    }
+
+    result.frames += decodedFrame.frames;
+    if(options.writeOutput && !writer.write(move(decodedFrame.output))) {
+        result.status = "write_failed";
+        return false;
+    }
+
+    return true;
+}
+
+// stores frames still inside the device at the end of input
+void drainDecoding(Decoder &decoder, const Options &options, AsyncWriter &writer, FileResult &result, Deinterlacer &deinterlacer) {
+    auto decodedFrame = decoder.drain();
+    handleDecoded(decodedFrame, options, writer, result, deinterlacer, decoder.getCaptureStride());
+}
+
+void finishDecoding(Decoder &decoder, AsyncWriter &writer, FileResult &result, const chrono::steady_clock::time_point &start) {
+    if(!writer.close() && result.status == "ok") {
+        result.status = "write_failed";
+    }
+
+    decoder.unload();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+FileResult decodeFile(Decoder &decoder, const Options &options, const string &path) {
+    FileResult result;
+    result.path = path;
+    const auto fileStart = chrono::steady_clock::now();
+
+    vector<char> data(probeSize);
     {
-        Decoder::InitStatus initStatus = decoder.initializeDecoder(inputVideoWidth, inputVideoHeight, 256 * 1024);
-        if(initStatus != Decoder::InitStatus::OK) {
-            cout << "Failed initializing decoder, error code: " << static_cast<int>(initStatus) << "\n";
-            return 1;
+        ifstream probeFile(path, ios::binary);
+        if(!probeFile) {
+            result.status = "open_failed";
+            return result;
         }
+
+        probeFile.read(data.data(), data.size());
+        data.resize(probeFile.gcount());
+    }
+
+    if(!startDecoding(decoder, options, data, result)) {
+        return result;
     }
-    
-    ifstream videoFile(inputVideoPath, ios::binary);
-    if(!videoFile) {
-        cout << "Failed to open video file\n";
-        return 2;
+
+    FileSource videoFile;
+    if(!videoFile.open(path, options.chunkSize, decoder.getInputBufferSize())) {
+        result.status = "open_failed";
+        return result;
     }
 
-    ofstream outputFile(outputPath, ios::binary | ios::app);
-    if(!outputFile) {
-        cout << "Failed opening output file\n";
-        return 3;
+    AsyncWriter writer;
+    if(options.writeOutput && !writer.open(outputPathFor(options, path))) {
+        result.status = "output_failed";
+        return result;
     }
 
-    // load the video data from the file fully
-    vector<char> data(chunkSize);
+    Deinterlacer deinterlacer(options.deinterlaceMethod);
 
-    while(videoFile) {
-        videoFile.read(data.data(), data.size());
-        streamsize read = videoFile.gcount();
-        if(read <= 0) break;
-        data.resize(read);
+    // chunks are taken from readahead buffers without copying
+    const char *chunk;
+    int chunkSize;
+
+    bool decoding = true;
+    while(decoding && videoFile.read(chunk, chunkSize)) {
+        result.inputBytes += chunkSize;
+        const bool isLast = videoFile.last();
 
         // decoding time measurement
-        auto decodingStart = chrono::high_resolution_clock::now();
+        auto decodingStart = chrono::steady_clock::now();
+        auto decodedFrame = decoder.decode(chunk, chunkSize, isLast);
+        videoFile.report(chrono::duration<double>(chrono::steady_clock::now() - decodingStart).count());
+
+        decoding = handleDecoded(decodedFrame, options, writer, result, deinterlacer, decoder.getCaptureStride());
+    }
+
+    result.chunkSize = videoFile.chunkSize();
+
+    if(videoFile.failed() && result.status == "ok") {
+        result.status = "read_failed";
+    }
+
+    if(decoding && result.status == "ok") {
+        drainDecoding(decoder, options, writer, result, deinterlacer);
+    }
 
-        // decode the data
-        bool isLast = (read < chunkSize || videoFile.peek() == EOF);
-        auto decodedFrame = decoder.decode(data, isLast);
+    finishDecoding(decoder, writer, result, fileStart);
+    return result;
+}
 
-        if(decodedFrame.status != Decoder::Status::OK) {
-            cout << "Failed decoding, error code: " << static_cast<int>(decodedFrame.status) << "\n";
-            return 4;
+// re-encodes the input on hardware encoder (decoded frames are passed as dmabufs, never copied)
+FileResult transcodeFile(const Options &options, const string &path) {
+    FileResult result;
+    result.path = path;
+    const auto fileStart = chrono::steady_clock::now();
+
+    vector<char> data(probeSize);
+    {
+        ifstream probeFile(path, ios::binary);
+        if(!probeFile) {
+            result.status = "open_failed";
+            return result;
         }
 
-        auto decodingEnd = chrono::high_resolution_clock::now();
-        auto decodingDuration = chrono::duration_cast<chrono::milliseconds>(decodingEnd - decodingStart).count();
+        probeFile.read(data.data(), data.size());
+        data.resize(probeFile.gcount());
+    }
+
+    result.imageSize = Decoder::probeImageSize(data, codecFor(options, path));
+    if(result.imageSize.first <= 0) {
+        result.status = "no_sps";
+        return result;
+    }
 
-        // write chunk to a file
-        if(!decodedFrame.output.empty()) {
-            cout << "Decoded frame successfully in " << decodedFrame.imageSize.first << "x" << decodedFrame.imageSize.second << " for " << decodingDuration << "ms\n";
-            outputFile.write(reinterpret_cast<const char *>(decodedFrame.output.data()), decodedFrame.output.size());
+    TranscodeOptions transcodeOptions;
+    transcodeOptions.bitrate = options.encodeBitrate * 1000;
+    transcodeOptions.scaledSize = options.scaledSize;
+    transcodeOptions.decoderDevice = options.device;
+    transcodeOptions.inputCodec = codecFor(options, path);
+
+    Transcoder transcoder;
+    Decoder::InitStatus initStatus = transcoder.initialize(result.imageSize.first, result.imageSize.second, transcodeOptions);
+    if(initStatus != Decoder::InitStatus::OK) {
+        result.status = "init_failed_" + to_string(static_cast<int>(initStatus));
+        return result;
+    }
+
+    FileSource videoFile;
+    if(!videoFile.open(path, options.chunkSize)) {
+        result.status = "open_failed";
+        return result;
+    }
+
+    AsyncWriter writer;
+    if(options.writeOutput && !writer.open(outputPathFor(options, path))) {
+        result.status = "output_failed";
+        return result;
+    }
+
+    const char *chunk;
+    int chunkSize;
+
+    while(videoFile.read(chunk, chunkSize)) {
+        result.inputBytes += chunkSize;
+
+        auto encodedData = transcoder.transcode(chunk, chunkSize, videoFile.last());
+        if(encodedData.status != Decoder::Status::OK) {
+            result.status = "transcode_failed";
+            break;
+        }
+
+        result.frames += encodedData.frames;
+        if(options.writeOutput && !encodedData.output.empty() && !writer.write(move(encodedData.output))) {
+            result.status = "write_failed";
+            break;
         }
     }
 
-    // unload and close the decoder
-    decoder.unload();
-    
-    return 0;
-}
\ No newline at end of file
+    result.chunkSize = videoFile.chunkSize();
+    if(options.scaledSize.first > 0) {
+        result.imageSize = options.scaledSize;
+    }
+
+    if(videoFile.failed() && result.status == "ok") {
+        result.status = "read_failed";
+    }
+
+    if(!writer.close() && result.status == "ok") {
+        result.status = "write_failed";
+    }
+
+    transcoder.unload();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - fileStart).count();
+    return result;
+}
+
+// decodes live input from stdin (for example rpicam-vid -o - | ./v4l2 -)
+FileResult decodeStream(Decoder &decoder, const Options &options, const int fd) {
+    FileResult result;
+    result.path = "-";
+    const auto streamStart = chrono::steady_clock::now();
+
+    StreamSource stream;
+    if(!stream.open(fd)) {
+        result.status = "open_failed";
+        return result;
+    }
+
+    const char *chunk;
+    int chunkSize;
+
+    // receive until SPS shows up
+    bool started = false;
+    while(!started && !stream.finished()) {
+        stream.wait(eventTimeout);
+        stream.receive();
+
+        if(stream.next(chunk, chunkSize)) {
+            started = Decoder::probeImageSize(vector<char>(chunk, chunk + chunkSize), codecFor(options, "-")).first > 0 || stream.occupancy() >= 1;
+        }
+    }
+
+    if(!started || !startDecoding(decoder, options, vector<char>(chunk, chunk + chunkSize), result)) {
+        if(result.status == "ok") result.status = "no_sps";
+        return result;
+    }
+
+    AsyncWriter writer;
+    if(options.writeOutput && !writer.open(outputPathFor(options, "stream"))) {
+        result.status = "output_failed";
+        return result;
+    }
+
+    Deinterlacer deinterlacer(options.deinterlaceMethod);
+
+    bool decoding = true;
+    while(decoding && !stream.finished()) {
+        if(!stream.next(chunk, chunkSize)) {
+            stream.wait(eventTimeout);
+            stream.receive();
+            continue;
+        }
+
+        result.inputBytes += chunkSize;
+        auto decodedFrame = decoder.decode(chunk, chunkSize, stream.last());
+        stream.release();
+
+        decoding = handleDecoded(decodedFrame, options, writer, result, deinterlacer, decoder.getCaptureStride());
+    }
+
+    if(stream.failed() && result.status == "ok") {
+        result.status = "read_failed";
+    }
+
+    if(decoding && result.status == "ok") {
+        drainDecoding(decoder, options, writer, result, deinterlacer);
+    }
+
+    finishDecoding(decoder, writer, result, streamStart);
+    return result;
+}
+
+string escapeJSON(const string &text) {
+    string output;
+    for(const char character : text) {
+        if(character == '"' || character == '\\') {
+            output += '\\';
+            output += character;
+        } else if((unsigned char)character < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+            output += escaped;
+        } else {
+            output += character;
+        }
+    }
+
+    return output;
+}
+
+void printUsage() {
+    cout << "usage: v4l2 [options] [files or glob patterns...]   (- for stdin)\n"
+         << "  -j, --jobs N          concurrent decoder sessions (default 1)\n"
+         << "  -l, --list FILE       read input paths from FILE (one per line)\n"
+         << "  -o, --output DIR      output directory (default .)\n"
+         << "  -n, --no-output       decode without writing output\n"
+         << "  -c, --chunk BYTES     input chunk size (default auto)\n"
+         << "  -d, --device PATH     decoder device (default " << decoderDev << ")\n"
+         << "  -m, --max-memory KIB  process memory limit (default 262144, -1 for automatic)\n"
+         << "  -k, --keyframes       decode keyframes only\n"
+         << "  -H, --hevc            input is HEVC (default for .h265, .265 and .hevc files)\n"
+         << "  -t, --thumbnail [W]   write downscaled first keyframe only (default width " << defaultThumbnailWidth << ")\n"
+         << "  -i, --deinterlace [M] deinterlace interlaced frames, M is bob, blend or motion (default)\n"
+         << "  -e, --encode KBPS     re-encode to H.264 at KBPS on " << encoderDev << " instead of writing YUV\n"
+         << "  -s, --scale WxH       scale re-encoded output on " << scalerDev << "\n";
+}
+
+bool addInput(Options &options, const string &pattern) {
+    if(pattern.find_first_of("*?[") == string::npos) {
+        options.inputs.push_back(pattern);
+        return true;
+    }
+
+    glob_t matches;
+    if(glob(pattern.c_str(), 0, nullptr, &matches) != 0) {
+        globfree(&matches);
+        return false;
+    }
+
+    for(size_t i = 0; i < matches.gl_pathc; i++) {
+        options.inputs.push_back(matches.gl_pathv[i]);
+    }
+
+    globfree(&matches);
+    return true;
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+    for(int i = 1; i < argc; i++) {
+        const string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if((argument == "-j" || argument == "--jobs") && hasValue) {
+            options.jobs = max(1, atoi(argv[++i]));
+        } else if((argument == "-l" || argument == "--list") && hasValue) {
+            ifstream list(argv[++i]);
+            if(!list) return false;
+
+            string line;
+            while(getline(list, line)) {
+                if(!line.empty()) options.inputs.push_back(line);
+            }
+        } else if((argument == "-o" || argument == "--output") && hasValue) {
+            options.outputDirectory = argv[++i];
+        } else if(argument == "-n" || argument == "--no-output") {
+            options.writeOutput = false;
+        } else if((argument == "-c" || argument == "--chunk") && hasValue) {
+            const string size = argv[++i];
+            options.chunkSize = size == "auto" ? 0 : max(1, atoi(size.c_str()));
+        } else if((argument == "-d" || argument == "--device") && hasValue) {
+            options.device = argv[++i];
+        } else if((argument == "-m" || argument == "--max-memory") && hasValue) {
+            options.maxMemory = atoi(argv[++i]);
+        } else if(argument == "-k" || argument == "--keyframes") {
+            options.keyframesOnly = true;
+        } else if(argument == "-H" || argument == "--hevc") {
+            options.hevc = true;
+        } else if(argument == "-t" || argument == "--thumbnail") {
+            options.thumbnail = true;
+            if(hasValue && isdigit(argv[i + 1][0])) {
+                options.thumbnailWidth = max(1, atoi(argv[++i]));
+            }
+        } else if(argument == "-i" || argument == "--deinterlace") {
+            options.deinterlace = true;
+            if(hasValue && argv[i + 1][0] != '-') {
+                const string method = argv[i + 1];
+                if(method == "bob" || method == "blend" || method == "motion") {
+                    options.deinterlaceMethod = method == "bob" ? Deinterlacer::Method::BOB : method == "blend" ? Deinterlacer::Method::BLEND : Deinterlacer::Method::MOTION_ADAPTIVE;
+                    i++;
+                }
+            }
+        } else if((argument == "-e" || argument == "--encode") && hasValue) {
+            options.encodeBitrate = max(1, atoi(argv[++i]));
+        } else if((argument == "-s" || argument == "--scale") && hasValue) {
+            if(sscanf(argv[++i], "%dx%d", &options.scaledSize.first, &options.scaledSize.second) != 2) return false;
+        } else if(argument == "-") {
+            options.inputs.push_back(argument);
+        } else if(argument == "-h" || argument == "--help" || argument[0] == '-') {
+            return false;
+        } else if(!addInput(options, argument)) {
+            cerr << "No files match " << argument << "\n";
+        }
+    }
+
+    if(options.inputs.empty() && argc == 1) {
+        options.inputs.push_back(defaultInputPath);
+    }
+
+    return !options.inputs.empty();
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if(!parseOptions(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    // kill -USR2 writes trace of decoding stages to output directory (when built with -DV4L2_TRACE)
+    traceInstallSignal(SIGUSR2, options.outputDirectory);
+
+    vector<FileResult> results(options.inputs.size());
+    size_t nextInput = 0;
+    mutex workLock;
+
+    const auto batchStart = chrono::steady_clock::now();
+
+    // each session takes next file from the work queue
+    auto session = [&]() {
+        Decoder decoder;
+
+        while(true) {
+            size_t input;
+            {
+                lock_guard<mutex> lock(workLock);
+                if(nextInput >= options.inputs.size()) return;
+                input = nextInput++;
+            }
+
+            if(options.inputs[input] == "-") {
+                results[input] = decodeStream(decoder, options, STDIN_FILENO);
+            } else if(options.encodeBitrate > 0) {
+                results[input] = transcodeFile(options, options.inputs[input]);
+            } else {
+                results[input] = decodeFile(decoder, options, options.inputs[input]);
+            }
+        }
+    };
+
+    vector<thread> sessions;
+    for(int i = 0; i < min<int>(options.jobs, options.inputs.size()); i++) {
+        sessions.emplace_back(session);
+    }
+
+    for(auto &worker : sessions) {
+        worker.join();
+    }
+
+    const double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+
+    // report in JSON
+    long long totalFrames = 0, totalBytes = 0;
+    int failedFiles = 0;
+    ostringstream report;
+
+    report << "{\n  \"files\": [\n";
+    for(size_t i = 0; i < results.size(); i++) {
+        const FileResult &result = results[i];
+        totalFrames += result.frames;
+        totalBytes += result.inputBytes;
+        failedFiles += result.status != "ok";
+
+        report << "    {\"path\": \"" << escapeJSON(result.path) << "\", \"status\": \"" << result.status
+               << "\", \"width\": " << result.imageSize.first << ", \"height\": " << result.imageSize.second
+               << ", \"frames\": " << result.frames << ", \"bytes\": " << result.inputBytes
+               << ", \"chunk\": " << result.chunkSize << ", \"seconds\": " << result.seconds
+               << ", \"fps\": " << (result.seconds > 0 ? result.frames / result.seconds : 0) << "}"
+               << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    report << "  ],\n  \"total\": {\"files\": " << results.size() << ", \"failed\": " << failedFiles
+           << ", \"jobs\": " << options.jobs << ", \"frames\": " << totalFrames << ", \"bytes\": " << totalBytes
+           << ", \"seconds\": " << batchSeconds
+           << ", \"fps\": " << (batchSeconds > 0 ? totalFrames / batchSeconds : 0)
+           << ", \"throughput_mbps\": " << (batchSeconds > 0 ? totalBytes * 8 / batchSeconds / 1e6 : 0) << "}\n}\n";
+
+    cout << report.str();
+
+    return failedFiles == 0 ? 0 : 4;
+}
@@ -0,0 +1,487 @@
+// Graph of processing stages connected by lock-free queues, run on a thread pool
+// Written by ukicomputers
+
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+using namespace std;
+
+// default settings
+const size_t pipelineQueueSize = 8; // payloads waiting between two stages
+const int pipelineBatch = 4; // payloads a stage processes before the worker moves on
+const int pipelineIdleWait = 2; // maximal sleep (ms) of a worker which found no work
+
+/*
+    note for pipelines:
+
+    Pipeline connects stages (for example source -> NAL filter -> decode -> scale -> sink) without
+    writing threads for each of them, every connection is a bounded single producer, single consumer
+    lock-free queue of Payload<T> (shared_ptr to const T), so payloads are passed without copying and
+    one output can feed multiple stages (each gets its own queue and a reference to the same payload)
+
+    stage types are checked when stages are connected:
+        Pipeline pipeline;
+        auto chunks = pipeline.addSource<vector<char>>("read", [&](Emitter<vector<char>> &output) {
+            ...
+            output.emit(make_shared<vector<char>>(chunk));
+            return file.last() ? Pipeline::Result::END : Pipeline::Result::MORE;
+        });
+        auto frames = pipeline.addStage<Decoder::DecodedFrame>("decode", chunks,
+            [&](const Payload<vector<char>> &chunk, Emitter<Decoder::DecodedFrame> &output) {
+                auto frame = make_shared<Decoder::DecodedFrame>(decoder.decode(*chunk, false));
+                if(frame->frames > 0) output.emit(frame);
+                return frame->status == Decoder::Status::OK;
+            },
+            [&](Emitter<Decoder::DecodedFrame> &output) { ... decoder.drain() ... }); // at the end of input
+        pipeline.addSink("write", frames, [&](const Payload<Decoder::DecodedFrame> &frame) { ...; return true; });
+        pipeline.start(3);
+        pipeline.wait();
+
+    a stage may emit any number of payloads for each input, those which don't fit into a full queue
+    wait inside the stage, which doesn't get new input until they are queued (backpressure)
+    stage functions return false on failure, which stops the whole pipeline
+
+    workers of the pool run any stage which has work, but a stage never runs on two workers at once,
+    so stage functions don't need locking, a stage which blocks (for example decoding) occupies its worker,
+    so there should be at least as many workers as blocking stages
+
+    metrics of every stage (payloads in and out, busy time, queue occupancy, stalls on full queues)
+    are collected all the time, and read by getMetrics
+*/
+
+template<typename T>
+using Payload = shared_ptr<const T>;
+
+// bounded ring, push only from one thread, pop only from one (other) thread
+template<typename T>
+class SPSCQueue {
+private:
+    vector<T> slots;
+    alignas(64) atomic<size_t> head{0}; // next to pop, written by consumer
+    alignas(64) atomic<size_t> tail{0}; // next to push, written by producer
+public:
+    SPSCQueue(const size_t capacity) : slots(max<size_t>(capacity, 1)) {}
+
+    bool push(T &item) {
+        const size_t position = tail.load(memory_order_relaxed);
+        if(position - head.load(memory_order_acquire) == slots.size()) {
+            return false;
+        }
+
+        slots[position % slots.size()] = move(item);
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        const size_t position = head.load(memory_order_relaxed);
+        if(position == tail.load(memory_order_acquire)) {
+            return false;
+        }
+
+        // moving out leaves the slot empty, so payload isn't kept alive by the queue
+        item = move(slots[position % slots.size()]);
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+};
+
+struct PipelineNode {
+    string name;
+
+    atomic<bool> busy{false}; // being run by a worker
+    atomic<bool> done{false}; // everything is processed and emitted
+
+    // metrics
+    atomic<long long> inputs{0};
+    atomic<long long> outputs{0};
+    atomic<long long> busyTime{0}; // ns spent in runs which processed something
+    atomic<long long> stalls{0}; // payloads which found a full queue
+    atomic<size_t> maxQueued{0};
+
+    PipelineNode(const string &stageName) : name(stageName) {}
+    virtual ~PipelineNode() = default;
+
+    // processes a batch, progress is set if anything was consumed or emitted, returns false on failure
+    virtual bool run(bool &progress) = 0;
+
+    // payloads waiting in input queue
+    virtual size_t queued() {
+        return 0;
+    }
+};
+
+// outputs of a stage, with a queue for every connected stage
+template<typename T>
+class Emitter {
+private:
+    PipelineNode &node;
+    vector<unique_ptr<SPSCQueue<Payload<T>>>> queues;
+    vector<deque<Payload<T>>> overflow; // emitted, not fitting into the queue yet
+public:
+    Emitter(PipelineNode &owner) : node(owner) {}
+
+    // passes payload to every connected stage
+    void emit(const Payload<T> &payload) {
+        node.outputs++;
+
+        for(size_t i = 0; i < queues.size(); i++) {
+            Payload<T> item = payload;
+            if(!overflow[i].empty() || !queues[i]->push(item)) {
+                overflow[i].push_back(move(item));
+                node.stalls++;
+            }
+        }
+    }
+
+    // queues waiting payloads, returns true if nothing is waiting anymore
+    bool flush(bool &progress) {
+        bool flushed = true;
+
+        for(size_t i = 0; i < queues.size(); i++) {
+            while(!overflow[i].empty() && queues[i]->push(overflow[i].front())) {
+                overflow[i].pop_front();
+                progress = true;
+            }
+
+            flushed = flushed && overflow[i].empty();
+        }
+
+        return flushed;
+    }
+
+    // only while pipeline isn't running
+    SPSCQueue<Payload<T>> *connect(const size_t queueSize) {
+        queues.emplace_back(new SPSCQueue<Payload<T>>(queueSize));
+        overflow.emplace_back();
+        return queues.back().get();
+    }
+};
+
+class Pipeline {
+public:
+    enum class Result {
+        MORE, // source has more to give
+        END, // end of input
+        FAILED
+    };
+
+    // output of a stage, which next stages are connected to
+    template<typename T>
+    struct Port {
+        PipelineNode *node = nullptr;
+        Emitter<T> *emitter = nullptr;
+    };
+
+    struct StageMetrics {
+        string name;
+        long long inputs = 0;
+        long long outputs = 0;
+        double busySeconds = 0;
+        double utilization = 0; // busy time / time since start (0 - 1)
+        double latency = 0; // average busy time per input in ms
+        size_t queued = 0; // payloads waiting in input queue now
+        size_t maxQueued = 0;
+        long long stalls = 0;
+        bool done = false;
+    };
+private:
+    template<typename Out>
+    struct SourceNode : PipelineNode {
+        Emitter<Out> output{*this};
+        function<Result(Emitter<Out> &)> produce;
+        bool ended = false;
+
+        SourceNode(const string &stageName) : PipelineNode(stageName) {}
+
+        bool run(bool &progress) override {
+            if(!output.flush(progress)) {
+                return true;
+            }
+
+            if(ended) {
+                done.store(true, memory_order_release);
+                return true;
+            }
+
+            for(int i = 0; i < pipelineBatch && !ended; i++) {
+                const long long emitted = outputs.load(memory_order_relaxed);
+                const Result result = produce(output);
+                if(result == Result::FAILED) {
+                    return false;
+                }
+
+                ended = result == Result::END;
+                progress = progress || ended || outputs.load(memory_order_relaxed) != emitted;
+
+                // stop at a full queue, or when source has nothing yet
+                if(!output.flush(progress) || outputs.load(memory_order_relaxed) == emitted) {
+                    break;
+                }
+            }
+
+            return true;
+        }
+    };
+
+    // stage with input, Out is void for sinks
+    template<typename In, typename Out>
+    struct StageNode : PipelineNode {
+        PipelineNode *upstream = nullptr;
+        SPSCQueue<Payload<In>> *input = nullptr;
+        unique_ptr<Emitter<Out>> output;
+        function<bool(const Payload<In> &)> process;
+        function<bool()> finish;
+        bool ended = false;
+
+        StageNode(const string &stageName) : PipelineNode(stageName) {}
+
+        bool run(bool &progress) override {
+            if(output && !output->flush(progress)) {
+                return true;
+            }
+
+            if(ended) {
+                done.store(true, memory_order_release);
+                return true;
+            }
+
+            const size_t waiting = input->size();
+            if(waiting > maxQueued.load(memory_order_relaxed)) {
+                maxQueued.store(waiting, memory_order_relaxed);
+            }
+
+            for(int i = 0; i < pipelineBatch; i++) {
+                // upstream is done only after its last push, so it is read before the queue
+                const bool upstreamDone = upstream->done.load(memory_order_acquire);
+
+                Payload<In> payload;
+                if(!input->pop(payload)) {
+                    if(upstreamDone) {
+                        ended = true;
+                        progress = true;
+                        if(finish && !finish()) {
+                            return false;
+                        }
+                    }
+
+                    break;
+                }
+
+                inputs++;
+                progress = true;
+                if(!process(payload)) {
+                    return false;
+                }
+
+                if(output && !output->flush(progress)) {
+                    break;
+                }
+            }
+
+            return true;
+        }
+
+        size_t queued() override {
+            return input->size();
+        }
+    };
+
+    vector<unique_ptr<PipelineNode>> nodes;
+    vector<thread> workers;
+
+    atomic<bool> stopping{false};
+    atomic<bool> pipelineFailed{false};
+    atomic<int> sleeping{0};
+    mutex idleMutex;
+    condition_variable idleCondition;
+    chrono::steady_clock::time_point startTime;
+    bool started = false;
+
+    template<typename In, typename Out>
+    StageNode<In, Out> *addNode(const string &name, const Port<In> &source, const size_t queueSize) {
+        StageNode<In, Out> *node = new StageNode<In, Out>(name);
+        nodes.emplace_back(node);
+
+        node->upstream = source.node;
+        node->input = source.emitter->connect(queueSize);
+        return node;
+    }
+
+    bool allDone() {
+        for(const auto &node : nodes) {
+            if(!node->done.load(memory_order_acquire)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void workerLoop(const size_t first) {
+        while(!stopping.load()) {
+            bool progress = false;
+
+            // workers start at different stages, so they don't all compete for the first one
+            for(size_t i = 0; i < nodes.size() && !stopping.load(); i++) {
+                PipelineNode &node = *nodes[(first + i) % nodes.size()];
+                if(node.done.load(memory_order_acquire) || node.busy.exchange(true, memory_order_acquire)) {
+                    continue;
+                }
+
+                const auto runStart = chrono::steady_clock::now();
+                bool moved = false;
+                const bool succeeded = node.run(moved);
+                if(moved) {
+                    node.busyTime += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - runStart).count();
+                }
+
+                node.busy.store(false, memory_order_release);
+
+                if(!succeeded) {
+                    pipelineFailed.store(true);
+                    stopping.store(true);
+                }
+
+                progress = progress || moved;
+            }
+
+            if(allDone()) {
+                stopping.store(true);
+            }
+
+            if(stopping.load()) {
+                idleCondition.notify_all();
+                break;
+            }
+
+            if(progress) {
+                if(sleeping.load() > 0) {
+                    idleCondition.notify_all();
+                }
+            } else {
+                // timeout covers a wakeup which happened just before sleeping
+                unique_lock<mutex> lock(idleMutex);
+                sleeping++;
+                idleCondition.wait_for(lock, chrono::milliseconds(pipelineIdleWait));
+                sleeping--;
+            }
+        }
+    }
+public:
+    ~Pipeline() { stop(); }
+
+    // produce is called while output has space, it emits payloads to output (if any) and returns Result
+    template<typename Out, typename Produce>
+    Port<Out> addSource(const string &name, Produce produce) {
+        SourceNode<Out> *node = new SourceNode<Out>(name);
+        nodes.emplace_back(node);
+
+        node->produce = produce;
+        return {node, &node->output};
+    }
+
+    // process(payload, output) is called for every input payload, finish(output) once after the last one
+    template<typename Out, typename In, typename Process>
+    Port<Out> addStage(const string &name, const Port<In> &source, Process process, const function<bool(Emitter<Out> &)> &finish = nullptr, const size_t queueSize = pipelineQueueSize) {
+        StageNode<In, Out> *node = addNode<In, Out>(name, source, queueSize);
+        node->output.reset(new Emitter<Out>(*node));
+
+        Emitter<Out> *output = node->output.get();
+        node->process = [process, output](const Payload<In> &payload) { return process(payload, *output); };
+        if(finish) {
+            node->finish = [finish, output]() { return finish(*output); };
+        }
+
+        return {node, output};
+    }
+
+    // consume is called for every payload, finish once after the last one
+    template<typename In, typename Consume>
+    void addSink(const string &name, const Port<In> &source, Consume consume, const function<bool()> &finish = nullptr, const size_t queueSize = pipelineQueueSize) {
+        StageNode<In, void> *node = addNode<In, void>(name, source, queueSize);
+        node->process = consume;
+        node->finish = finish;
+    }
+
+    // starts workers, stages can't be added anymore
+    bool start(const int threads = thread::hardware_concurrency()) {
+        if(started || nodes.empty()) {
+            return false;
+        }
+
+        started = true;
+        startTime = chrono::steady_clock::now();
+
+        for(int i = 0; i < max(threads, 1); i++) {
+            workers.emplace_back(&Pipeline::workerLoop, this, i % nodes.size());
+        }
+
+        return true;
+    }
+
+    // waits until every stage is done (returns true) or a stage failed
+    bool wait() {
+        for(thread &worker : workers) {
+            if(worker.joinable()) {
+                worker.join();
+            }
+        }
+
+        return !pipelineFailed.load() && allDone();
+    }
+
+    // stops workers after their current stage run (payloads in queues are dropped with the pipeline)
+    void stop() {
+        stopping.store(true);
+        idleCondition.notify_all();
+        wait();
+    }
+
+    bool failed() {
+        return pipelineFailed.load();
+    }
+
+    bool finished() {
+        return allDone();
+    }
+
+    // can be called while running
+    vector<StageMetrics> getMetrics() {
+        const double elapsed = started ? chrono::duration<double>(chrono::steady_clock::now() - startTime).count() : 0;
+        vector<StageMetrics> metrics;
+
+        for(const auto &node : nodes) {
+            StageMetrics stage;
+            stage.name = node->name;
+            stage.inputs = node->inputs.load();
+            stage.outputs = node->outputs.load();
+            stage.busySeconds = node->busyTime.load() / 1e9;
+            stage.utilization = elapsed > 0 ? stage.busySeconds / elapsed : 0;
+            stage.latency = stage.inputs > 0 ? stage.busySeconds * 1000 / stage.inputs : 0;
+            stage.queued = node->queued();
+            stage.maxQueued = node->maxQueued.load();
+            stage.stalls = node->stalls.load();
+            stage.done = node->done.load();
+            metrics.push_back(stage);
+        }
+
+        return metrics;
+    }
+};
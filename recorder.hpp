@@ -0,0 +1,505 @@
+// Recording of compressed H.264 (or HEVC) input while decoding
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#include <cstdio>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+const int recorderSegmentFrames = 300; // minimal frames in a segment before it is cut on the next IDR
+const int recorderSegments = 10; // segments kept on disk (older are removed), -1 for unlimited
+const size_t recorderQueueSize = 8 * 1024 * 1024; // bytes waiting to be written
+
+/*
+    note for recording:
+
+    SegmentRecorder tees compressed input of a decoder to disk, without a second reader of the source
+    complete access units are appended to segment files (prefix-000001.h264, prefix-000002.h264, ...,
+    .h265 for HEVC), which are cut on IDR boundaries, so each of them can be decoded on its own
+    (if the first IDR of a segment comes without parameter sets, the last ones are written before it)
+
+    every segment has an index (prefix-000001.idx) with one line per access unit:
+    frame number, byte offset in segment, size, and 1 if it is a keyframe
+
+    writing is done on its own thread, if the disk can't keep up, access units are dropped
+    (up to the next IDR, so segments stay decodable) and counted in getDroppedFrames
+
+    only the last recorderSegments segments are kept, to keep segments around an event
+    (pre- and post-event recording), call markEvent
+*/
+
+struct SegmentRecorder {
+private:
+    struct Segment {
+        int number;
+        FILE *video = nullptr;
+        FILE *index = nullptr;
+        long long size = 0;
+        long long frames = 0;
+    };
+
+    string directory;
+    string prefix;
+    int segmentFrames = recorderSegmentFrames;
+    int maxSegments = recorderSegments;
+    const char *videoExtension = "h264";
+
+    // access unit waiting for writer, keyframes without parameter sets have the last ones with them
+    struct QueuedUnit {
+        AccessUnit accessUnit;
+        vector<uint8_t> parameterSets;
+    };
+
+    AccessUnitAssembler assembler;
+    AccessUnit unit;
+
+    // write queue, shared with writer thread
+    deque<QueuedUnit> queue;
+    size_t queueBytes = 0;
+    mutex queueLock;
+    condition_variable queueChanged;
+    bool finished = false;
+    bool writeFailed = false;
+    bool eventPending = false;
+    int eventPreSegments = 0;
+    int eventPostSegments = 0;
+    thread writer;
+
+    // decoding thread side
+    bool dropping = false;
+    long long droppedFrames = 0;
+    long long recordedFrames = 0;
+
+    // writer thread side
+    Segment segment;
+    int nextSegment = 1;
+    deque<int> closedSegments;
+    set<int> protectedSegments;
+    int protectUntil = 0; // segments up to this number are protected when closed
+
+    string segmentPath(const int number, const char *extension) {
+        char name[32];
+        snprintf(name, sizeof(name), "-%06d.", number);
+        return directory + "/" + prefix + name + extension;
+    }
+
+    void closeSegment() {
+        if(!segment.video) {
+            return;
+        }
+
+        fclose(segment.video);
+        fclose(segment.index);
+        segment.video = segment.index = nullptr;
+
+        if(segment.number <= protectUntil) {
+            protectedSegments.insert(segment.number);
+        } else {
+            closedSegments.push_back(segment.number);
+        }
+
+        // rotate out oldest segments
+        while(maxSegments >= 0 && (int)closedSegments.size() > maxSegments) {
+            const int oldest = closedSegments.front();
+            closedSegments.pop_front();
+
+            if(!protectedSegments.count(oldest)) {
+                remove(segmentPath(oldest, videoExtension).c_str());
+                remove(segmentPath(oldest, "idx").c_str());
+            }
+        }
+    }
+
+    bool openSegment() {
+        segment = Segment();
+        segment.number = nextSegment++;
+        segment.video = fopen(segmentPath(segment.number, videoExtension).c_str(), "wb");
+        segment.index = fopen(segmentPath(segment.number, "idx").c_str(), "w");
+
+        if(!segment.video || !segment.index) {
+            if(segment.video) fclose(segment.video);
+            if(segment.index) fclose(segment.index);
+            segment.video = segment.index = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool writeUnit(const QueuedUnit &queued) {
+        const AccessUnit &accessUnit = queued.accessUnit;
+        size_t size = accessUnit.data.size();
+
+        if(accessUnit.keyframe && (!segment.video || segment.frames >= segmentFrames)) {
+            closeSegment();
+            if(!openSegment()) {
+                return false;
+            }
+
+            // segment starts with parameter sets, they are a part of its first access unit
+            const vector<uint8_t> &parameterSets = queued.parameterSets;
+            if(fwrite(parameterSets.data(), 1, parameterSets.size(), segment.video) != parameterSets.size()) {
+                return false;
+            }
+
+            size += parameterSets.size();
+        }
+
+        // stream starts without IDR, nothing to cut on yet
+        if(!segment.video) {
+            return true;
+        }
+
+        if(fwrite(accessUnit.data.data(), 1, accessUnit.data.size(), segment.video) != accessUnit.data.size()) {
+            return false;
+        }
+
+        fprintf(segment.index, "%lld %lld %zu %d\n", segment.frames, segment.size, size, accessUnit.keyframe ? 1 : 0);
+
+        segment.size += size;
+        segment.frames++;
+        return true;
+    }
+
+    // protects segments around the current one from rotation
+    void protectSegments(const int preSegments, const int postSegments) {
+        const int current = nextSegment - 1;
+        for(const int number : closedSegments) {
+            if(number >= current - preSegments) {
+                protectedSegments.insert(number);
+            }
+        }
+
+        protectUntil = max(protectUntil, current + postSegments);
+    }
+
+    void run() {
+        while(true) {
+            QueuedUnit queued;
+            bool event = false;
+            int preSegments = 0, postSegments = 0;
+
+            {
+                unique_lock<mutex> lock(queueLock);
+                queueChanged.wait(lock, [&]() { return finished || eventPending || !queue.empty(); });
+
+                if(eventPending) {
+                    event = true;
+                    preSegments = eventPreSegments;
+                    postSegments = eventPostSegments;
+                    eventPending = false;
+                    eventPreSegments = eventPostSegments = 0;
+                } else if(queue.empty()) {
+                    break;
+                } else {
+                    queued = move(queue.front());
+                    queue.pop_front();
+                    queueBytes -= queued.accessUnit.data.size() + queued.parameterSets.size();
+                }
+            }
+
+            if(event) {
+                protectSegments(preSegments, postSegments);
+                continue;
+            }
+
+            if(!writeUnit(queued)) {
+                lock_guard<mutex> lock(queueLock);
+                writeFailed = true;
+            }
+        }
+
+        closeSegment();
+    }
+
+    void enqueue(AccessUnit &accessUnit) {
+        // after a drop, wait for the next IDR
+        if(dropping && !accessUnit.keyframe) {
+            droppedFrames++;
+            return;
+        }
+
+        QueuedUnit queued;
+        if(accessUnit.keyframe && !accessUnit.parameterSets) {
+            queued.parameterSets = assembler.getParameterSets();
+        }
+
+        {
+            lock_guard<mutex> lock(queueLock);
+            const size_t size = accessUnit.data.size() + queued.parameterSets.size();
+            if(queueBytes + size > recorderQueueSize) {
+                dropping = true;
+                droppedFrames++;
+                return;
+            }
+
+            dropping = false;
+            queueBytes += size;
+            queued.accessUnit = move(accessUnit);
+            queue.push_back(move(queued));
+        }
+
+        recordedFrames++;
+        queueChanged.notify_one();
+    }
+public:
+    ~SegmentRecorder() { close(); }
+
+    // files are written to directory/prefix-NNNNNN.h264, directory must exist
+    bool open(const string &outputDirectory, const string &filePrefix, const int minimalSegmentFrames = recorderSegmentFrames, const int keptSegments = recorderSegments) {
+        close();
+
+        directory = outputDirectory;
+        prefix = filePrefix;
+        segmentFrames = minimalSegmentFrames;
+        maxSegments = keptSegments;
+        finished = writeFailed = dropping = eventPending = false;
+        eventPreSegments = eventPostSegments = 0;
+        droppedFrames = recordedFrames = 0;
+        closedSegments.clear();
+        protectedSegments.clear();
+        protectUntil = 0;
+        nextSegment = 1;
+
+        writer = thread(&SegmentRecorder::run, this);
+        return true;
+    }
+
+    // tees NALs of decoder into the recorder (other observers of the decoder, like PrerollBuffer, are kept)
+    void attach(Decoder &decoder) {
+        setCodec(decoder.getCodec());
+        decoder.addNALObserver([this](const uint8_t *nal, size_t size, long long offset) {
+            push(nal, size, offset);
+        });
+    }
+
+    // codec of pushed NALs (H.264 by default), set before the first one
+    void setCodec(const Codec codec) {
+        assembler = AccessUnitAssembler(codec);
+        videoExtension = codec == Codec::HEVC ? "h265" : "h264";
+    }
+
+    // adds NAL (with start code), for use without decoder
+    void push(const uint8_t *nal, const size_t size, const long long offset = -1) {
+        if(assembler.push(nal, size, offset, unit)) {
+            enqueue(unit);
+        }
+    }
+
+    /*
+        keeps segments around an event out of rotation: current segment, preSegments before it,
+        and postSegments after it (protected segments are never removed by the recorder)
+    */
+    void markEvent(const int preSegments = 1, const int postSegments = 1) {
+        {
+            // segment lists belong to writer thread, so event is applied there
+            lock_guard<mutex> lock(queueLock);
+            eventPending = true;
+            eventPreSegments = max(eventPreSegments, preSegments);
+            eventPostSegments = max(eventPostSegments, postSegments);
+        }
+
+        queueChanged.notify_one();
+    }
+
+    // writes remaining data and closes files
+    void close() {
+        if(!writer.joinable()) {
+            return;
+        }
+
+        if(assembler.flush(unit)) {
+            enqueue(unit);
+        }
+
+        {
+            lock_guard<mutex> lock(queueLock);
+            finished = true;
+        }
+
+        queueChanged.notify_all();
+        writer.join();
+    }
+
+    long long getRecordedFrames() {
+        return recordedFrames;
+    }
+
+    long long getDroppedFrames() {
+        return droppedFrames;
+    }
+
+    // bytes waiting to be written (dropping starts at recorderQueueSize)
+    size_t getQueuedBytes() {
+        lock_guard<mutex> lock(queueLock);
+        return queueBytes;
+    }
+
+    bool failed() {
+        lock_guard<mutex> lock(queueLock);
+        return writeFailed;
+    }
+};
+
+/*
+    note for pre-roll:
+
+    PrerollBuffer keeps the last part of compressed input in memory (which is 50 - 100x smaller
+    than decoded frames), so when an event is triggered, clip can start before it
+
+    access units are kept in whole GOPs: the buffer always starts with an IDR, and the oldest GOP
+    is removed only once the newer ones cover at least minimalFrames (for example 5 seconds * fps)
+    IDRs without parameter sets get the last ones in front, so buffered data decodes on its own
+    memory is limited by maxBytes, if a single GOP is bigger, buffer restarts at the next IDR
+
+    on trigger, buffered data can be written to file (dump), taken as access units, or decoded
+*/
+
+struct PrerollBuffer {
+private:
+    deque<AccessUnit> units;
+    deque<size_t> gopSizes; // access units in each GOP, oldest first
+    size_t bytes = 0;
+    size_t maxBytes;
+    long long minimalFrames;
+
+    AccessUnitAssembler assembler;
+    AccessUnit unit;
+
+    void dropOldestGOP() {
+        for(size_t i = 0; i < gopSizes.front(); i++) {
+            bytes -= units.front().data.size();
+            units.pop_front();
+        }
+
+        gopSizes.pop_front();
+    }
+
+    void store(AccessUnit &accessUnit) {
+        if(accessUnit.keyframe) {
+            if(!accessUnit.parameterSets) {
+                const vector<uint8_t> parameterSets = assembler.getParameterSets();
+                accessUnit.data.insert(accessUnit.data.begin(), parameterSets.begin(), parameterSets.end());
+                accessUnit.parameterSets = !parameterSets.empty();
+            }
+
+            gopSizes.push_back(0);
+        } else if(gopSizes.empty()) {
+            // nothing to decode it from
+            return;
+        }
+
+        bytes += accessUnit.data.size();
+        gopSizes.back()++;
+        units.push_back(move(accessUnit));
+
+        // keep enough frames before the trigger
+        while(gopSizes.size() > 1 && (long long)(units.size() - gopSizes.front()) >= minimalFrames) {
+            dropOldestGOP();
+        }
+
+        while(bytes > maxBytes && !gopSizes.empty()) {
+            dropOldestGOP();
+        }
+    }
+public:
+    // minimalFrames is length of pre-roll in frames, maxBytes is memory limit
+    PrerollBuffer(const long long frames, const size_t memoryLimit) : maxBytes(memoryLimit), minimalFrames(frames) {}
+
+    // tees NALs of decoder into the buffer (other observers of the decoder, like SegmentRecorder, are kept)
+    void attach(Decoder &decoder) {
+        setCodec(decoder.getCodec());
+        decoder.addNALObserver([this](const uint8_t *nal, size_t size, long long offset) {
+            push(nal, size, offset);
+        });
+    }
+
+    // codec of pushed NALs (H.264 by default), set before the first one
+    void setCodec(const Codec codec) {
+        assembler = AccessUnitAssembler(codec);
+    }
+
+    // adds NAL (with start code), for use without decoder
+    void push(const uint8_t *nal, const size_t size, const long long offset = -1) {
+        if(assembler.push(nal, size, offset, unit)) {
+            store(unit);
+        }
+    }
+
+    // buffered access units from the oldest IDR, buffer is left untouched
+    const deque<AccessUnit> &getUnits() {
+        return units;
+    }
+
+    // removes and returns buffered access units (for example to continue recording after trigger)
+    deque<AccessUnit> take() {
+        deque<AccessUnit> output = move(units);
+        units.clear();
+        gopSizes.clear();
+        bytes = 0;
+        return output;
+    }
+
+    // writes buffered data (starting with IDR) to a file
+    bool dump(const string &path) {
+        FILE *output = fopen(path.c_str(), "wb");
+        if(!output) {
+            return false;
+        }
+
+        bool written = true;
+        for(const auto &accessUnit : units) {
+            written &= fwrite(accessUnit.data.data(), 1, accessUnit.data.size(), output) == accessUnit.data.size();
+        }
+
+        return fclose(output) == 0 && written;
+    }
+
+    /*
+        decodes buffered data with given decoder (which must not be the one feeding this buffer),
+        if lastData is true, the final access unit ends the stream and the decoder is drained
+    */
+    Decoder::DecodedFrame decode(Decoder &decoder, const bool lastData = false) {
+        Decoder::DecodedFrame returnedOutput;
+
+        const auto add = [&](const Decoder::DecodedFrame &decodedFrame) {
+            returnedOutput.status = decodedFrame.status;
+            if(decodedFrame.status != Decoder::Status::OK) {
+                return false;
+            }
+
+            returnedOutput.output.insert(returnedOutput.output.end(), decodedFrame.output.begin(), decodedFrame.output.end());
+            returnedOutput.frames += decodedFrame.frames;
+            returnedOutput.fields.insert(returnedOutput.fields.end(), decodedFrame.fields.begin(), decodedFrame.fields.end());
+            returnedOutput.imageSize = decodedFrame.imageSize;
+            return true;
+        };
+
+        for(size_t i = 0; i < units.size(); i++) {
+            const auto &data = units[i].data;
+            if(!add(decoder.decode(reinterpret_cast<const char *>(data.data()), data.size(), lastData && i + 1 == units.size()))) {
+                return returnedOutput;
+            }
+        }
+
+        // frames still inside the device
+        if(lastData) {
+            add(decoder.drain());
+        }
+
+        return returnedOutput;
+    }
+
+    long long getFrames() {
+        return units.size();
+    }
+
+    size_t getMemoryUsage() {
+        return bytes;
+    }
+};
@@ -0,0 +1,232 @@
+// Reverse playback of H.264 (or HEVC) input
+// Written by ukicomputers
+
+#pragma once
+#include "lazy.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+/*
+    note for reverse playback:
+
+    frames can't be decoded backwards, so ReversePlayer decodes each GOP (from its IDR) forwards
+    into a pool of frames, and then returns them in reverse order
+    while frames of one GOP are returned, the previous GOP is already decoded on a background thread
+
+    memory is bounded by about two GOPs of frames (the returned one and the one decoded ahead),
+    with proxyFactor > 1 frames are downscaled by it before they are stored
+
+    playback starts from frame set by seek (the last frame of stream by default)
+
+    index must be complete (not extended by ingesting) while playing, and the decoder session
+    is used only by the player thread
+    like with LazyDecoder, frames are numbered in decode order, which is expected to be output order
+*/
+
+class ReversePlayer {
+private:
+    struct GOP {
+        long long first = -1; // frame numbers of the range
+        long long last = -1;
+        vector<vector<uint8_t>> frames;
+        pair<int, int> imageSize;
+        Decoder::Status status = Decoder::Status::OK;
+    };
+
+    StreamIndex &index;
+    Decoder &decoder;
+    int proxyFactor;
+
+    GOP current; // frames being returned
+    GOP pending; // decoded ahead
+    bool pendingReady = false;
+    long long position = -1; // next frame to return
+
+    pair<long long, long long> requested = {-1, -1}; // range waiting for decode thread
+    pair<long long, long long> scheduled = {-1, -1}; // last range passed to decode thread
+
+    vector<vector<uint8_t>> pool; // frame buffers for reuse
+    thread worker;
+    mutex playerMutex;
+    condition_variable playerCondition;
+    bool stopWorker = false;
+
+    long long decodedFrames = 0;
+
+    // range of frames from the last IDR before frame up to it
+    pair<long long, long long> rangeFor(const long long frame) {
+        return {frame >= 0 && frame < index.getFrames() ? index.keyframeBefore(frame) : -1, frame};
+    }
+
+    void recycle(GOP &gop) {
+        for(auto &frame : gop.frames) {
+            pool.push_back(move(frame));
+        }
+
+        gop.frames.clear();
+    }
+
+    void schedule(const pair<long long, long long> &range) {
+        requested = range;
+        scheduled = range;
+        playerCondition.notify_all();
+    }
+
+    void decodeLoop() {
+        while(true) {
+            GOP gop;
+            {
+                unique_lock<mutex> lock(playerMutex);
+                playerCondition.wait(lock, [this] { return stopWorker || requested.first >= 0; });
+
+                if(stopWorker) {
+                    return;
+                }
+
+                gop.first = requested.first;
+                gop.last = requested.second;
+                requested = {-1, -1};
+            }
+
+            long long frames = 0;
+            gop.status = decodeUnits(decoder, index.getUnits(gop.first, gop.last), [&](const uint8_t *data, size_t frameSize, const pair<int, int> &imageSize) {
+                vector<uint8_t> frame;
+                {
+                    lock_guard<mutex> lock(playerMutex);
+                    if(!pool.empty()) {
+                        frame = move(pool.back());
+                        pool.pop_back();
+                    }
+                }
+
+                // keeps capacity of reused buffer
+                if(proxyFactor > 1) {
+                    const vector<uint8_t> proxy = downscaleFrame(data, imageSize, proxyFactor);
+                    frame.assign(proxy.begin(), proxy.end());
+                    gop.imageSize = {imageSize.first / proxyFactor, imageSize.second / proxyFactor};
+                } else {
+                    frame.assign(data, data + frameSize);
+                    gop.imageSize = imageSize;
+                }
+
+                gop.frames.push_back(move(frame));
+            }, frames);
+
+            // output order didn't match decode order
+            if(gop.status == Decoder::Status::OK && frames != gop.last - gop.first + 1) {
+                gop.status = Decoder::Status::FAILED;
+            }
+
+            lock_guard<mutex> lock(playerMutex);
+            decodedFrames += frames;
+            recycle(pending);
+            pending = move(gop);
+            pendingReady = true;
+            playerCondition.notify_all();
+        }
+    }
+
+    // makes GOP which ends with position current, and schedules decode of the one before it
+    bool takeGOP() {
+        const auto range = rangeFor(position);
+        if(range.first < 0) {
+            return false;
+        }
+
+        unique_lock<mutex> lock(playerMutex);
+        if(scheduled != range) {
+            schedule(range);
+        }
+
+        playerCondition.wait(lock, [&] { return pendingReady && pending.first == range.first && pending.last == range.second; });
+
+        recycle(current);
+        swap(current, pending);
+        pendingReady = false;
+        scheduled = {-1, -1}; // taken, so it is decoded again if it's needed again
+
+        // pipelined decode of the previous GOP
+        if(current.first > 0) {
+            const auto previous = rangeFor(current.first - 1);
+            if(previous.first >= 0) {
+                schedule(previous);
+            }
+        }
+
+        return true;
+    }
+public:
+    // decoder must be initialized, and it is used only by this object
+    ReversePlayer(StreamIndex &streamIndex, Decoder &videoDecoder, const int factor = 1) : index(streamIndex), decoder(videoDecoder), proxyFactor(max(factor, 1)) {
+        worker = thread(&ReversePlayer::decodeLoop, this);
+    }
+
+    ~ReversePlayer() {
+        {
+            lock_guard<mutex> lock(playerMutex);
+            stopWorker = true;
+        }
+
+        playerCondition.notify_all();
+        worker.join();
+    }
+
+    // sets frame which is returned next (the last frame of stream by default when -1)
+    void seek(const long long frame = -1) {
+        position = frame < 0 ? index.getFrames() - 1 : min(frame, index.getFrames() - 1);
+
+        // GOP decoded ahead is dropped, one still being decoded is taken only if next() needs the same range
+        lock_guard<mutex> lock(playerMutex);
+        recycle(current);
+        recycle(pending);
+        current = {};
+        pending = {};
+        pendingReady = false;
+        scheduled = {-1, -1};
+    }
+
+    /*
+        returns the frame at current position (frames = 1) and steps one frame back
+        at the beginning of stream (or before the first IDR), no frame is returned (frames = 0)
+    */
+    Decoder::DecodedFrame next() {
+        Decoder::DecodedFrame returnedOutput;
+
+        if(position < 0) {
+            return returnedOutput;
+        }
+
+        if(position < current.first || position > current.last) {
+            if(!takeGOP()) {
+                position = -1;
+                return returnedOutput;
+            }
+        }
+
+        returnedOutput.status = current.status;
+        if(current.status != Decoder::Status::OK) {
+            // GOP is skipped
+            position = current.first - 1;
+            return returnedOutput;
+        }
+
+        returnedOutput.output = current.frames[position - current.first];
+        returnedOutput.imageSize = current.imageSize;
+        returnedOutput.frames = 1;
+        position--;
+        return returnedOutput;
+    }
+
+    // frame number which is returned next (-1 at the beginning of stream)
+    long long getPosition() {
+        return position;
+    }
+
+    // frames decoded by the device, including frames of GOPs left by seeking
+    long long getDecodedFrames() {
+        lock_guard<mutex> lock(playerMutex);
+        return decodedFrames;
+    }
+};
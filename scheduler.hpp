@@ -0,0 +1,229 @@
+// Multi-stream scheduler for decoders sharing one hardware block
+// Written by ukicomputers
+
+// Weighted fair queuing is based on start-time fair queuing (SFQ) described in
+// https://en.wikipedia.org/wiki/Fair_queuing
+
+#pragma once
+#include "decoder.hpp"
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+const int schedulerSlots = 1; // concurrent submissions to decoding hardware
+
+/*
+    note for scheduling:
+
+    when multiple decoders share one hardware block, a high-bitrate stream can starve the others
+    scheduler meters submissions of all streams: decoder of each stream is used through
+    FrameScheduler::decode (from its own thread), which waits for the stream's turn
+
+    streams in higher priority class are always served first (REALTIME before NORMAL before BACKGROUND)
+    inside the same class, input bytes are shared by stream weight
+*/
+
+struct FrameScheduler {
+    enum class Priority {
+        REALTIME,
+        NORMAL,
+        BACKGROUND
+    };
+
+    struct StreamStats {
+        // share of all bytes submitted through scheduler (0 - 1)
+        double share = 0;
+
+        // time spent waiting for a turn, in ms
+        double averageLatency = 0;
+        double maxLatency = 0;
+
+        long long submittedBytes = 0;
+        long long submissions = 0;
+    };
+private:
+    struct Stream {
+        int weight;
+        Priority priority;
+        bool active = true;
+
+        // virtual time at which last request of this stream finishes
+        double finishTag = 0;
+
+        long long submittedBytes = 0;
+        long long submissions = 0;
+        double latencySum = 0;
+        double latencyMax = 0;
+    };
+
+    struct Request {
+        int stream;
+        double startTag;
+        double finishTag;
+        unsigned long long sequence;
+    };
+
+    mutex schedulerLock;
+    condition_variable turnChanged;
+
+    vector<Stream> streams;
+    vector<Request> waiting;
+
+    double virtualTime = 0;
+    int freeSlots;
+    unsigned long long sequence = 0;
+    long long totalBytes = 0;
+
+    // request which gets the next free slot
+    int nextRequest() {
+        int best = -1;
+
+        for(int i = 0; i < waiting.size(); i++) {
+            if(best < 0) {
+                best = i;
+                continue;
+            }
+
+            const Priority priority = streams[waiting[i].stream].priority;
+            const Priority bestPriority = streams[waiting[best].stream].priority;
+
+            if(priority != bestPriority) {
+                if(priority < bestPriority) best = i;
+            } else if(waiting[i].finishTag != waiting[best].finishTag) {
+                if(waiting[i].finishTag < waiting[best].finishTag) best = i;
+            } else if(waiting[i].sequence < waiting[best].sequence) {
+                best = i;
+            }
+        }
+
+        return best;
+    }
+
+    void acquire(const int stream, const long long bytes) {
+        unique_lock<mutex> lock(schedulerLock);
+        const auto waitStart = chrono::steady_clock::now();
+
+        Request request;
+        request.stream = stream;
+        request.startTag = streams[stream].finishTag > virtualTime ? streams[stream].finishTag : virtualTime;
+        request.finishTag = request.startTag + (double)(bytes + 1) / streams[stream].weight;
+        request.sequence = sequence++;
+        streams[stream].finishTag = request.finishTag;
+
+        waiting.push_back(request);
+
+        turnChanged.wait(lock, [&]() {
+            if(freeSlots <= 0) return false;
+            const int next = nextRequest();
+            return waiting[next].sequence == request.sequence;
+        });
+
+        for(int i = 0; i < waiting.size(); i++) {
+            if(waiting[i].sequence == request.sequence) {
+                waiting.erase(waiting.begin() + i);
+                break;
+            }
+        }
+
+        freeSlots--;
+        virtualTime = request.startTag;
+
+        // streams may be added while waiting, so reference is taken only now
+        Stream &current = streams[stream];
+
+        const double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - waitStart).count();
+        current.latencySum += latency;
+        if(latency > current.latencyMax) {
+            current.latencyMax = latency;
+        }
+
+        current.submittedBytes += bytes;
+        current.submissions++;
+        totalBytes += bytes;
+    }
+
+    void release() {
+        {
+            lock_guard<mutex> lock(schedulerLock);
+            freeSlots++;
+        }
+
+        turnChanged.notify_all();
+    }
+public:
+    FrameScheduler(const int slots = schedulerSlots) : freeSlots(slots) {}
+
+    // weight is relative share of stream inside its priority class (must be > 0)
+    int addStream(const int weight = 1, const Priority priority = Priority::NORMAL) {
+        lock_guard<mutex> lock(schedulerLock);
+
+        Stream stream;
+        stream.weight = weight > 0 ? weight : 1;
+        stream.priority = priority;
+        stream.finishTag = virtualTime;
+        streams.push_back(stream);
+
+        return streams.size() - 1;
+    }
+
+    // stream can't submit anymore, statistics are kept
+    void removeStream(const int stream) {
+        lock_guard<mutex> lock(schedulerLock);
+        if(stream >= 0 && stream < streams.size()) {
+            streams[stream].active = false;
+        }
+    }
+
+    void setPriority(const int stream, const Priority priority) {
+        {
+            lock_guard<mutex> lock(schedulerLock);
+            if(stream >= 0 && stream < streams.size()) {
+                streams[stream].priority = priority;
+            }
+        }
+
+        turnChanged.notify_all();
+    }
+
+    // same as Decoder::decode, but waits for turn of the stream first
+    Decoder::DecodedFrame decode(const int stream, Decoder &decoder, const vector<char> &input, bool lastData) {
+        {
+            lock_guard<mutex> lock(schedulerLock);
+            if(stream < 0 || stream >= streams.size() || !streams[stream].active) {
+                Decoder::DecodedFrame returnedOutput;
+                returnedOutput.status = Decoder::Status::FAILED;
+                return returnedOutput;
+            }
+        }
+
+        acquire(stream, input.size());
+        Decoder::DecodedFrame returnedOutput = decoder.decode(input, lastData);
+        release();
+
+        return returnedOutput;
+    }
+
+    StreamStats getStreamStats(const int stream) {
+        lock_guard<mutex> lock(schedulerLock);
+
+        StreamStats stats;
+        if(stream < 0 || stream >= streams.size()) {
+            return stats;
+        }
+
+        const Stream &current = streams[stream];
+        stats.submittedBytes = current.submittedBytes;
+        stats.submissions = current.submissions;
+        stats.maxLatency = current.latencyMax;
+
+        if(current.submissions > 0) {
+            stats.averageLatency = current.latencySum / current.submissions;
+        }
+
+        if(totalBytes > 0) {
+            stats.share = (double)current.submittedBytes / totalBytes;
+        }
+
+        return stats;
+    }
+};
@@ -0,0 +1,617 @@
+// Input sources for the H.264 decoder
+// Written by ukicomputers
+
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+const int autotuneSamples = 8; // decode calls measured per chunk size
+const int autotuneDuration = 3000; // maximal autotuning time (ms)
+const int autotuneLatency = 50; // decode call duration (ms) above which chunk size is penalized
+const size_t readaheadBlockSize = 1024 * 1024; // size of a single readahead block
+const int readaheadBlocks = 4; // blocks in readahead ring
+const size_t readaheadAlignment = 4096; // readahead block alignment (page size)
+const size_t streamRingSize = 4 * 1024 * 1024; // receive ring of stream sources
+
+/*
+    note for chunk size autotuning:
+
+    throughput depends on how read chunks line up with NAL boundaries and decoder input buffers
+    small chunks cost more parsing and ioctl calls per byte, while big ones raise latency of each call
+
+    autotuner tries every candidate size for autotuneSamples decode calls during the start of stream
+    (at most autotuneDuration), and settles on the size with lowest decode cost per byte
+    sizes whose average call takes longer than autotuneLatency are penalized
+*/
+
+struct ChunkAutotuner {
+    struct Result {
+        int chunkSize;
+        long long bytes = 0;
+        double seconds = 0;
+        double maxCall = 0; // in seconds
+        int calls = 0;
+
+        double costPerByte() const {
+            return bytes > 0 ? seconds / bytes : 0;
+        }
+
+        double score() const {
+            const double averageCall = calls > 0 ? seconds / calls : 0;
+            const double latencyLimit = autotuneLatency / 1000.0;
+            return averageCall > latencyLimit ? costPerByte() * (averageCall / latencyLimit) : costPerByte();
+        }
+    };
+private:
+    vector<Result> results;
+    int candidate = 0;
+    int bestCandidate = -1;
+    chrono::steady_clock::time_point tuningStart;
+    bool started = false;
+
+    void settle() {
+        bestCandidate = 0;
+        for(int i = 1; i < (int)results.size(); i++) {
+            if(results[i].calls == 0) continue;
+            if(results[bestCandidate].calls == 0 || results[i].score() < results[bestCandidate].score()) {
+                bestCandidate = i;
+            }
+        }
+    }
+public:
+    // inputBufferSize of the decoder is tried too (one chunk per device buffer)
+    ChunkAutotuner(const int inputBufferSize = 0) {
+        for(int size = 4096; size <= 262144; size *= 2) {
+            Result result;
+            result.chunkSize = size;
+            results.push_back(result);
+        }
+
+        if(inputBufferSize > 0 && (inputBufferSize & (inputBufferSize - 1)) != 0) {
+            Result result;
+            result.chunkSize = inputBufferSize;
+            results.push_back(result);
+        }
+    }
+
+    bool settled() {
+        return bestCandidate >= 0;
+    }
+
+    // size of the next chunk to read
+    int chunkSize() {
+        return settled() ? results[bestCandidate].chunkSize : results[candidate].chunkSize;
+    }
+
+    // reports duration of the decode call for the chunk returned by last chunkSize
+    void report(const int bytes, const double seconds) {
+        if(settled()) {
+            return;
+        }
+
+        if(!started) {
+            tuningStart = chrono::steady_clock::now();
+            started = true;
+        }
+
+        Result &result = results[candidate];
+        result.bytes += bytes;
+        result.seconds += seconds;
+        result.calls++;
+        if(seconds > result.maxCall) {
+            result.maxCall = seconds;
+        }
+
+        if(result.calls >= autotuneSamples) {
+            candidate++;
+        }
+
+        const auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - tuningStart).count();
+        if(candidate >= (int)results.size() || elapsed > autotuneDuration) {
+            settle();
+        }
+    }
+
+    const vector<Result> &getResults() {
+        return results;
+    }
+};
+
+/*
+    note for file sources:
+
+    reading from slow storage (SD cards) blocks, and if it is done on the decoding thread,
+    decoder sits idle during I/O stalls
+
+    FileSource reads the file on a background thread into a bounded ring of large
+    page-aligned blocks (readaheadBlocks x readaheadBlockSize) and hints the kernel with posix_fadvise,
+    so decoding thread only takes chunks of already read data
+*/
+
+// reads input file in chunks on a readahead thread, with optional chunk size autotuning
+struct FileSource {
+private:
+    struct Block {
+        char *data = nullptr;
+        size_t size = 0;
+    };
+
+    int file = -1;
+    int fixedChunkSize = 0;
+    bool autotune = false;
+    ChunkAutotuner tuner;
+    int lastChunk = 0;
+
+    // ring of blocks, filled by reader thread
+    vector<Block> blocks;
+    size_t filledBlocks = 0; // total blocks filled by reader
+    size_t takenBlocks = 0; // total blocks released by consumer
+    bool readerFinished = false;
+    bool readerFailed = false;
+    bool stopReader = false;
+    mutex ringLock;
+    condition_variable ringChanged;
+    thread reader;
+
+    // block currently being consumed
+    bool hasBlock = false;
+    size_t blockPosition = 0;
+
+    void readBlocks() {
+        off_t offset = 0;
+
+        while(true) {
+            Block *block;
+            {
+                unique_lock<mutex> lock(ringLock);
+                ringChanged.wait(lock, [&]() { return stopReader || filledBlocks - takenBlocks < blocks.size(); });
+                if(stopReader) return;
+                block = &blocks[filledBlocks % blocks.size()];
+            }
+
+            // hint kernel about the data after this block
+            posix_fadvise(file, offset + readaheadBlockSize, readaheadBlockSize * blocks.size(), POSIX_FADV_WILLNEED);
+
+            size_t size = 0;
+            bool failed = false;
+            while(size < readaheadBlockSize) {
+                const ssize_t count = pread(file, block->data + size, readaheadBlockSize - size, offset + size);
+                if(count < 0) {
+                    if(errno == EINTR) continue;
+                    failed = true;
+                    break;
+                }
+
+                if(count == 0) break;
+                size += count;
+            }
+
+            offset += size;
+            block->size = size;
+
+            const bool finished = failed || size < readaheadBlockSize;
+            {
+                lock_guard<mutex> lock(ringLock);
+                if(size > 0) {
+                    filledBlocks++;
+                }
+
+                if(finished) {
+                    readerFinished = true;
+                    readerFailed = failed;
+                }
+            }
+
+            ringChanged.notify_all();
+            if(finished) return;
+        }
+    }
+
+    // waits until current block has data, returns false at the end of file
+    bool waitBlock() {
+        unique_lock<mutex> lock(ringLock);
+
+        if(hasBlock && blockPosition >= blocks[takenBlocks % blocks.size()].size) {
+            takenBlocks++;
+            hasBlock = false;
+            blockPosition = 0;
+            ringChanged.notify_all();
+        }
+
+        if(!hasBlock) {
+            ringChanged.wait(lock, [&]() { return filledBlocks > takenBlocks || readerFinished; });
+            if(filledBlocks == takenBlocks) return false;
+            hasBlock = true;
+        }
+
+        return true;
+    }
+
+    void close() {
+        if(reader.joinable()) {
+            {
+                lock_guard<mutex> lock(ringLock);
+                stopReader = true;
+            }
+
+            ringChanged.notify_all();
+            reader.join();
+        }
+
+        for(auto &block : blocks) {
+            free(block.data);
+        }
+
+        blocks.clear();
+
+        if(file >= 0) {
+            ::close(file);
+            file = -1;
+        }
+    }
+public:
+    ~FileSource() { close(); }
+
+    // chunkSize = 0 enables autotuning
+    bool open(const string &path, const int chunkSize = 0, const int inputBufferSize = 0) {
+        close();
+
+        fixedChunkSize = chunkSize;
+        autotune = chunkSize <= 0;
+        tuner = ChunkAutotuner(inputBufferSize);
+        filledBlocks = takenBlocks = 0;
+        readerFinished = readerFailed = stopReader = hasBlock = false;
+        blockPosition = 0;
+
+        file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(file < 0) {
+            return false;
+        }
+
+        posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        blocks.resize(readaheadBlocks);
+        for(auto &block : blocks) {
+            if(posix_memalign(reinterpret_cast<void **>(&block.data), readaheadAlignment, readaheadBlockSize) != 0) {
+                block.data = nullptr;
+                close();
+                return false;
+            }
+        }
+
+        reader = thread(&FileSource::readBlocks, this);
+        return true;
+    }
+
+    // gives next chunk without copying, valid until next read, returns false when there is no more data
+    bool read(const char *&chunk, int &size) {
+        if(!waitBlock()) {
+            size = lastChunk = 0;
+            return false;
+        }
+
+        const Block &block = blocks[takenBlocks % blocks.size()];
+        const int requested = autotune ? tuner.chunkSize() : fixedChunkSize;
+
+        chunk = block.data + blockPosition;
+        size = lastChunk = min<size_t>(requested, block.size - blockPosition);
+        blockPosition += size;
+
+        return true;
+    }
+
+    // same as above, but copies chunk to vector
+    bool read(vector<char> &chunk) {
+        const char *data;
+        int size;
+
+        if(!read(data, size)) {
+            chunk.clear();
+            return false;
+        }
+
+        chunk.assign(data, data + size);
+        return true;
+    }
+
+    // is the last read chunk at the end of file (may wait for reader)
+    bool last() {
+        unique_lock<mutex> lock(ringLock);
+        if(hasBlock && blockPosition < blocks[takenBlocks % blocks.size()].size) {
+            return false;
+        }
+
+        const size_t next = takenBlocks + (hasBlock ? 1 : 0);
+        ringChanged.wait(lock, [&]() { return filledBlocks > next || readerFinished; });
+        return filledBlocks <= next;
+    }
+
+    // did reading fail (before end of file)
+    bool failed() {
+        lock_guard<mutex> lock(ringLock);
+        return readerFailed;
+    }
+
+    // reports how long decoding of the last chunk took (used for autotuning)
+    void report(const double seconds) {
+        if(autotune) {
+            tuner.report(lastChunk, seconds);
+        }
+    }
+
+    int chunkSize() {
+        return autotune ? tuner.chunkSize() : fixedChunkSize;
+    }
+
+    bool autotuned() {
+        return autotune && tuner.settled();
+    }
+};
+
+/*
+    note for stream sources:
+
+    StreamSource reads live input from any file descriptor (pipe, stdin, TCP or Unix socket)
+    without blocking - wait polls for new data, receive takes everything that is available
+
+    data is received into a ring buffer (memfd mapped twice back to back, so data which wraps
+    around the end is still contiguous in memory) and split on NAL boundaries in place,
+    next gives run of complete NALs straight from the ring without copying
+    if input is a pipe, data is moved into the ring by splice (without copying through user space)
+*/
+
+struct StreamSource {
+private:
+    int input = -1;
+    bool inputPipe = false;
+    bool inputFinished = false;
+    bool inputFailed = false;
+
+    // ring buffer, both halves of mapping show the same memfd pages
+    int ringFile = -1;
+    char *ring = nullptr;
+    size_t ringSize = 0;
+
+    // absolute stream positions (ring position is position % ringSize)
+    unsigned long long readPosition = 0; // first byte not yet consumed
+    unsigned long long writePosition = 0; // end of received data
+    unsigned long long scanPosition = 0; // data before this is already scanned
+    unsigned long long lastStart = 0; // position of the last found start code
+    bool hasStart = false;
+    unsigned long long pendingRelease = 0;
+    bool pendingLast = false;
+
+    // throughput measurement
+    chrono::steady_clock::time_point rateStart;
+    unsigned long long rateBytes = 0;
+    double rate = 0;
+
+    void updateRate(const size_t bytes) {
+        rateBytes += bytes;
+
+        const auto now = chrono::steady_clock::now();
+        const double elapsed = chrono::duration<double>(now - rateStart).count();
+        if(elapsed >= 1) {
+            rate = rateBytes / elapsed;
+            rateBytes = 0;
+            rateStart = now;
+        }
+    }
+
+    // finds start codes in newly received data
+    void scan() {
+        const char *data = ring + readPosition % ringSize;
+        const size_t end = writePosition - readPosition;
+        size_t position = scanPosition > readPosition + 2 ? scanPosition - readPosition : 2;
+
+        while(position < end) {
+            const void *found = memchr(data + position, 0x01, end - position);
+            if(!found) break;
+
+            position = static_cast<const char *>(found) - data;
+            if(data[position - 1] == 0x00 && data[position - 2] == 0x00) {
+                const size_t start = (position >= 3 && data[position - 3] == 0x00) ? position - 3 : position - 2;
+                lastStart = readPosition + start;
+                hasStart = true;
+            }
+
+            position++;
+        }
+
+        scanPosition = writePosition;
+    }
+
+    void close() {
+        if(ring) {
+            munmap(ring, ringSize * 2);
+            ring = nullptr;
+        }
+
+        if(ringFile >= 0) {
+            ::close(ringFile);
+            ringFile = -1;
+        }
+    }
+public:
+    ~StreamSource() { close(); }
+
+    // fd is switched to non-blocking mode, and isn't closed by the source
+    bool open(const int fd, const size_t size = streamRingSize) {
+        close();
+
+        input = fd;
+        inputFinished = inputFailed = hasStart = false;
+        readPosition = writePosition = scanPosition = lastStart = pendingRelease = 0;
+        pendingLast = false;
+        rateBytes = 0;
+        rate = 0;
+        rateStart = chrono::steady_clock::now();
+
+        const long pageSize = sysconf(_SC_PAGESIZE);
+        ringSize = (size + pageSize - 1) / pageSize * pageSize;
+
+        struct stat inputStat;
+        inputPipe = fstat(fd, &inputStat) == 0 && S_ISFIFO(inputStat.st_mode);
+
+        const int flags = fcntl(fd, F_GETFL);
+        if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            return false;
+        }
+
+        ringFile = memfd_create("v4l2-stream", MFD_CLOEXEC);
+        if(ringFile < 0 || ftruncate(ringFile, ringSize) < 0) {
+            close();
+            return false;
+        }
+
+        // reserve space for two copies, and map the memfd into both halves
+        void *reserved = mmap(nullptr, ringSize * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(reserved == MAP_FAILED) {
+            close();
+            return false;
+        }
+
+        ring = static_cast<char *>(reserved);
+        if(
+            mmap(ring, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ringFile, 0) == MAP_FAILED ||
+            mmap(ring + ringSize, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ringFile, 0) == MAP_FAILED
+        ) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    // waits until input has new data (timeout in ms), returns false on timeout
+    bool wait(const int timeout) {
+        if(inputFinished) {
+            return true;
+        }
+
+        pollfd descriptor;
+        descriptor.fd = input;
+        descriptor.events = POLLIN;
+        descriptor.revents = 0;
+
+        return poll(&descriptor, 1, timeout) > 0;
+    }
+
+    // receives all currently available data into ring, returns number of received bytes
+    size_t receive() {
+        size_t received = 0;
+
+        while(!inputFinished && writePosition - readPosition < ringSize) {
+            const size_t offset = writePosition % ringSize;
+            const size_t space = min<size_t>(ringSize - (writePosition - readPosition), ringSize - offset);
+
+            ssize_t count = -1;
+            if(inputPipe) {
+                loff_t fileOffset = offset;
+                count = splice(input, nullptr, ringFile, &fileOffset, space, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if(count < 0 && errno == EINVAL) {
+                    // splice into memfd isn't supported, read instead
+                    inputPipe = false;
+                    continue;
+                }
+            } else {
+                count = read(input, ring + offset, space);
+            }
+
+            if(count < 0) {
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    inputFailed = true;
+                    inputFinished = true;
+                }
+                break;
+            }
+
+            if(count == 0) {
+                inputFinished = true;
+                break;
+            }
+
+            writePosition += count;
+            received += count;
+        }
+
+        updateRate(received);
+        scan();
+        return received;
+    }
+
+    /*
+        gives a run of complete NALs (from the oldest data to the last found start code)
+        pointer stays valid until release is called, which marks it as consumed
+
+        once input is finished, or if ring is full without a complete NAL, all data is given
+    */
+    bool next(const char *&data, int &size) {
+        size_t available = 0;
+
+        if(hasStart && lastStart > readPosition) {
+            available = lastStart - readPosition;
+        }
+
+        if(inputFinished || (available == 0 && writePosition - readPosition >= ringSize)) {
+            available = writePosition - readPosition;
+        }
+
+        if(available == 0) {
+            return false;
+        }
+
+        data = ring + readPosition % ringSize;
+        size = available;
+        pendingRelease = available;
+        pendingLast = inputFinished && available == writePosition - readPosition;
+        return true;
+    }
+
+    void release() {
+        readPosition += pendingRelease;
+        pendingRelease = 0;
+
+        if(hasStart && lastStart < readPosition) {
+            hasStart = false;
+        }
+    }
+
+    // is the run given by last next call at the end of input
+    bool last() {
+        return pendingLast;
+    }
+
+    // does consumer have everything from the input
+    bool finished() {
+        return inputFinished && readPosition == writePosition;
+    }
+
+    bool failed() {
+        return inputFailed;
+    }
+
+    // received bytes per second (measured over the last second)
+    double bytesPerSecond() {
+        return rate;
+    }
+
+    // how much of the ring is filled (0 - 1)
+    double occupancy() {
+        return ringSize > 0 ? (double)(writePosition - readPosition) / ringSize : 0;
+    }
+};
@@ -0,0 +1,242 @@
+// Lightweight tracing of decoding stages (Chrome trace JSON, opened by Perfetto)
+// Written by ukicomputers
+
+#pragma once
+#include <string>
+#include <csignal>
+using namespace std;
+
+/*
+    note for tracing:
+
+    tracing is compiled in only when V4L2_TRACE is defined (for example g++ -DV4L2_TRACE ...),
+    otherwise trace points are empty and trace functions do nothing
+
+    TRACE_SCOPE(name) records time from the statement to the end of its scope, and
+    TRACE_CALL(name, expression) records time of a single expression (for example an ioctl)
+    names must be string literals
+
+    every thread writes into its own ring of the last traceRingEvents events, without locks,
+    so tracing doesn't change timing noticeably, and older events are overwritten
+
+    traceDump writes events of all threads to a file in Chrome trace JSON format, which can be
+    opened in ui.perfetto.dev or chrome://tracing, traceInstallSignal dumps on a signal
+    (signal handler only sets a flag, file is written by a background thread)
+*/
+
+// default settings
+const int traceRingEvents = 16384; // events kept per thread
+const int traceSignalPoll = 100; // interval (ms) of checking for a dump request
+
+#ifdef V4L2_TRACE
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cinttypes>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct TraceRing {
+    // fields are atomic, so a dump can read them while the owner thread writes
+    struct Event {
+        atomic<const char *> name{nullptr};
+        atomic<uint64_t> start{0}; // ns of steady clock
+        atomic<uint64_t> duration{0};
+    };
+
+    Event events[traceRingEvents];
+    atomic<uint64_t> head{0}; // events written so far
+    long threadId = syscall(SYS_gettid);
+    string threadName;
+
+    // only the owner thread writes
+    void record(const char *name, const uint64_t start, const uint64_t duration) {
+        const uint64_t position = head.load(memory_order_relaxed);
+        Event &event = events[position % traceRingEvents];
+
+        event.name.store(name, memory_order_relaxed);
+        event.start.store(start, memory_order_relaxed);
+        event.duration.store(duration, memory_order_relaxed);
+        head.store(position + 1, memory_order_release);
+    }
+};
+
+struct Tracer {
+private:
+    mutex registryMutex;
+    vector<shared_ptr<TraceRing>> rings; // rings outlive their threads, so events of finished threads are kept
+
+    // signal dump
+    inline static atomic<bool> dumpRequested{false};
+    thread dumper;
+    atomic<bool> stopDumper{false};
+    string dumpDirectory;
+    int dumps = 0;
+
+    static void signalHandler(int) {
+        dumpRequested.store(true);
+    }
+
+    void dumpLoop() {
+        while(!stopDumper.load()) {
+            this_thread::sleep_for(chrono::milliseconds(traceSignalPoll));
+
+            if(dumpRequested.exchange(false)) {
+                char name[64];
+                snprintf(name, sizeof(name), "/trace-%d-%d.json", (int)getpid(), ++dumps);
+                dump(dumpDirectory + name);
+            }
+        }
+    }
+public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    ~Tracer() {
+        stopDumper.store(true);
+        if(dumper.joinable()) {
+            dumper.join();
+        }
+    }
+
+    TraceRing &ring() {
+        thread_local shared_ptr<TraceRing> local;
+        if(!local) {
+            local = make_shared<TraceRing>();
+
+            lock_guard<mutex> lock(registryMutex);
+            rings.push_back(local);
+        }
+
+        return *local;
+    }
+
+    static uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void setThreadName(const string &name) {
+        TraceRing &current = ring();
+
+        lock_guard<mutex> lock(registryMutex);
+        current.threadName = name;
+    }
+
+    bool dump(const string &path) {
+        FILE *output = fopen(path.c_str(), "w");
+        if(!output) {
+            return false;
+        }
+
+        const int pid = getpid();
+        bool first = true;
+        const auto separator = [&]() {
+            fputs(first ? "\n" : ",\n", output);
+            first = false;
+        };
+
+        fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", output);
+
+        lock_guard<mutex> lock(registryMutex);
+        for(const auto &ring : rings) {
+            if(!ring->threadName.empty()) {
+                separator();
+                fprintf(output, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %ld, \"args\": {\"name\": \"%s\"}}", pid, ring->threadId, ring->threadName.c_str());
+            }
+
+            const uint64_t head = ring->head.load(memory_order_acquire);
+            const uint64_t oldest = head > traceRingEvents ? head - traceRingEvents : 0;
+
+            for(uint64_t i = oldest; i < head; i++) {
+                const TraceRing::Event &event = ring->events[i % traceRingEvents];
+                const char *name = event.name.load(memory_order_relaxed);
+                const uint64_t start = event.start.load(memory_order_relaxed);
+                const uint64_t duration = event.duration.load(memory_order_relaxed);
+
+                // skip events which were overwritten by the owner thread while reading
+                if(ring->head.load(memory_order_acquire) - i > traceRingEvents || !name) {
+                    continue;
+                }
+
+                separator();
+                fprintf(
+                    output, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %ld, \"ts\": %" PRIu64 ".%03d, \"dur\": %" PRIu64 ".%03d}",
+                    name, pid, ring->threadId, start / 1000, (int)(start % 1000), duration / 1000, (int)(duration % 1000)
+                );
+            }
+        }
+
+        fputs("\n]}\n", output);
+        return fclose(output) == 0;
+    }
+
+    bool installSignal(const int signal, const string &directory) {
+        lock_guard<mutex> lock(registryMutex);
+        if(dumper.joinable()) {
+            return false;
+        }
+
+        dumpDirectory = directory;
+        if(::signal(signal, &Tracer::signalHandler) == SIG_ERR) {
+            return false;
+        }
+
+        dumper = thread(&Tracer::dumpLoop, this);
+        return true;
+    }
+};
+
+struct TraceScope {
+    const char *name;
+    uint64_t start;
+
+    TraceScope(const char *scopeName) : name(scopeName), start(Tracer::now()) {}
+
+    // callers check errno of the traced call after the scope ends (first event of a thread allocates its ring)
+    ~TraceScope() {
+        const int savedErrno = errno;
+        Tracer::instance().ring().record(name, start, Tracer::now() - start);
+        errno = savedErrno;
+    }
+};
+
+#define TRACE_JOIN(a, b) a##b
+#define TRACE_NAME(line) TRACE_JOIN(traceScope, line)
+#define TRACE_SCOPE(name) TraceScope TRACE_NAME(__LINE__)(name)
+#define TRACE_CALL(name, expression) ([&]() { TraceScope traceScope(name); return (expression); }())
+
+// writes traced events of all threads to path
+inline bool traceDump(const string &path) {
+    return Tracer::instance().dump(path);
+}
+
+// dumps to directory/trace-PID-N.json whenever signal is received
+inline bool traceInstallSignal(const int signal = SIGUSR2, const string &directory = ".") {
+    return Tracer::instance().installSignal(signal, directory);
+}
+
+// names calling thread in dumps
+inline void traceThreadName(const string &name) {
+    Tracer::instance().setThreadName(name);
+}
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_CALL(name, expression) (expression)
+
+inline bool traceDump(const string &) {
+    return false;
+}
+
+inline bool traceInstallSignal(const int = SIGUSR2, const string & = ".") {
+    return false;
+}
+
+inline void traceThreadName(const string &) {}
+#endif
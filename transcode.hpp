@@ -0,0 +1,311 @@
+// Hardware transcoding (decoder -> optional scaler -> encoder) without copying frames
+// Written by ukicomputers
+
+#pragma once
+#include "decoder.hpp"
+#include "encoder.hpp"
+#include <deque>
+using namespace std;
+
+const int transcodeStallTimeout = 1000; // maximal wait (ms) for a downstream device to free a buffer
+
+struct TranscodeOptions {
+    int bitrate = encoderBitrate;
+    int gopSize = encoderGOPSize;
+    pair<int, int> scaledSize = {0, 0}; // {0, 0} for no scaling
+    string decoderDevice = decoderDev;
+    string encoderDevice = encoderDev;
+    string scalerDevice = scalerDev;
+    Codec inputCodec = Codec::H264; // H.264, HEVC, MJPEG or FWHT (framed IVF loses its headers, so not VP8/VP9)
+    uint32_t codec = V4L2_PIX_FMT_H264; // output format of encoder
+};
+
+/*
+    note for transcoding:
+
+    decoded frames stay in decoder capture buffers (see note for holding frames), which are exported
+    as dmabufs and passed to encoder (or first to scaler) input, so frames are never copied by CPU
+
+    a decoder capture buffer is returned to the decoder only after the next device consumed it,
+    so input is passed to the decoder one access unit (or frame) at a time, and only while it has
+    a free capture buffer, if downstream devices are slow, transcode waits for them (backpressure
+    through all stages)
+
+    decoder and encoder must agree on frame layout (stride), otherwise initialization fails
+    with INCOMPATIBLE_HARDWARE
+*/
+
+class Transcoder {
+private:
+    Decoder decoder;
+    Encoder encoder;
+    Scaler scaler;
+    bool scaling = false;
+    bool initialized = false;
+
+    unique_ptr<Framer> framer; // NALs are joined into access units, other codecs give whole frames
+    AccessUnitAssembler assembler;
+    AccessUnit unit;
+
+    deque<Decoder::HeldFrame> decoded; // taken from decoder, not passed on yet
+    deque<Scaler::ScaledFrame> scaled;
+
+    long long decodedFrames = 0;
+    long long encodedFrames = 0;
+    long long stalls = 0;
+
+    // moves frames between stages as far as free buffers allow, and collects encoded data
+    bool pump(Encoder::EncodedData &returnedOutput) {
+        vector<int> tags;
+
+        // buffers consumed by encoder go back to their owner
+        if(!encoder.reclaim(tags)) {
+            return false;
+        }
+
+        for(const int tag : tags) {
+            if(!(scaling ? scaler.releaseFrame(tag) : decoder.releaseFrame(tag))) {
+                return false;
+            }
+        }
+
+        if(scaling) {
+            tags.clear();
+            if(!scaler.reclaim(tags)) {
+                return false;
+            }
+
+            for(const int tag : tags) {
+                if(!decoder.releaseFrame(tag)) {
+                    return false;
+                }
+            }
+        }
+
+        Decoder::HeldFrame frame;
+        while(decoder.takeFrame(frame)) {
+            decoded.push_back(frame);
+            decodedFrames++;
+        }
+
+        if(scaling) {
+            while(!decoded.empty() && scaler.canSubmit()) {
+                if(!scaler.submit(decoded.front().dmabuf, decoded.front().size, decoded.front().index)) {
+                    return false;
+                }
+
+                decoded.pop_front();
+            }
+
+            Scaler::ScaledFrame scaledFrame;
+            while(scaler.takeFrame(scaledFrame)) {
+                scaled.push_back(scaledFrame);
+            }
+
+            while(!scaled.empty() && encoder.canSubmit()) {
+                if(!encoder.submit(scaled.front().dmabuf, scaled.front().size, scaled.front().index)) {
+                    return false;
+                }
+
+                scaled.pop_front();
+            }
+        } else {
+            while(!decoded.empty() && encoder.canSubmit()) {
+                if(!encoder.submit(decoded.front().dmabuf, decoded.front().size, decoded.front().index)) {
+                    return false;
+                }
+
+                decoded.pop_front();
+            }
+        }
+
+        Encoder::EncodedData encodedData = encoder.receive();
+        if(encodedData.status != Decoder::Status::OK) {
+            return false;
+        }
+
+        returnedOutput.output.insert(returnedOutput.output.end(), encodedData.output.begin(), encodedData.output.end());
+        returnedOutput.frames += encodedData.frames;
+        encodedFrames += encodedData.frames;
+        return true;
+    }
+
+    // waits for any downstream device to make progress
+    bool waitDownstream() {
+        stalls++;
+        return encoder.wait(transcodeStallTimeout / 2) || (scaling && scaler.wait(transcodeStallTimeout / 2));
+    }
+
+    // frames which aren't passed to encoder yet
+    bool framesInFlight() {
+        return !decoded.empty() || !scaled.empty() || (scaling && scaler.getQueuedInput() > 0);
+    }
+
+    // passes a whole frame (access unit) to the decoder
+    bool decodeUnit(const uint8_t *data, const size_t size, Encoder::EncodedData &returnedOutput) {
+        // backpressure: decoder needs a free capture buffer for the frame
+        while(decoder.getFreeCaptureBuffers() == 0) {
+            if(!pump(returnedOutput)) {
+                return false;
+            }
+
+            if(decoder.getFreeCaptureBuffers() == 0 && !waitDownstream() && decoder.getFreeCaptureBuffers() == 0) {
+                return false;
+            }
+        }
+
+        Decoder::DecodedFrame decodedFrame = decoder.decode(reinterpret_cast<const char *>(data), size, false);
+        return decodedFrame.status == Decoder::Status::OK && pump(returnedOutput);
+    }
+public:
+    Decoder::InitStatus initialize(const int width, const int height, const TranscodeOptions &options = {}) {
+        if(initialized) {
+            return Decoder::InitStatus::OK;
+        }
+
+        if(options.inputCodec == Codec::VP8 || options.inputCodec == Codec::VP9) {
+            return Decoder::InitStatus::INCOMPATIBLE_HARDWARE;
+        }
+
+        Decoder::InitStatus status = decoder.initializeDecoder(width, height, -1, options.decoderDevice, -1, options.inputCodec);
+        if(status != Decoder::InitStatus::OK) {
+            return status;
+        }
+
+        if(!decoder.exportBuffers()) {
+            unload();
+            return Decoder::InitStatus::INCOMPATIBLE_HARDWARE;
+        }
+
+        decoder.setHoldFrames(true);
+        framer = Framer::create(options.inputCodec);
+        assembler = AccessUnitAssembler(options.inputCodec);
+
+        pair<int, int> encodedSize = decoder.getImageSize();
+        int stride = decoder.getCaptureStride();
+
+        scaling = options.scaledSize.first > 0 && options.scaledSize.second > 0 && options.scaledSize != encodedSize;
+        if(scaling) {
+            status = scaler.initializeScaler(encodedSize, stride, options.scaledSize, options.scalerDevice);
+            if(status != Decoder::InitStatus::OK) {
+                unload();
+                return status;
+            }
+
+            encodedSize = scaler.getOutputSize();
+            stride = scaler.getOutputStride();
+        }
+
+        status = encoder.initializeEncoder(encodedSize.first, encodedSize.second, options.bitrate, options.gopSize, options.encoderDevice, true, stride, options.codec);
+        if(status != Decoder::InitStatus::OK) {
+            unload();
+            return status;
+        }
+
+        initialized = true;
+        return Decoder::InitStatus::OK;
+    }
+
+    // passes next chunk of input, returns encoded data which is ready
+    Encoder::EncodedData transcode(const char *data, const size_t size, const bool lastData) {
+        Encoder::EncodedData returnedOutput;
+
+        if(!initialized) {
+            returnedOutput.status = Decoder::Status::NOT_INITIALIZED;
+            return returnedOutput;
+        }
+
+        bool succeeded = true;
+        const auto output = [&](const uint8_t *nal, size_t nalSize, int, long long offset) {
+            if(!succeeded) {
+                return;
+            }
+
+            if(!framer->annexB()) {
+                succeeded = decodeUnit(nal, nalSize, returnedOutput);
+            } else if(assembler.push(nal, nalSize, offset, unit)) {
+                succeeded = decodeUnit(unit.data.data(), unit.data.size(), returnedOutput);
+            }
+        };
+
+        framer->push(reinterpret_cast<const uint8_t *>(data), size, output);
+
+        if(lastData) {
+            framer->flush(output);
+
+            if(succeeded && framer->annexB() && assembler.flush(unit)) {
+                succeeded = decodeUnit(unit.data.data(), unit.data.size(), returnedOutput);
+            }
+
+            // remaining frames of all stages, decoder gives them only into capture buffers which
+            // downstream devices gave back, so draining goes on while frames are passed on
+            auto progressTime = chrono::steady_clock::now();
+            while(succeeded && !decoder.isDrained()) {
+                const int freeBuffers = decoder.getFreeCaptureBuffers();
+                Decoder::DecodedFrame decodedFrame = decoder.drain(freeBuffers > 0);
+                succeeded = decodedFrame.status == Decoder::Status::OK && pump(returnedOutput);
+
+                if(decodedFrame.frames > 0 || decoder.getFreeCaptureBuffers() > freeBuffers) {
+                    progressTime = chrono::steady_clock::now();
+                } else if(succeeded && !decoder.isDrained()) {
+                    // no stage made progress within timeout
+                    waitDownstream();
+                    succeeded = chrono::steady_clock::now() - progressTime < chrono::milliseconds(transcodeStallTimeout);
+                }
+            }
+
+            while(succeeded && framesInFlight()) {
+                succeeded = pump(returnedOutput);
+
+                // no progress within timeout
+                if(succeeded && framesInFlight() && !waitDownstream()) {
+                    succeeded = pump(returnedOutput) && !framesInFlight();
+                }
+            }
+
+            if(succeeded) {
+                Encoder::EncodedData encodedData = encoder.drain();
+                succeeded = encodedData.status == Decoder::Status::OK;
+                returnedOutput.output.insert(returnedOutput.output.end(), encodedData.output.begin(), encodedData.output.end());
+                returnedOutput.frames += encodedData.frames;
+                encodedFrames += encodedData.frames;
+            }
+        }
+
+        if(!succeeded) {
+            returnedOutput.status = Decoder::Status::FAILED;
+        }
+
+        return returnedOutput;
+    }
+
+    Encoder &getEncoder() {
+        return encoder;
+    }
+
+    long long getDecodedFrames() {
+        return decodedFrames;
+    }
+
+    long long getEncodedFrames() {
+        return encodedFrames;
+    }
+
+    // waits for a downstream device to free a buffer (backpressure)
+    long long getStalls() {
+        return stalls;
+    }
+
+    void unload() {
+        encoder.unload();
+        scaler.unload();
+        decoder.unload();
+
+        framer = nullptr;
+        assembler = {};
+        unit = {};
+        decoded.clear();
+        scaled.clear();
+        initialized = false;
+    }
+};
@@ -0,0 +1,252 @@
+// Trick-play (fast forward) of H.264 (or HEVC) input
+// Written by ukicomputers
+
+#pragma once
+#include "lazy.hpp"
+#include <deque>
+#include <chrono>
+using namespace std;
+
+const double trickOutputRate = 25; // output frames per second the player is shown at
+const int trickMinimalSamples = 10; // decoded frames before measured decode cost is trusted
+
+/*
+    note for trick-play:
+
+    at speed N, one output frame is shown for every N * frameRate / outputRate frames of stream (step)
+    decoding every frame is often too slow for that, so TrickPlayer chooses which access units to submit:
+
+    ALL - every frame is decoded, and every step-th is returned
+    REFERENCE_ONLY - non-reference frames (nal_ref_idc = 0, or HEVC sub-layer non-reference pictures, usually B frames) are dropped
+    KEYFRAMES_ONLY - only IDRs are decoded, jumping through the IDR index to the one closest to the next output
+
+    mode is chosen from measured decode cost per frame, as the least dropping one which still meets
+    output rate, and it is changed only on IDR boundaries (so references are never missing)
+    until enough frames are measured, KEYFRAMES_ONLY is used for speeds above 1x
+
+    effective speed is stream time passed per playback time, where playback time is the time
+    output frames take at output rate, or more if decoding couldn't keep up
+
+    index must be complete (not extended by ingesting) while playing
+    like with LazyDecoder, frames are numbered in decode order, which is expected to be output order
+*/
+
+class TrickPlayer {
+public:
+    enum class Mode {
+        ALL,
+        REFERENCE_ONLY,
+        KEYFRAMES_ONLY
+    };
+private:
+    StreamIndex &index;
+    Decoder &decoder;
+    double frameRate;
+    double outputRate;
+    double speed = 1;
+
+    Mode mode = Mode::ALL;
+    long long submitPosition = -1; // next access unit which may be submitted
+    double nextOutput = 0; // frame number of the next output frame
+    deque<pair<long long, bool>> submitted; // frame numbers of submitted access units (not decoded yet), and if they are chosen for output
+    deque<pair<long long, vector<uint8_t>>> ready; // decoded frames waiting to be returned
+    pair<int, int> imageSize;
+    bool drained = false;
+
+    // decode cost
+    double decodeSeconds = 0;
+    long long decodedFrames = 0;
+
+    // effective speed
+    long long startFrame = -1;
+    long long position = -1; // last returned frame
+    long long outputFrames = 0;
+    chrono::steady_clock::time_point startTime;
+
+    double step() {
+        return max(speed * frameRate / outputRate, 1.0);
+    }
+
+    // least dropping mode which still meets output rate
+    Mode chooseMode() {
+        if(step() <= 1) {
+            return Mode::ALL;
+        }
+
+        if(decodedFrames < trickMinimalSamples) {
+            return Mode::KEYFRAMES_ONLY;
+        }
+
+        const double frameCost = decodeSeconds / decodedFrames;
+        const double referenceShare = index.getFrames() > 0 ? (double)index.getReferenceFrames() / index.getFrames() : 1;
+
+        if(step() * frameCost <= 1 / outputRate) {
+            return Mode::ALL;
+        }
+
+        if(step() * referenceShare * frameCost <= 1 / outputRate) {
+            return Mode::REFERENCE_ONLY;
+        }
+
+        return Mode::KEYFRAMES_ONLY;
+    }
+
+    // decoded frames get frame numbers in order they were submitted
+    void collect(Decoder::DecodedFrame &decodedFrame) {
+        if(decodedFrame.frames == 0) {
+            return;
+        }
+
+        imageSize = decodedFrame.imageSize;
+        const size_t frameSize = decodedFrame.output.size() / decodedFrame.frames;
+
+        for(int i = 0; i < decodedFrame.frames && !submitted.empty(); i++) {
+            const long long frame = submitted.front().first;
+            const bool chosen = submitted.front().second;
+            submitted.pop_front();
+
+            if(chosen || frame >= nextOutput) {
+                const uint8_t *data = decodedFrame.output.data() + i * frameSize;
+                ready.emplace_back(frame, vector<uint8_t>(data, data + frameSize));
+                nextOutput = max(nextOutput + step(), (double)frame + 1);
+            }
+        }
+    }
+
+    // submits the next access unit(s) by current mode, false at the end of stream
+    bool submit(Decoder::Status &status) {
+        if(submitPosition < 0 || submitPosition >= index.getFrames()) {
+            return false;
+        }
+
+        // in keyframes only mode, jump to the IDR closest to the next output frame
+        if(mode == Mode::KEYFRAMES_ONLY) {
+            long long keyframe = index.keyframeBefore((long long)nextOutput);
+            if(keyframe < submitPosition) {
+                keyframe = index.keyframeAfter(submitPosition);
+            }
+
+            if(keyframe < 0) {
+                return false;
+            }
+
+            submitPosition = keyframe;
+        }
+
+        const AccessUnit &unit = index.getUnit(submitPosition);
+
+        // mode is changed only on IDR (also in keyframes only mode, where it decides how to continue)
+        if(unit.keyframe) {
+            mode = chooseMode();
+        }
+
+        if(mode == Mode::REFERENCE_ONLY && !unit.reference) {
+            submitPosition++;
+            return true;
+        }
+
+        submitted.emplace_back(submitPosition, mode == Mode::KEYFRAMES_ONLY);
+        submitPosition++;
+
+        const auto decodeStart = chrono::steady_clock::now();
+        Decoder::DecodedFrame decodedFrame = decoder.decode(reinterpret_cast<const char *>(unit.data.data()), unit.data.size(), false);
+        decodeSeconds += chrono::duration<double>(chrono::steady_clock::now() - decodeStart).count();
+        decodedFrames += decodedFrame.frames;
+
+        status = decodedFrame.status;
+        collect(decodedFrame);
+        return true;
+    }
+public:
+    // decoder must be initialized, and it is used only by this object, frameRate is frame rate of stream
+    TrickPlayer(StreamIndex &streamIndex, Decoder &videoDecoder, const double streamFrameRate, const double rate = trickOutputRate) : index(streamIndex), decoder(videoDecoder), frameRate(streamFrameRate), outputRate(rate) {}
+
+    // playback speed (for example 8, 16 or 32), applies from the next output frame
+    void setSpeed(const double playbackSpeed) {
+        speed = max(playbackSpeed, 1.0);
+
+        // speed is measured again from now
+        startFrame = position;
+        outputFrames = 0;
+        startTime = chrono::steady_clock::now();
+    }
+
+    // starts playback from the last IDR at or before frame
+    bool seek(const long long frame = 0) {
+        long long keyframe = index.keyframeBefore(frame);
+        if(keyframe < 0) {
+            keyframe = index.keyframeAfter(0);
+        }
+
+        if(keyframe < 0 || !decoder.resetStream(index.getUnit(keyframe).offset)) {
+            submitPosition = -1;
+            return false;
+        }
+
+        submitPosition = keyframe;
+        nextOutput = max(frame, keyframe);
+        submitted.clear();
+        ready.clear();
+        drained = false;
+        mode = chooseMode();
+
+        position = nextOutput - 1;
+        setSpeed(speed);
+        return true;
+    }
+
+    // returns the next output frame (frames = 1), at the end of stream no frame is returned (frames = 0)
+    Decoder::DecodedFrame next() {
+        Decoder::DecodedFrame returnedOutput;
+
+        while(ready.empty()) {
+            Decoder::Status status = Decoder::Status::OK;
+
+            if(!submit(status)) {
+                if(drained || submitPosition < 0) {
+                    return returnedOutput;
+                }
+
+                // remaining frames in the device
+                Decoder::DecodedFrame decodedFrame = decoder.drain();
+                status = decodedFrame.status;
+                collect(decodedFrame);
+                drained = true;
+            }
+
+            if(status != Decoder::Status::OK) {
+                returnedOutput.status = status;
+                return returnedOutput;
+            }
+        }
+
+        position = ready.front().first;
+        returnedOutput.output = move(ready.front().second);
+        returnedOutput.imageSize = imageSize;
+        returnedOutput.frames = 1;
+        ready.pop_front();
+
+        outputFrames++;
+        return returnedOutput;
+    }
+
+    // frame number of the last returned frame
+    long long getPosition() {
+        return position;
+    }
+
+    Mode getMode() {
+        return mode;
+    }
+
+    // achieved speed since the last seek or speed change
+    double getEffectiveSpeed() {
+        if(outputFrames == 0) {
+            return 0;
+        }
+
+        const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        const double playback = max(elapsed, outputFrames / outputRate);
+        return (position - startFrame) / frameRate / playback;
+    }
+};
@@ -0,0 +1,204 @@
+// C API of the decoder (see v4l2dec.h)
+// Written by ukicomputers
+
+#include "v4l2dec.h"
+#include "decoder.hpp"
+#include <new>
+#include <cstddef>
+using namespace std;
+
+/*
+    H.264 and HEVC input is split into access units, so only whole frames wait for a free capture
+    buffer, input of other codecs waits in submitted chunks (their framers strip container headers,
+    which the decoder needs to see)
+*/
+
+struct v4l2dec {
+    Decoder decoder;
+    bool annexB = false;
+
+    NALSplitter splitter;
+    AccessUnitAssembler assembler;
+    AccessUnit unit;
+
+    deque<vector<uint8_t>> pending; // input not passed to the device yet
+    bool finishing = false; // last input is submitted
+
+    // passes waiting input while the device has free capture buffers
+    int feed() {
+        while(!pending.empty() && decoder.getFreeCaptureBuffers() > 0) {
+            const vector<uint8_t> &data = pending.front();
+            if(decoder.decode(reinterpret_cast<const char *>(data.data()), data.size(), false).status != Decoder::Status::OK) {
+                return V4L2DEC_FAILED;
+            }
+
+            pending.pop_front();
+        }
+
+        // while every capture buffer is held, only frames which are already decoded are taken,
+        // draining goes on in next calls until the last buffer is dequeued
+        if(finishing && pending.empty() && !decoder.isDrained()) {
+            if(decoder.drain(decoder.getFreeCaptureBuffers() > 0).status != Decoder::Status::OK) {
+                return V4L2DEC_FAILED;
+            }
+        }
+
+        return V4L2DEC_OK;
+    }
+};
+
+// v4l2dec_frame of the first layout with struct_size (version 2), fields added later are filled only
+// if they fit into struct_size of the caller (see note for C API)
+static const size_t minimalFrameSize = offsetof(v4l2dec_frame, field) + sizeof(int);
+
+// codecs of the C API are passed as Codec
+static_assert(static_cast<int>(Codec::H264) == V4L2DEC_CODEC_H264 && static_cast<int>(Codec::FWHT) == V4L2DEC_CODEC_FWHT, "codec numbering differs");
+
+static int statusOf(const Decoder::InitStatus status) {
+    switch(status) {
+        case Decoder::InitStatus::OK: return V4L2DEC_OK;
+        case Decoder::InitStatus::DEVICE_NOT_FOUND: return V4L2DEC_DEVICE_NOT_FOUND;
+        case Decoder::InitStatus::INCOMPATIBLE_HARDWARE: return V4L2DEC_INCOMPATIBLE_HARDWARE;
+        case Decoder::InitStatus::INSUFFICIENT_MEMORY: return V4L2DEC_INSUFFICIENT_MEMORY;
+        default: return V4L2DEC_FAILED;
+    }
+}
+
+extern "C" {
+
+int v4l2dec_version(void) {
+    return V4L2DEC_VERSION;
+}
+
+v4l2dec *v4l2dec_open(const char *device, int width, int height, int codec, int *status) {
+    int result = V4L2DEC_INVALID_ARGUMENT;
+    v4l2dec *decoder = nullptr;
+
+    if(width > 0 && height > 0 && codec >= V4L2DEC_CODEC_H264 && codec <= V4L2DEC_CODEC_FWHT) {
+        decoder = new(nothrow) v4l2dec;
+        result = decoder ? V4L2DEC_OK : V4L2DEC_INSUFFICIENT_MEMORY;
+    }
+
+    if(decoder) {
+        const Codec inputCodec = static_cast<Codec>(codec);
+        result = statusOf(decoder->decoder.initializeDecoder(width, height, -1, device ? device : decoderDev, -1, inputCodec));
+
+        if(result == V4L2DEC_OK) {
+            decoder->decoder.setHoldFrames(true);
+            decoder->annexB = inputCodec == Codec::H264 || inputCodec == Codec::HEVC;
+            decoder->assembler = AccessUnitAssembler(inputCodec);
+        } else {
+            delete decoder;
+            decoder = nullptr;
+        }
+    }
+
+    if(status) {
+        *status = result;
+    }
+
+    return decoder;
+}
+
+int v4l2dec_submit(v4l2dec *decoder, const void *data, size_t size, int last) {
+    if(!decoder || (!data && size > 0) || decoder->finishing) {
+        return V4L2DEC_INVALID_ARGUMENT;
+    }
+
+    // exceptions (allocation failures) must not cross the C boundary
+    try {
+        const uint8_t *input = static_cast<const uint8_t *>(data);
+
+        if(decoder->annexB) {
+            const auto output = [decoder](const uint8_t *nal, size_t nalSize, int, long long offset) {
+                if(decoder->assembler.push(nal, nalSize, offset, decoder->unit)) {
+                    decoder->pending.push_back(move(decoder->unit.data));
+                }
+            };
+
+            decoder->splitter.push(input, size, output);
+            if(last) {
+                decoder->splitter.flush(output);
+                if(decoder->assembler.flush(decoder->unit)) {
+                    decoder->pending.push_back(move(decoder->unit.data));
+                }
+            }
+        } else if(size > 0) {
+            decoder->pending.emplace_back(input, input + size);
+        }
+    } catch(const bad_alloc &) {
+        return V4L2DEC_INSUFFICIENT_MEMORY;
+    }
+
+    decoder->finishing = last;
+    return decoder->feed();
+}
+
+int v4l2dec_receive(v4l2dec *decoder, v4l2dec_frame *frame) {
+    if(!decoder || !frame || frame->struct_size < minimalFrameSize) {
+        return V4L2DEC_INVALID_ARGUMENT;
+    }
+
+    Decoder::HeldFrame held;
+    if(!decoder->decoder.takeFrame(held)) {
+        const int status = decoder->feed();
+        if(status != V4L2DEC_OK) {
+            return status;
+        }
+
+        if(!decoder->decoder.takeFrame(held)) {
+            return decoder->finishing && decoder->pending.empty() && decoder->decoder.isDrained() ? V4L2DEC_END : V4L2DEC_AGAIN;
+        }
+    }
+
+    frame->data = held.data;
+    frame->size = held.size;
+    frame->width = held.imageSize.first;
+    frame->height = held.imageSize.second;
+    frame->stride = decoder->decoder.getCaptureStride();
+    frame->dmabuf = held.dmabuf;
+    frame->index = held.index;
+    frame->field = held.field;
+    return V4L2DEC_OK;
+}
+
+int v4l2dec_frame_release(v4l2dec *decoder, const v4l2dec_frame *frame) {
+    if(!decoder || !frame) {
+        return V4L2DEC_INVALID_ARGUMENT;
+    }
+
+    return decoder->decoder.releaseFrame(frame->index) ? V4L2DEC_OK : V4L2DEC_INVALID_ARGUMENT;
+}
+
+int v4l2dec_reset(v4l2dec *decoder) {
+    if(!decoder) {
+        return V4L2DEC_INVALID_ARGUMENT;
+    }
+
+    decoder->splitter.reset();
+    decoder->assembler = AccessUnitAssembler(decoder->decoder.getCodec());
+    decoder->unit = {};
+    decoder->pending.clear();
+    decoder->finishing = false;
+
+    return decoder->decoder.resetStream() ? V4L2DEC_OK : V4L2DEC_FAILED;
+}
+
+void v4l2dec_close(v4l2dec *decoder) {
+    delete decoder;
+}
+
+const char *v4l2dec_status_string(int status) {
+    switch(status) {
+        case V4L2DEC_OK: return "ok";
+        case V4L2DEC_AGAIN: return "no frame available yet";
+        case V4L2DEC_END: return "end of stream";
+        case V4L2DEC_DEVICE_NOT_FOUND: return "device not found";
+        case V4L2DEC_INCOMPATIBLE_HARDWARE: return "incompatible hardware";
+        case V4L2DEC_INSUFFICIENT_MEMORY: return "insufficient memory";
+        case V4L2DEC_INVALID_ARGUMENT: return "invalid argument";
+        default: return "decoding failed";
+    }
+}
+
+}
@@ -0,0 +1,108 @@
+/* C API of the decoder (for bindings to other languages, see v4l2dec_python.cpp) */
+/* Written by ukicomputers */
+
+#ifndef V4L2DEC_H
+#define V4L2DEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    note for C API:
+
+    v4l2dec wraps Decoder with held frames (see note for holding frames in decoder.hpp), so decoded
+    frames are given straight from the mapped capture buffers of the device, without copying
+
+    submit passes input in chunks of any size, it is split into access units (or frames) which are
+    passed to the device only while it has a free capture buffer, the rest waits inside the decoder
+    receive gives the next decoded frame, which stays valid until v4l2dec_frame_release, and it also
+    passes waiting input to the device, so call it until it returns V4L2DEC_AGAIN after every submit
+    after input submitted with last set, remaining frames are drained and receive ends with V4L2DEC_END
+    once the last one is given, while all capture buffers are held it gives V4L2DEC_AGAIN until
+    frames are released
+
+    functions of one decoder must not be called from multiple threads at the same time
+    frames which aren't released hold capture buffers, so the device stops decoding when all are held
+
+    ABI is stable within V4L2DEC_VERSION: v4l2dec is opaque, and v4l2dec_frame is allocated by the
+    caller, who sets struct_size to sizeof(v4l2dec_frame) of the header it was built with (for
+    example with V4L2DEC_FRAME_INIT), new fields are added at the end, and the library fills only
+    fields which fit into struct_size, so older callers keep working
+    any other change of the layout bumps V4L2DEC_VERSION (compare it with v4l2dec_version)
+*/
+
+#define V4L2DEC_VERSION 2
+
+/* only functions below are exported when the library is built with -fvisibility=hidden */
+#define V4L2DEC_API __attribute__((visibility("default")))
+
+typedef struct v4l2dec v4l2dec;
+
+enum v4l2dec_codec {
+    V4L2DEC_CODEC_H264,
+    V4L2DEC_CODEC_HEVC,
+    V4L2DEC_CODEC_MJPEG,
+    V4L2DEC_CODEC_VP8, /* in IVF container */
+    V4L2DEC_CODEC_VP9, /* in IVF container */
+    V4L2DEC_CODEC_FWHT
+};
+
+enum v4l2dec_status {
+    V4L2DEC_OK = 0,
+    V4L2DEC_AGAIN = 1, /* no frame is decoded yet, submit more input (or release frames) */
+    V4L2DEC_END = 2, /* all frames of input are received */
+    V4L2DEC_DEVICE_NOT_FOUND = -1,
+    V4L2DEC_INCOMPATIBLE_HARDWARE = -2,
+    V4L2DEC_INSUFFICIENT_MEMORY = -3,
+    V4L2DEC_INVALID_ARGUMENT = -4,
+    V4L2DEC_FAILED = -5
+};
+
+typedef struct v4l2dec_frame {
+    size_t struct_size; /* set by caller, see note for C API */
+    const uint8_t *data; /* YUV420 planar, luma lines are stride bytes apart */
+    size_t size;
+    int width;
+    int height;
+    int stride;
+    int dmabuf; /* -1, frames aren't exported */
+    int index; /* capture buffer, used by v4l2dec_frame_release */
+    int field; /* enum v4l2_field of lines, 1 (V4L2_FIELD_NONE) for progressive frames */
+} v4l2dec_frame;
+
+/* frame ready to be passed to v4l2dec_receive */
+#define V4L2DEC_FRAME_INIT {sizeof(v4l2dec_frame), NULL, 0, 0, 0, 0, 0, 0, 0}
+
+/* version of the library, compared with V4L2DEC_VERSION of the header */
+V4L2DEC_API int v4l2dec_version(void);
+
+/* opens device (NULL for default), status (may be NULL) receives reason of failure */
+V4L2DEC_API v4l2dec *v4l2dec_open(const char *device, int width, int height, int codec, int *status);
+
+/* passes next chunk of input, data is only read during the call */
+V4L2DEC_API int v4l2dec_submit(v4l2dec *decoder, const void *data, size_t size, int last);
+
+/* gives next decoded frame (V4L2DEC_OK), or V4L2DEC_AGAIN / V4L2DEC_END without a frame, struct_size of frame must be set */
+V4L2DEC_API int v4l2dec_receive(v4l2dec *decoder, v4l2dec_frame *frame);
+
+/* returns capture buffer of a received frame to the device */
+V4L2DEC_API int v4l2dec_frame_release(v4l2dec *decoder, const v4l2dec_frame *frame);
+
+/* starts a new stream (for example after seeking), received frames become invalid */
+V4L2DEC_API int v4l2dec_reset(v4l2dec *decoder);
+
+/* closes device (NULL is ignored), received frames become invalid */
+V4L2DEC_API void v4l2dec_close(v4l2dec *decoder);
+
+/* readable name of a status */
+V4L2DEC_API const char *v4l2dec_status_string(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
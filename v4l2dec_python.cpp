@@ -0,0 +1,359 @@
+// Python module over the C API (v4l2dec.h), frames are given through the buffer protocol without copying
+// Written by ukicomputers
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+#include <cstring>
+#include "v4l2dec.h"
+
+/*
+    note for Python module:
+
+    import v4l2dec, numpy
+    decoder = v4l2dec.Decoder(1920, 1080, codec="h264", device="/dev/video10")
+    decoder.submit(data, last=True)
+    while (frame := decoder.receive()) is not None:
+        with frame:
+            luma = numpy.frombuffer(frame, numpy.uint8, frame.stride * frame.height).reshape(frame.height, frame.stride)
+
+    Frame exposes the mapped capture buffer (read only), so arrays and memoryviews of it don't copy
+    data, it is given back to the device by release (or end of with block, or when frame is deleted),
+    which fails with BufferError while any array or memoryview of the frame still exists
+
+    receive returns None when no frame is ready, finished tells whether it is because input ended
+    decoding calls release the GIL (calls of one decoder are serialized by its lock),
+    frames keep their decoder open
+*/
+
+struct DecoderObject {
+    PyObject_HEAD
+    v4l2dec *decoder;
+    PyThread_type_lock lock;
+    int status; // of the last receive
+    Py_ssize_t frames; // received and not released yet
+};
+
+struct FrameObject {
+    PyObject_HEAD
+    DecoderObject *owner;
+    v4l2dec_frame frame;
+    Py_ssize_t exports; // buffers given out and not released yet
+    bool released;
+};
+
+// heap types created from specs on module initialization
+static PyTypeObject *DecoderType = nullptr;
+static PyTypeObject *FrameType = nullptr;
+
+static PyObject *raiseStatus(const int status) {
+    PyErr_SetString(status == V4L2DEC_INVALID_ARGUMENT ? PyExc_ValueError : status == V4L2DEC_INSUFFICIENT_MEMORY ? PyExc_MemoryError : PyExc_OSError, v4l2dec_status_string(status));
+    return nullptr;
+}
+
+// runs call on decoder without GIL, while no other thread uses the decoder
+template<typename Call>
+static void unlocked(DecoderObject *self, const Call &call) {
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    call();
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+}
+
+// frame
+
+static bool releaseFrame(FrameObject *self) {
+    if(self->released) {
+        return true;
+    }
+
+    if(self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "frame is still used by a memoryview or array");
+        return false;
+    }
+
+    unlocked(self->owner, [self]() { v4l2dec_frame_release(self->owner->decoder, &self->frame); });
+    self->owner->frames--;
+    self->released = true;
+    return true;
+}
+
+static void Frame_dealloc(FrameObject *self) {
+    // buffers hold a reference to the frame, so there are no exports left here
+    releaseFrame(self);
+    Py_XDECREF(self->owner);
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(reinterpret_cast<PyObject *>(self));
+    Py_DECREF(type);
+}
+
+static int Frame_getbuffer(FrameObject *self, Py_buffer *view, int flags) {
+    if(self->released) {
+        PyErr_SetString(PyExc_BufferError, "frame is released");
+        return -1;
+    }
+
+    if(PyBuffer_FillInfo(view, reinterpret_cast<PyObject *>(self), const_cast<uint8_t *>(self->frame.data), self->frame.size, 1, flags) < 0) {
+        return -1;
+    }
+
+    self->exports++;
+    return 0;
+}
+
+static void Frame_releasebuffer(FrameObject *self, Py_buffer *) {
+    self->exports--;
+}
+
+static PyObject *Frame_release(FrameObject *self, PyObject *) {
+    if(!releaseFrame(self)) {
+        return nullptr;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *Frame_enter(FrameObject *self, PyObject *) {
+    Py_INCREF(self);
+    return reinterpret_cast<PyObject *>(self);
+}
+
+static PyObject *Frame_exit(FrameObject *self, PyObject *) {
+    return Frame_release(self, nullptr);
+}
+
+static PyObject *Frame_released(FrameObject *self, void *) {
+    return PyBool_FromLong(self->released);
+}
+
+static PyMethodDef frameMethods[] = {
+    {"release", reinterpret_cast<PyCFunction>(Frame_release), METH_NOARGS, "gives capture buffer back to the device"},
+    {"__enter__", reinterpret_cast<PyCFunction>(Frame_enter), METH_NOARGS, nullptr},
+    {"__exit__", reinterpret_cast<PyCFunction>(Frame_exit), METH_VARARGS, nullptr},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+static PyMemberDef frameMembers[] = {
+    {"width", T_INT, offsetof(FrameObject, frame.width), READONLY, nullptr},
+    {"height", T_INT, offsetof(FrameObject, frame.height), READONLY, nullptr},
+    {"stride", T_INT, offsetof(FrameObject, frame.stride), READONLY, "bytes per luma line"},
+    {"field", T_INT, offsetof(FrameObject, frame.field), READONLY, "enum v4l2_field of lines, 1 for progressive frames"},
+    {"size", T_PYSSIZET, offsetof(FrameObject, frame.size), READONLY, nullptr},
+    {nullptr, 0, 0, 0, nullptr}
+};
+
+static PyGetSetDef frameGetSet[] = {
+    {"released", reinterpret_cast<getter>(Frame_released), nullptr, nullptr, nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}
+};
+
+// Frame isn't created from Python, only by Decoder.receive
+static PyType_Slot frameSlots[] = {
+    {Py_tp_dealloc, reinterpret_cast<void *>(Frame_dealloc)},
+    {Py_bf_getbuffer, reinterpret_cast<void *>(Frame_getbuffer)},
+    {Py_bf_releasebuffer, reinterpret_cast<void *>(Frame_releasebuffer)},
+    {Py_tp_methods, frameMethods},
+    {Py_tp_members, frameMembers},
+    {Py_tp_getset, frameGetSet},
+    {0, nullptr}
+};
+
+static PyType_Spec frameSpec = {"v4l2dec.Frame", sizeof(FrameObject), 0, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, frameSlots};
+
+// decoder
+
+static int Decoder_init(DecoderObject *self, PyObject *args, PyObject *keywords) {
+    static const char *keywordList[] = {"width", "height", "codec", "device", nullptr};
+    static const char *codecs[] = {"h264", "hevc", "mjpeg", "vp8", "vp9", "fwht"};
+
+    int width, height;
+    const char *codecName = "h264";
+    const char *device = nullptr;
+    if(!PyArg_ParseTupleAndKeywords(args, keywords, "ii|sz", const_cast<char **>(keywordList), &width, &height, &codecName, &device)) {
+        return -1;
+    }
+
+    int codec = -1;
+    for(int i = 0; i < (int)(sizeof(codecs) / sizeof(codecs[0])); i++) {
+        if(strcmp(codecName, codecs[i]) == 0) {
+            codec = i;
+        }
+    }
+
+    if(codec < 0) {
+        PyErr_Format(PyExc_ValueError, "unknown codec %s", codecName);
+        return -1;
+    }
+
+    if(self->frames > 0) {
+        PyErr_SetString(PyExc_BufferError, "frames of decoder aren't released");
+        return -1;
+    }
+
+    if(!self->lock && !(self->lock = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    int status;
+    unlocked(self, [&]() {
+        v4l2dec_close(self->decoder);
+        self->decoder = v4l2dec_open(device, width, height, codec, &status);
+    });
+
+    if(!self->decoder) {
+        raiseStatus(status);
+        return -1;
+    }
+
+    self->status = V4L2DEC_AGAIN;
+    return 0;
+}
+
+static void Decoder_dealloc(DecoderObject *self) {
+    // frames keep a reference, so none of them is alive here
+    v4l2dec_close(self->decoder);
+    if(self->lock) {
+        PyThread_free_lock(self->lock);
+    }
+
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(reinterpret_cast<PyObject *>(self));
+    Py_DECREF(type);
+}
+
+static bool opened(DecoderObject *self) {
+    if(!self->decoder) {
+        PyErr_SetString(PyExc_ValueError, "decoder isn't opened");
+    }
+
+    return self->decoder;
+}
+
+static PyObject *Decoder_submit(DecoderObject *self, PyObject *args, PyObject *keywords) {
+    static const char *keywordList[] = {"data", "last", nullptr};
+
+    Py_buffer data;
+    int last = 0;
+    if(!opened(self) || !PyArg_ParseTupleAndKeywords(args, keywords, "y*|p", const_cast<char **>(keywordList), &data, &last)) {
+        return nullptr;
+    }
+
+    int status;
+    unlocked(self, [&]() { status = v4l2dec_submit(self->decoder, data.buf, data.len, last); });
+
+    PyBuffer_Release(&data);
+    if(status != V4L2DEC_OK) {
+        return raiseStatus(status);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *Decoder_receive(DecoderObject *self, PyObject *) {
+    if(!opened(self)) {
+        return nullptr;
+    }
+
+    v4l2dec_frame frame = V4L2DEC_FRAME_INIT;
+    int status;
+    unlocked(self, [&]() { status = v4l2dec_receive(self->decoder, &frame); });
+    self->status = status;
+
+    if(self->status == V4L2DEC_AGAIN || self->status == V4L2DEC_END) {
+        Py_RETURN_NONE;
+    }
+
+    if(self->status != V4L2DEC_OK) {
+        return raiseStatus(self->status);
+    }
+
+    FrameObject *result = PyObject_New(FrameObject, FrameType);
+    if(!result) {
+        unlocked(self, [&]() { v4l2dec_frame_release(self->decoder, &frame); });
+        return nullptr;
+    }
+
+    Py_INCREF(self);
+    self->frames++;
+    result->owner = self;
+    result->frame = frame;
+    result->exports = 0;
+    result->released = false;
+    return reinterpret_cast<PyObject *>(result);
+}
+
+static PyObject *Decoder_reset(DecoderObject *self, PyObject *) {
+    if(!opened(self)) {
+        return nullptr;
+    }
+
+    // capture buffers of old frames would be given back while holding new ones
+    if(self->frames > 0) {
+        PyErr_SetString(PyExc_BufferError, "frames of decoder aren't released");
+        return nullptr;
+    }
+
+    int status;
+    unlocked(self, [&]() { status = v4l2dec_reset(self->decoder); });
+
+    if(status != V4L2DEC_OK) {
+        return raiseStatus(status);
+    }
+
+    self->status = V4L2DEC_AGAIN;
+    Py_RETURN_NONE;
+}
+
+static PyObject *Decoder_finished(DecoderObject *self, void *) {
+    return PyBool_FromLong(self->status == V4L2DEC_END);
+}
+
+static PyMethodDef decoderMethods[] = {
+    {"submit", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(Decoder_submit)), METH_VARARGS | METH_KEYWORDS, "passes next chunk of input (any bytes-like object)"},
+    {"receive", reinterpret_cast<PyCFunction>(Decoder_receive), METH_NOARGS, "returns next decoded Frame, or None if no frame is ready"},
+    {"reset", reinterpret_cast<PyCFunction>(Decoder_reset), METH_NOARGS, "starts a new stream, frames must be released before"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+static PyGetSetDef decoderGetSet[] = {
+    {"finished", reinterpret_cast<getter>(Decoder_finished), nullptr, "all frames of input are received", nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}
+};
+
+static PyType_Slot decoderSlots[] = {
+    {Py_tp_new, reinterpret_cast<void *>(PyType_GenericNew)},
+    {Py_tp_init, reinterpret_cast<void *>(Decoder_init)},
+    {Py_tp_dealloc, reinterpret_cast<void *>(Decoder_dealloc)},
+    {Py_tp_methods, decoderMethods},
+    {Py_tp_getset, decoderGetSet},
+    {0, nullptr}
+};
+
+static PyType_Spec decoderSpec = {"v4l2dec.Decoder", sizeof(DecoderObject), 0, Py_TPFLAGS_DEFAULT, decoderSlots};
+
+static PyModuleDef moduleDefinition = {PyModuleDef_HEAD_INIT, "v4l2dec", "V4L2 hardware decoder with zero-copy frames", -1, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+PyMODINIT_FUNC PyInit_v4l2dec(void) {
+    // types live as long as the process (module isn't reinitialized, m_size is -1)
+    if(!DecoderType && !(DecoderType = reinterpret_cast<PyTypeObject *>(PyType_FromSpec(&decoderSpec)))) {
+        return nullptr;
+    }
+
+    if(!FrameType && !(FrameType = reinterpret_cast<PyTypeObject *>(PyType_FromSpec(&frameSpec)))) {
+        return nullptr;
+    }
+
+    PyObject *module = PyModule_Create(&moduleDefinition);
+    if(!module) {
+        return nullptr;
+    }
+
+    if(PyModule_AddObjectRef(module, "Decoder", reinterpret_cast<PyObject *>(DecoderType)) < 0 || PyModule_AddObjectRef(module, "Frame", reinterpret_cast<PyObject *>(FrameType)) < 0) {
+        Py_DECREF(module);
+        return nullptr;
+    }
+
+    return module;
+}
@@ -0,0 +1,1095 @@
+// Differential correctness harness of optimized paths
+// runs the reference (scalar, synchronous) path and every optimized variant on the same input,
+// and checks that NAL streams and decoded frames are byte identical
+
+#include "harness.hpp"
+#include "source.hpp"
+#include "lazy.hpp"
+#include "reverse.hpp"
+#include "compositor.hpp"
+#include "deinterlace.hpp"
+#include "transcode.hpp"
+#include "recorder.hpp"
+#include "pipeline.hpp"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <thread>
+using namespace std;
+
+// default settings
+const string defaultInputPath = "video.h264";
+const int verifySeed = 1; // seed of random chunk sizes and data
+const int kernelWidths[] = {1, 15, 16, 31, 32, 33, 64, 100, 1920}; // row widths of compared kernels
+const int decodeChunkSizes[] = {1500, 65536, 1024 * 1024}; // chunk sizes of decode variants
+const int lazySamples = 8; // frames requested through LazyDecoder
+const pair<int, int> roundTripSize = {320, 240}; // synthetic frames encoded by vicodec
+const int roundTripFrames = 8;
+const double roundTripPSNR = 30; // minimal luma PSNR (dB) after FWHT encoding (lossy, so not compared byte by byte)
+const int pipelineValues = 1000; // payloads given by source of checked pipelines
+const int pipelineCopies = 3; // payloads emitted for each input into a queue of one (backpressure)
+const int pipelineFailAt = 100; // value on which a stage fails
+
+// row kernels are selected at build time, so SIMD ones are compared only when the build enables them
+#if defined(__AVX2__)
+const string kernelVariant = "AVX2";
+#elif defined(__ARM_NEON)
+const string kernelVariant = "NEON";
+#else
+const string kernelVariant = "";
+#endif
+
+/*
+    note for verification:
+
+    every check runs the reference and the optimized variant on the same input and compares results
+    byte by byte, results are printed as PASS, FAIL or SKIP lines, exit status is 1 if anything failed
+
+    without a device (CPU paths):
+    - NALSplitter (memchr scanning) in several chunk sizes and Annex-B framer against a byte by byte split
+    - NALSplitter::find against a byte by byte search on random data
+    - FileSource (readahead ring, fixed and autotuned chunks) against plain ifstream reading
+    - StreamSource (splice into ring) from a pipe written in random sizes, runs must end on NAL boundaries
+    - StreamIndex of chunked input against the whole input
+    - SegmentRecorder and PrerollBuffer of a stream with parameter sets only before the first IDR,
+      every segment (and the buffer) must be its GOP with the parameter sets in front
+    - AVX2/NEON row kernels of Compositor and Deinterlacer against their scalar versions (skipped
+      if the build enables neither, on x86 AVX2 needs -march=native or -mavx2)
+    - Deinterlacer on sequential field layouts against the same fields interleaved, static motion
+      adaptive frames against the woven input
+    - Pipeline on one and more workers: both stages fed by one source get every payload in order,
+      a stage emitting more than fits into its queue loses nothing, finish callbacks run once after
+      the last input, and a failing stage stops the whole pipeline (source never ends by itself)
+
+    with a device (vicodec works too, with FWHT input), decoded frames are compared by hash:
+    - decoding in every chunk size of decodeChunkSizes, and from FileSource, against the first of them
+    - held frames (no copy) against copied output
+    - second pass after resetStream against the first one
+    - frames requested through LazyDecoder against sequential decoding
+    - frames returned by ReversePlayer after repeated seeks (also into an already returned GOP)
+    - SegmentRecorder and PrerollBuffer attached to the same decoder both get its input, and decoding
+      of the pre-roll gives all of its frames (the last ones by draining)
+
+    with vicodec loaded as multi-planar (modprobe vicodec multiplanar=1), its devices are found
+    automatically, and synthetic frames go through Encoder, Decoder and Transcoder (FWHT to FWHT),
+    frame counts must match and decoded frames must be within roundTripPSNR of the source
+
+    build and run:
+        g++ -std=c++17 -O2 -march=native -pthread verify.cpp -o verify
+        ./verify video.h264                 # CPU paths only
+        ./verify video.h264 /dev/video10    # CPU paths and decoding
+        ./verify clip.fwht /dev/video1 640x480   # size must be given for inputs without SPS
+*/
+
+int failures = 0;
+
+void report(const string &check, const bool passed, const string &details = "") {
+    cout << (passed ? "PASS " : "FAIL ") << check << (details.empty() ? "" : ": " + details) << "\n";
+    failures += !passed;
+}
+
+void skip(const string &check, const string &reason) {
+    cout << "SKIP " << check << ": " << reason << "\n";
+}
+
+// FNV-1a, enough to tell frames apart
+uint64_t hashBytes(const uint8_t *data, const size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+void checkSplitter(const vector<char> &input) {
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(input.data());
+    const vector<Unit> reference = referenceSplit(data, input.size());
+
+    for(const size_t chunkSize : {(size_t)1, (size_t)7, (size_t)4096, (size_t)65536, max<size_t>(input.size(), 1)}) {
+        const vector<Unit> units = splitChunked(data, fixedChunks(input.size(), chunkSize));
+        report("NALSplitter chunk " + to_string(chunkSize), units == reference, to_string(units.size()) + " NALs, reference " + to_string(reference.size()));
+    }
+
+    report("Annex-B framer", frameChunked(Codec::H264, data, fixedChunks(input.size(), 4096)) == reference);
+}
+
+void checkFind() {
+    mt19937 random(verifySeed);
+    int mismatches = 0;
+
+    for(int i = 0; i < 10000; i++) {
+        // mostly zeros and ones, so start codes are frequent and fall on every alignment
+        vector<uint8_t> data(random() % 256);
+        for(auto &byte : data) {
+            byte = random() % 4 == 0 ? random() : random() % 2;
+        }
+
+        const size_t from = data.empty() ? 0 : random() % data.size();
+        mismatches += NALSplitter::find(data.data(), data.size(), from) != referenceFind(data.data(), data.size(), from);
+    }
+
+    report("NALSplitter::find", mismatches == 0, to_string(mismatches) + " mismatches of 10000");
+}
+
+void checkFileSource(const string &path, const vector<char> &input) {
+    for(const int chunkSize : {0, 4096, 65536}) {
+        FileSource source;
+        if(!source.open(path, chunkSize)) {
+            report("FileSource chunk " + to_string(chunkSize), false, "failed to open");
+            continue;
+        }
+
+        vector<char> data;
+        const char *chunk;
+        int size;
+        while(source.read(chunk, size)) {
+            data.insert(data.end(), chunk, chunk + size);
+            source.report(0.001);
+
+            if(source.last()) {
+                break;
+            }
+        }
+
+        report(chunkSize == 0 ? "FileSource autotuned" : "FileSource chunk " + to_string(chunkSize), !source.failed() && data == input);
+    }
+}
+
+void checkStreamSource(const vector<char> &input) {
+    int pipeFds[2];
+    if(pipe(pipeFds) < 0) {
+        skip("StreamSource", "no pipe");
+        return;
+    }
+
+    // writer gives input in random sizes, so runs are cut in any place
+    thread writer([&]() {
+        mt19937 random(verifySeed);
+        for(size_t position = 0; position < input.size();) {
+            const size_t size = min<size_t>(input.size() - position, random() % 8192 + 1);
+            const ssize_t written = write(pipeFds[1], input.data() + position, size);
+            if(written <= 0) {
+                break;
+            }
+
+            position += written;
+        }
+
+        close(pipeFds[1]);
+    });
+
+    StreamSource stream;
+    vector<char> data;
+    bool boundaries = true;
+    bool opened = stream.open(pipeFds[0]);
+
+    while(opened && !stream.finished() && !stream.failed()) {
+        stream.wait(eventTimeout);
+        stream.receive();
+
+        const char *run;
+        int size;
+        while(stream.next(run, size)) {
+            data.insert(data.end(), run, run + size);
+
+            // every run but the last ends right before a start code
+            if(!stream.last()) {
+                const pair<int, int> next = referenceFind(reinterpret_cast<const uint8_t *>(input.data()), min(input.size(), data.size() + 4), data.size());
+                boundaries = boundaries && next.first == (int)data.size();
+            }
+
+            stream.release();
+        }
+    }
+
+    writer.join();
+    close(pipeFds[0]);
+
+    report("StreamSource", opened && !stream.failed() && data == input && boundaries, boundaries ? "" : "run not ending on NAL boundary");
+}
+
+void checkIndex(const vector<char> &input, const Codec codec) {
+    StreamIndex whole(codec);
+    whole.ingest(input.data(), input.size(), true);
+
+    for(const size_t chunkSize : {(size_t)1000, (size_t)65536}) {
+        StreamIndex chunked(codec);
+        for(size_t position = 0; position < input.size(); position += chunkSize) {
+            const size_t size = min(chunkSize, input.size() - position);
+            chunked.ingest(input.data() + position, size, position + size == input.size());
+        }
+
+        bool same = chunked.getFrames() == whole.getFrames() && chunked.getKeyframes() == whole.getKeyframes();
+        for(long long i = 0; same && i < whole.getFrames(); i++) {
+            same = chunked.getUnit(i).data == whole.getUnit(i).data && chunked.getUnit(i).offset == whole.getUnit(i).offset;
+        }
+
+        report("StreamIndex chunk " + to_string(chunkSize), same, to_string(chunked.getFrames()) + " frames, whole " + to_string(whole.getFrames()));
+    }
+}
+
+// NALs of input with parameter sets only before the first slice (like rpicam-vid without --inline)
+vector<Unit> parameterSetsOnce(const vector<char> &input, const Codec codec) {
+    vector<Unit> units;
+    bool sliceSeen = false;
+
+    for(Unit &unit : referenceSplit(reinterpret_cast<const uint8_t *>(input.data()), input.size())) {
+        const NALHeader header = NALHeader::parse(codec, unit.data.data() + unit.startCode, unit.data.size() - unit.startCode);
+        if(sliceSeen && (header.vps || header.sps || header.pps)) {
+            continue;
+        }
+
+        sliceSeen = sliceSeen || header.slice;
+        units.push_back(move(unit));
+    }
+
+    return units;
+}
+
+// access units of NALs, grouped into GOPs (from the first keyframe)
+vector<vector<uint8_t>> referenceGOPs(const vector<Unit> &nals, const Codec codec) {
+    vector<vector<uint8_t>> gops;
+    AccessUnitAssembler assembler(codec);
+    AccessUnit unit;
+
+    const auto add = [&]() {
+        if(unit.keyframe) {
+            gops.emplace_back();
+        }
+
+        if(!gops.empty()) {
+            gops.back().insert(gops.back().end(), unit.data.begin(), unit.data.end());
+        }
+    };
+
+    for(const Unit &nal : nals) {
+        if(assembler.push(nal.data.data(), nal.data.size(), nal.offset, unit)) {
+            add();
+        }
+    }
+
+    if(assembler.flush(unit)) {
+        add();
+    }
+
+    return gops;
+}
+
+// removes files of a recording (segments numbered from 1) and its directory
+void removeRecording(const string &directory, const string &prefix, const Codec codec) {
+    for(int number = 1; ; number++) {
+        char name[32];
+        snprintf(name, sizeof(name), "-%06d.", number);
+        const string path = directory + "/" + prefix + name;
+
+        remove((path + "idx").c_str());
+        if(remove((path + (codec == Codec::HEVC ? "h265" : "h264")).c_str()) != 0) {
+            break;
+        }
+    }
+
+    rmdir(directory.c_str());
+}
+
+void checkRecorder(const vector<char> &input, const Codec codec) {
+    char directory[] = "/tmp/verify-XXXXXX";
+    if(!mkdtemp(directory)) {
+        skip("SegmentRecorder", "no temporary directory");
+        return;
+    }
+
+    const vector<Unit> nals = parameterSetsOnce(input, codec);
+    const vector<vector<uint8_t>> gops = referenceGOPs(nals, codec);
+
+    // parameter sets sent before the first slice
+    vector<uint8_t> parameterSets;
+    for(const Unit &nal : nals) {
+        const NALHeader header = NALHeader::parse(codec, nal.data.data() + nal.startCode, nal.data.size() - nal.startCode);
+        if(header.slice) {
+            break;
+        }
+
+        if(header.vps || header.sps || header.pps) {
+            parameterSets.insert(parameterSets.end(), nal.data.begin(), nal.data.end());
+        }
+    }
+
+    // a segment for every GOP
+    SegmentRecorder recorder;
+    recorder.open(directory, "segment", 1, -1);
+    recorder.setCodec(codec);
+    for(const Unit &nal : nals) {
+        // input is faster than any disk, so writer catches up first (or access units would be dropped)
+        while(recorder.getQueuedBytes() > 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+
+        recorder.push(nal.data.data(), nal.data.size(), nal.offset);
+    }
+
+    recorder.close();
+
+    bool same = !recorder.failed() && recorder.getDroppedFrames() == 0 && !gops.empty();
+    string details = to_string(gops.size()) + " GOPs";
+    for(size_t i = 0; i <= gops.size(); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/segment-%06zu.", i + 1);
+        const string path = string(directory) + name;
+
+        // one more segment than GOPs must not exist
+        const vector<uint8_t> segment = readFile<uint8_t>(path + (codec == Codec::HEVC ? "h265" : "h264"));
+        if(i < gops.size()) {
+            vector<uint8_t> expected = gops[i];
+            if(i > 0) {
+                expected.insert(expected.begin(), parameterSets.begin(), parameterSets.end());
+            }
+
+            if(same && segment != expected) {
+                same = false;
+                details = "segment " + to_string(i + 1) + " differs";
+            }
+        } else if(same && !segment.empty()) {
+            same = false;
+            details = "more segments than GOPs";
+        }
+    }
+
+    report("SegmentRecorder segments", same && !parameterSets.empty(), details);
+
+    // buffer keeps only the last GOP (without its last access unit, which isn't complete), parameter sets go in front
+    PrerollBuffer preroll(1, SIZE_MAX);
+    preroll.setCodec(codec);
+    for(const Unit &nal : nals) {
+        preroll.push(nal.data.data(), nal.data.size(), nal.offset);
+    }
+
+    const string dumpPath = string(directory) + "/preroll";
+    const bool dumped = preroll.dump(dumpPath);
+    const vector<uint8_t> dump = readFile<uint8_t>(dumpPath);
+    remove(dumpPath.c_str());
+
+    same = dumped && gops.size() > 1 && dump.size() > parameterSets.size() && dump.size() - parameterSets.size() <= gops.back().size();
+    same = same && equal(parameterSets.begin(), parameterSets.end(), dump.begin()) && equal(dump.begin() + parameterSets.size(), dump.end(), gops.back().begin());
+    report("PrerollBuffer parameter sets", same, to_string(preroll.getFrames()) + " frames");
+
+    removeRecording(directory, "segment", codec);
+}
+
+void checkKernels() {
+    if(kernelVariant.empty()) {
+        skip("row kernels", "only scalar kernels are compiled (build with -march=native)");
+        return;
+    }
+
+    mt19937 random(verifySeed);
+    bool averageSame = true;
+    bool halveSame = true;
+
+    for(const int width : kernelWidths) {
+        for(int run = 0; run < 16; run++) {
+            vector<uint8_t> first(width * 2), second(width * 2);
+            for(size_t i = 0; i < first.size(); i++) {
+                first[i] = random();
+                second[i] = run == 0 ? 0xFF : random(); // first run checks rounding at the top of range
+            }
+
+            vector<uint8_t> reference(width), optimized(width);
+            averageRowsScalar(first.data(), second.data(), reference.data(), width);
+            averageRows(first.data(), second.data(), optimized.data(), width);
+            averageSame = averageSame && reference == optimized;
+
+            halveRowScalar(first.data(), reference.data(), width);
+            halveRow(first.data(), optimized.data(), width);
+            halveSame = halveSame && reference == optimized;
+        }
+    }
+
+    report("averageRows", averageSame, kernelVariant);
+    report("halveRow", halveSame, kernelVariant);
+}
+
+void checkPipeline() {
+    for(const int threads : {1, 4}) {
+        const string workers = to_string(threads) + (threads == 1 ? " worker" : " workers");
+
+        Pipeline pipeline;
+        int next = 0;
+        const auto values = pipeline.addSource<int>("count", [&](Emitter<int> &output) {
+            for(int i = 0; i < 3 && next < pipelineValues; i++) {
+                output.emit(make_shared<int>(next++));
+            }
+
+            return next < pipelineValues ? Pipeline::Result::MORE : Pipeline::Result::END;
+        });
+
+        // both stages are fed by the same source (fan-out), copies don't fit into a queue of one
+        int stageFinishes = 0;
+        const auto copies = pipeline.addStage<int>("copy", values, [](const Payload<int> &value, Emitter<int> &output) {
+            for(int i = 0; i < pipelineCopies; i++) {
+                output.emit(value);
+            }
+
+            return true;
+        }, [&](Emitter<int> &output) {
+            stageFinishes++;
+            output.emit(make_shared<int>(-1));
+            return true;
+        }, 1);
+
+        const auto doubled = pipeline.addStage<int>("double", values, [](const Payload<int> &value, Emitter<int> &output) {
+            output.emit(make_shared<int>(*value * 2));
+            return true;
+        });
+
+        vector<int> copied, doubledValues;
+        int sinkFinishes = 0;
+        size_t copiedAtFinish = 0;
+        pipeline.addSink("copied", copies, [&](const Payload<int> &value) {
+            copied.push_back(*value);
+            return true;
+        }, [&]() {
+            sinkFinishes++;
+            copiedAtFinish = copied.size();
+            return true;
+        }, 1);
+
+        pipeline.addSink("doubled", doubled, [&](const Payload<int> &value) {
+            doubledValues.push_back(*value);
+            return true;
+        });
+
+        pipeline.start(threads);
+        const bool completed = pipeline.wait() && pipeline.finished() && !pipeline.failed();
+
+        vector<int> expectedCopies, expectedDoubled;
+        for(int i = 0; i < pipelineValues; i++) {
+            expectedCopies.insert(expectedCopies.end(), pipelineCopies, i);
+            expectedDoubled.push_back(i * 2);
+        }
+
+        expectedCopies.push_back(-1); // emitted by finish of stage
+
+        long long stalls = 0;
+        size_t maxQueued = 0;
+        for(const Pipeline::StageMetrics &stage : pipeline.getMetrics()) {
+            if(stage.name == "copy") {
+                stalls = stage.stalls;
+            } else if(stage.name == "copied") {
+                maxQueued = stage.maxQueued;
+            }
+        }
+
+        report("Pipeline fan-out, " + workers, completed && doubledValues == expectedDoubled && copied == expectedCopies);
+        report("Pipeline backpressure, " + workers, completed && copied == expectedCopies && stalls > 0 && maxQueued <= 1,
+            to_string(stalls) + " stalls, " + to_string(maxQueued) + " queued at most");
+        report("Pipeline finish callbacks, " + workers, stageFinishes == 1 && sinkFinishes == 1 && copiedAtFinish == expectedCopies.size());
+
+        // source never ends, so only failure of the stage stops the pipeline
+        Pipeline failing;
+        int counter = 0;
+        const auto endless = failing.addSource<int>("endless", [&](Emitter<int> &output) {
+            output.emit(make_shared<int>(counter++));
+            return Pipeline::Result::MORE;
+        });
+
+        const auto checked = failing.addStage<int>("check", endless, [](const Payload<int> &value, Emitter<int> &output) {
+            if(*value == pipelineFailAt) {
+                return false;
+            }
+
+            output.emit(value);
+            return true;
+        });
+
+        int received = 0;
+        bool finishCalled = false;
+        failing.addSink("received", checked, [&](const Payload<int> &) {
+            received++;
+            return true;
+        }, [&]() {
+            finishCalled = true;
+            return true;
+        });
+
+        failing.start(threads);
+        const bool succeeded = failing.wait();
+        report("Pipeline failure, " + workers, !succeeded && failing.failed() && !failing.finished() && !finishCalled && received <= pipelineFailAt,
+            to_string(received) + " received");
+    }
+}
+
+// interleaves fields of a YU12 frame stored one after another (like V4L2_FIELD_SEQ_TB / SEQ_BT)
+vector<uint8_t> sequentialFields(const vector<uint8_t> &frame, const pair<int, int> &imageSize, const bool bottomFirst) {
+    vector<uint8_t> output(frame.size());
+    size_t offset = 0;
+    for(int p = 0; p < 3; p++) {
+        const int width = imageSize.first >> (p == 0 ? 0 : 1);
+        const int height = imageSize.second >> (p == 0 ? 0 : 1);
+
+        int line = 0;
+        for(int parity : {bottomFirst ? 1 : 0, bottomFirst ? 0 : 1}) {
+            for(int y = parity; y < height; y += 2, line++) {
+                memcpy(output.data() + offset + (size_t)line * width, frame.data() + offset + (size_t)y * width, width);
+            }
+        }
+
+        offset += (size_t)width * height;
+    }
+
+    return output;
+}
+
+void checkDeinterlace() {
+    mt19937 random(verifySeed);
+    bool interpolateSame = true;
+    bool blendSame = true;
+    bool motionSame = true;
+
+    for(const int width : kernelWidths) {
+        for(int run = 0; run < 16; run++) {
+            vector<uint8_t> rows(width * 4);
+            for(size_t i = 0; i < rows.size(); i++) {
+                rows[i] = run == 0 ? 0xFF : random(); // first run checks rounding at the top of range
+            }
+
+            const uint8_t *above = rows.data(), *row = above + width, *below = row + width, *previous = below + width;
+            const int threshold = 1 + run * 16;
+
+            vector<uint8_t> reference(width), optimized(width);
+            interpolateRowScalar(above, below, reference.data(), width);
+            interpolateRow(above, below, optimized.data(), width);
+            interpolateSame = interpolateSame && reference == optimized;
+
+            blendRowScalar(above, row, below, reference.data(), width);
+            blendRow(above, row, below, optimized.data(), width);
+            blendSame = blendSame && reference == optimized;
+
+            motionRowScalar(above, row, below, previous, reference.data(), width, threshold);
+            motionRow(above, row, below, previous, optimized.data(), width, threshold);
+            motionSame = motionSame && reference == optimized;
+        }
+    }
+
+    if(kernelVariant.empty()) {
+        skip("deinterlacing row kernels", "only scalar kernels are compiled (build with -march=native)");
+    } else {
+        report("interpolateRow", interpolateSame, kernelVariant);
+        report("blendRow", blendSame, kernelVariant);
+        report("motionRow", motionSame, kernelVariant);
+    }
+
+    // odd field heights check that the longer field is the top one
+    for(const auto &imageSize : {pair<int, int>(64, 36), pair<int, int>(34, 22)}) {
+        const string size = to_string(imageSize.first) + "x" + to_string(imageSize.second);
+        vector<uint8_t> first(Deinterlacer::frameBytes(imageSize)), second(first.size());
+        for(size_t i = 0; i < first.size(); i++) {
+            first[i] = random();
+            second[i] = random();
+        }
+
+        bool sequentialSame = true;
+        for(const Deinterlacer::Method method : {Deinterlacer::Method::BOB, Deinterlacer::Method::BLEND, Deinterlacer::Method::MOTION_ADAPTIVE}) {
+            for(const bool bottomFirst : {false, true}) {
+                Deinterlacer interleaved(method), sequential(method);
+                const uint32_t interleavedField = bottomFirst ? V4L2_FIELD_INTERLACED_BT : V4L2_FIELD_INTERLACED_TB;
+                const uint32_t sequentialField = bottomFirst ? V4L2_FIELD_SEQ_BT : V4L2_FIELD_SEQ_TB;
+
+                // second frame compares motion adaptive paths too
+                for(const vector<uint8_t> *frame : {&first, &second}) {
+                    const vector<uint8_t> stored = sequentialFields(*frame, imageSize, bottomFirst);
+                    vector<uint8_t> reference(frame->size()), optimized(frame->size());
+                    interleaved.process(frame->data(), imageSize, interleavedField, reference.data());
+                    sequential.process(stored.data(), imageSize, sequentialField, optimized.data());
+                    sequentialSame = sequentialSame && reference == optimized;
+                }
+            }
+        }
+
+        report("Deinterlacer sequential fields " + size, sequentialSame);
+
+        Deinterlacer motion;
+        vector<uint8_t> output(first.size());
+        motion.process(first.data(), imageSize, V4L2_FIELD_INTERLACED, output.data());
+        motion.process(first.data(), imageSize, V4L2_FIELD_INTERLACED, output.data());
+        report("Deinterlacer static motion adaptive " + size, output == first);
+
+        motion.process(second.data(), imageSize, V4L2_FIELD_NONE, output.data());
+        report("Deinterlacer progressive " + size, output == second);
+    }
+}
+
+// decoding variants below collect hashes of decoded frames in output order
+
+struct DecodeSession {
+    Decoder decoder;
+    bool initialized = false;
+
+    bool open(const string &device, const pair<int, int> &size, const Codec codec) {
+        initialized = decoder.initializeDecoder(size.first, size.second, -1, device, -1, codec) == Decoder::InitStatus::OK;
+        return initialized;
+    }
+};
+
+void addFrames(const Decoder::DecodedFrame &decodedFrame, vector<uint64_t> &hashes) {
+    if(decodedFrame.frames == 0) {
+        return;
+    }
+
+    const size_t frameSize = decodedFrame.output.size() / decodedFrame.frames;
+    for(int i = 0; i < decodedFrame.frames; i++) {
+        hashes.push_back(hashBytes(decodedFrame.output.data() + i * frameSize, frameSize));
+    }
+}
+
+// takes held frames, hashing them in place and giving buffers back
+bool addHeldFrames(Decoder &decoder, vector<uint64_t> &hashes) {
+    Decoder::HeldFrame frame;
+    while(decoder.takeFrame(frame)) {
+        hashes.push_back(hashBytes(frame.data, frame.size));
+        if(!decoder.releaseFrame(frame.index)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool decodeChunked(Decoder &decoder, const vector<char> &input, const size_t chunkSize, const bool hold, vector<uint64_t> &hashes) {
+    for(size_t position = 0; position < input.size(); position += chunkSize) {
+        const size_t size = min(chunkSize, input.size() - position);
+        const Decoder::DecodedFrame decodedFrame = decoder.decode(input.data() + position, size, position + size == input.size());
+        if(decodedFrame.status != Decoder::Status::OK) {
+            return false;
+        }
+
+        addFrames(decodedFrame, hashes);
+        if(hold && !addHeldFrames(decoder, hashes)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool decodeFileSource(Decoder &decoder, const string &path, vector<uint64_t> &hashes) {
+    FileSource source;
+    if(!source.open(path)) {
+        return false;
+    }
+
+    const char *chunk;
+    int size;
+    while(source.read(chunk, size)) {
+        const auto start = chrono::steady_clock::now();
+        const Decoder::DecodedFrame decodedFrame = decoder.decode(chunk, size, source.last());
+        if(decodedFrame.status != Decoder::Status::OK) {
+            return false;
+        }
+
+        source.report(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        addFrames(decodedFrame, hashes);
+
+        if(source.last()) {
+            break;
+        }
+    }
+
+    return !source.failed();
+}
+
+void checkDecoding(const string &path, const vector<char> &input, const string &device, const Codec codec, pair<int, int> size) {
+    if(size.first <= 0 && (codec == Codec::H264 || codec == Codec::HEVC)) {
+        size = Decoder::probeImageSize(input, codec);
+    }
+
+    if(size.first <= 0) {
+        skip("decoding", "image size of input isn't known");
+        return;
+    }
+
+    DecodeSession session;
+    if(!session.open(device, size, codec)) {
+        skip("decoding", "failed to initialize " + device);
+        return;
+    }
+
+    // reference: smallest chunks, copied output
+    vector<uint64_t> reference;
+    if(!decodeChunked(session.decoder, input, decodeChunkSizes[0], false, reference) || reference.empty()) {
+        report("decoding reference", false, "no frames decoded");
+        return;
+    }
+
+    cout << "reference: " << reference.size() << " frames\n";
+
+    const auto compare = [&](const string &check, const bool decoded, const vector<uint64_t> &hashes) {
+        if(!decoded) {
+            report(check, false, "decoding failed");
+            return;
+        }
+
+        size_t first = 0;
+        while(first < min(hashes.size(), reference.size()) && hashes[first] == reference[first]) {
+            first++;
+        }
+
+        report(check, hashes == reference, hashes == reference ? "" : to_string(hashes.size()) + " frames, first difference at " + to_string(first));
+    };
+
+    for(const int chunkSize : decodeChunkSizes) {
+        if(chunkSize == decodeChunkSizes[0]) {
+            continue;
+        }
+
+        DecodeSession chunked;
+        vector<uint64_t> hashes;
+        compare("decoding chunk " + to_string(chunkSize), chunked.open(device, size, codec) && decodeChunked(chunked.decoder, input, chunkSize, false, hashes), hashes);
+    }
+
+    {
+        DecodeSession sourced;
+        vector<uint64_t> hashes;
+        compare("decoding from FileSource", sourced.open(device, size, codec) && decodeFileSource(sourced.decoder, path, hashes), hashes);
+    }
+
+    {
+        DecodeSession held;
+        vector<uint64_t> hashes;
+        bool decoded = held.open(device, size, codec);
+        if(decoded) {
+            held.decoder.setHoldFrames(true);
+            decoded = decodeChunked(held.decoder, input, decodeChunkSizes[1], true, hashes);
+        }
+
+        compare("held frames", decoded, hashes);
+    }
+
+    {
+        vector<uint64_t> hashes;
+        compare("second pass after resetStream", session.decoder.resetStream() && decodeChunked(session.decoder, input, decodeChunkSizes[0], false, hashes), hashes);
+    }
+
+    if(codec != Codec::H264 && codec != Codec::HEVC) {
+        skip("LazyDecoder", "input isn't Annex-B");
+        return;
+    }
+
+    DecodeSession lazySession;
+    if(!lazySession.open(device, size, codec)) {
+        report("LazyDecoder", false, "failed to initialize");
+        return;
+    }
+
+    LazyDecoder lazy(lazySession.decoder);
+    lazy.ingest(input, true);
+
+    // frames are numbered from the first IDR, which is frame 0 of the reference only if input starts with it
+    const long long frames = min<long long>(lazy.getIndex().getFrames(), reference.size());
+    if(frames == 0 || lazy.getIndex().getKeyframes().empty() || lazy.getIndex().getKeyframes().front() != 0) {
+        skip("LazyDecoder", "input doesn't start with a keyframe");
+        return;
+    }
+
+    mt19937 random(verifySeed);
+    bool same = true;
+    string details;
+    for(int i = 0; i < lazySamples && same; i++) {
+        // last sample is the last frame, the rest are random (out of order, like scrubbing)
+        const long long frame = i == lazySamples - 1 ? frames - 1 : random() % frames;
+        const Decoder::DecodedFrame decodedFrame = lazy.request(frame);
+
+        same = decodedFrame.status == Decoder::Status::OK && hashBytes(decodedFrame.output.data(), decodedFrame.output.size()) == reference[frame];
+        details = same ? "" : "frame " + to_string(frame);
+    }
+
+    report("LazyDecoder", same, details);
+
+    DecodeSession reverseSession;
+    if(!reverseSession.open(device, size, codec)) {
+        report("ReversePlayer", false, "failed to initialize");
+        return;
+    }
+
+    StreamIndex index(codec);
+    index.ingest(input.data(), input.size(), true);
+    ReversePlayer player(index, reverseSession.decoder);
+
+    // seeks back into GOP which was already taken (the only one of single GOP input), and to the first frame
+    same = true;
+    details = "";
+    for(const long long start : {frames - 1, frames - 1, frames / 2, 0LL}) {
+        player.seek(start);
+        for(long long frame = start; frame >= max(start - 2, 0LL) && same; frame--) {
+            const Decoder::DecodedFrame decodedFrame = player.next();
+            same = decodedFrame.status == Decoder::Status::OK && decodedFrame.frames == 1 && hashBytes(decodedFrame.output.data(), decodedFrame.output.size()) == reference[frame];
+            details = same ? "" : "frame " + to_string(frame) + " after seek to " + to_string(start);
+        }
+    }
+
+    report("ReversePlayer seeks", same, details);
+
+    // recorder and pre-roll buffer observe the same decoder (pre- and post-event recording)
+    char directory[] = "/tmp/verify-XXXXXX";
+    DecodeSession observed, prerollSession;
+    if(!observed.open(device, size, codec) || !prerollSession.open(device, size, codec)) {
+        report("NAL observers", false, "failed to initialize");
+        return;
+    }
+
+    if(!mkdtemp(directory)) {
+        skip("NAL observers", "no temporary directory");
+        return;
+    }
+
+    SegmentRecorder recorder;
+    recorder.open(directory, "observed", 1, -1);
+    recorder.attach(observed.decoder);
+
+    PrerollBuffer preroll(lazySamples, SIZE_MAX);
+    preroll.attach(observed.decoder);
+
+    vector<uint64_t> hashes;
+    const bool decoded = decodeChunked(observed.decoder, input, decodeChunkSizes[1], false, hashes);
+    recorder.close();
+    removeRecording(directory, "observed", codec);
+
+    // every access unit reaches the recorder (the last one when it is closed), the buffer has at least its GOP
+    long long units = 0;
+    AccessUnitAssembler assembler(codec);
+    AccessUnit unit;
+    for(const Unit &nal : referenceSplit(reinterpret_cast<const uint8_t *>(input.data()), input.size())) {
+        units += assembler.push(nal.data.data(), nal.data.size(), nal.offset, unit);
+    }
+
+    units += assembler.flush(unit);
+
+    report("NAL observers", decoded && recorder.getRecordedFrames() + recorder.getDroppedFrames() == units && preroll.getFrames() >= lazySamples,
+        to_string(recorder.getRecordedFrames() + recorder.getDroppedFrames()) + " recorded and dropped, " + to_string(preroll.getFrames()) + " buffered");
+
+    // decoding of pre-roll gives all of its frames (the last ones by drain), which end the stream
+    hashes.clear();
+    const Decoder::DecodedFrame decodedFrame = preroll.decode(prerollSession.decoder, true);
+    addFrames(decodedFrame, hashes);
+
+    const long long firstFrame = index.getFrames() - 1 - preroll.getFrames();
+    same = decodedFrame.status == Decoder::Status::OK && (long long)hashes.size() == preroll.getFrames() && firstFrame >= 0;
+    for(size_t i = 0; same && i < hashes.size() && firstFrame + i < reference.size(); i++) {
+        same = hashes[i] == reference[firstFrame + i];
+    }
+
+    report("PrerollBuffer decode", same, to_string(hashes.size()) + " of " + to_string(preroll.getFrames()) + " frames");
+}
+
+Codec codecOf(const string &path) {
+    const string extension = path.substr(path.find_last_of('.') + 1);
+    if(extension == "h265" || extension == "265" || extension == "hevc") return Codec::HEVC;
+    if(extension == "mjpeg" || extension == "mjpg") return Codec::MJPEG;
+    if(extension == "ivf") return Codec::VP8;
+    if(extension == "fwht") return Codec::FWHT;
+    return Codec::H264;
+}
+
+// vicodec round trip below (FWHT encoder and stateful decoder)
+
+bool hasFormat(const int fd, const uint32_t type, const uint32_t pixelFormat) {
+    v4l2_fmtdesc format = {};
+    format.type = type;
+    for(; ioctl(fd, VIDIOC_ENUM_FMT, &format) == 0; format.index++) {
+        if(format.pixelformat == pixelFormat) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// encoder takes raw frames and gives FWHT on CAPTURE, decoder the other way around
+bool findVicodec(string &encoderDevice, string &decoderDevice) {
+    for(int i = 0; i < 64; i++) {
+        const string path = "/dev/video" + to_string(i);
+        const int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+        if(fd < 0) {
+            continue;
+        }
+
+        v4l2_capability capability = {};
+        if(ioctl(fd, VIDIOC_QUERYCAP, &capability) == 0 && strcmp(reinterpret_cast<const char *>(capability.driver), "vicodec") == 0) {
+            if(hasFormat(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_PIX_FMT_FWHT)) {
+                encoderDevice = path;
+            } else if(hasFormat(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_PIX_FMT_FWHT)) {
+                decoderDevice = path;
+            }
+        }
+
+        close(fd);
+    }
+
+    return !encoderDevice.empty() && !decoderDevice.empty();
+}
+
+// smooth moving gradient (YU12 with luma stride), FWHT keeps it well above roundTripPSNR
+vector<uint8_t> syntheticFrame(const pair<int, int> &size, const int stride, const int frame) {
+    vector<uint8_t> output(Deinterlacer::frameBytes(size, stride), 128);
+    for(int y = 0; y < size.second; y++) {
+        for(int x = 0; x < size.first; x++) {
+            const int phase = (x + y + frame * 4) % 512;
+            output[(size_t)y * stride + x] = phase < 256 ? phase : 511 - phase;
+        }
+    }
+
+    uint8_t *chroma = output.data() + (size_t)stride * size.second;
+    for(int y = 0; y < size.second / 2; y++) {
+        for(int x = 0; x < size.first / 2; x++) {
+            chroma[(size_t)y * (stride / 2) + x] = 64 + x * 128 / size.first;
+        }
+    }
+
+    return output;
+}
+
+double lumaPSNR(const uint8_t *source, const int sourceStride, const uint8_t *decoded, const int decodedStride, const pair<int, int> &size) {
+    double error = 0;
+    for(int y = 0; y < size.second; y++) {
+        for(int x = 0; x < size.first; x++) {
+            const int difference = source[(size_t)y * sourceStride + x] - decoded[(size_t)y * decodedStride + x];
+            error += difference * difference;
+        }
+    }
+
+    error /= (double)size.first * size.second;
+    return error == 0 ? 99 : 10 * log10(255.0 * 255.0 / error);
+}
+
+// decodes whole FWHT stream, frames are copied with capture stride
+bool decodeFrames(const string &device, const vector<uint8_t> &input, vector<vector<uint8_t>> &frames, int &stride) {
+    DecodeSession session;
+    if(!session.open(device, roundTripSize, Codec::FWHT)) {
+        return false;
+    }
+
+    stride = session.decoder.getCaptureStride();
+    const auto add = [&](const Decoder::DecodedFrame &decodedFrame) {
+        const size_t frameSize = decodedFrame.frames > 0 ? decodedFrame.output.size() / decodedFrame.frames : 0;
+        for(int i = 0; i < decodedFrame.frames; i++) {
+            frames.emplace_back(decodedFrame.output.begin() + i * frameSize, decodedFrame.output.begin() + (i + 1) * frameSize);
+        }
+
+        return decodedFrame.status == Decoder::Status::OK;
+    };
+
+    return add(session.decoder.decode(reinterpret_cast<const char *>(input.data()), input.size(), false)) && add(session.decoder.drain());
+}
+
+void checkVicodec() {
+    string encoderDevice, decoderDevice;
+    if(!findVicodec(encoderDevice, decoderDevice)) {
+        skip("vicodec round trip", "vicodec isn't loaded (modprobe vicodec multiplanar=1)");
+        return;
+    }
+
+    Encoder encoder;
+    if(encoder.initializeEncoder(roundTripSize.first, roundTripSize.second, encoderBitrate, encoderGOPSize, encoderDevice, false, 0, V4L2_PIX_FMT_FWHT) != Decoder::InitStatus::OK) {
+        report("vicodec encoder", false, "failed to initialize " + encoderDevice);
+        return;
+    }
+
+    const int sourceStride = encoder.getInputStride();
+    vector<vector<uint8_t>> source;
+    vector<uint8_t> encoded;
+    int encodedFrames = 0;
+    bool encodedAll = true;
+
+    for(int i = 0; i < roundTripFrames; i++) {
+        source.push_back(syntheticFrame(roundTripSize, sourceStride, i));
+        Encoder::EncodedData encodedData = encoder.encode(source.back().data(), source.back().size());
+        encodedAll = encodedAll && encodedData.status == Decoder::Status::OK;
+        encoded.insert(encoded.end(), encodedData.output.begin(), encodedData.output.end());
+        encodedFrames += encodedData.frames;
+    }
+
+    Encoder::EncodedData encodedData = encoder.drain();
+    encodedAll = encodedAll && encodedData.status == Decoder::Status::OK;
+    encoded.insert(encoded.end(), encodedData.output.begin(), encodedData.output.end());
+    encodedFrames += encodedData.frames;
+
+    report("vicodec encode", encodedAll && encodedFrames == roundTripFrames, to_string(encodedFrames) + " frames, " + to_string(encoded.size()) + " bytes");
+
+    // decoded frames (of encoded or transcoded stream) against the source
+    const auto compare = [&](const string &check, const vector<uint8_t> &stream) {
+        vector<vector<uint8_t>> frames;
+        int stride = 0;
+        if(!decodeFrames(decoderDevice, stream, frames, stride)) {
+            report(check, false, "decoding failed");
+            return;
+        }
+
+        double worst = 99;
+        for(size_t i = 0; i < min(frames.size(), source.size()); i++) {
+            worst = min(worst, lumaPSNR(source[i].data(), sourceStride, frames[i].data(), stride, roundTripSize));
+        }
+
+        report(check, frames.size() == source.size() && worst >= roundTripPSNR, to_string(frames.size()) + " frames, lowest PSNR " + to_string(worst) + " dB");
+    };
+
+    compare("vicodec encode and decode", encoded);
+
+    TranscodeOptions options;
+    options.inputCodec = Codec::FWHT;
+    options.codec = V4L2_PIX_FMT_FWHT;
+    options.decoderDevice = decoderDevice;
+    options.encoderDevice = encoderDevice;
+
+    Transcoder transcoder;
+    if(transcoder.initialize(roundTripSize.first, roundTripSize.second, options) != Decoder::InitStatus::OK) {
+        report("vicodec transcode", false, "failed to initialize");
+        return;
+    }
+
+    const Encoder::EncodedData transcoded = transcoder.transcode(reinterpret_cast<const char *>(encoded.data()), encoded.size(), true);
+    report("vicodec transcode", transcoded.status == Decoder::Status::OK && transcoder.getEncodedFrames() == roundTripFrames, to_string(transcoder.getEncodedFrames()) + " frames, " + to_string(transcoder.getStalls()) + " stalls");
+
+    // second generation of lossy coding, FWHT requantizes with the same parameters
+    compare("vicodec transcode and decode", transcoded.output);
+}
+
+int main(int argc, char **argv) {
+    const string path = argc > 1 ? argv[1] : defaultInputPath;
+    const vector<char> input = readFile<char>(path);
+    if(input.empty()) {
+        cout << "Failed to open video file\n";
+        return 2;
+    }
+
+    const Codec codec = codecOf(path);
+
+    checkFind();
+    checkKernels();
+    checkDeinterlace();
+    checkPipeline();
+    checkFileSource(path, input);
+    checkStreamSource(input);
+
+    if(codec == Codec::H264 || codec == Codec::HEVC) {
+        checkSplitter(input);
+        checkIndex(input, codec);
+        checkRecorder(input, codec);
+    }
+
+    if(argc > 2) {
+        pair<int, int> size = {0, 0};
+        if(argc > 3) {
+            sscanf(argv[3], "%dx%d", &size.first, &size.second);
+        }
+
+        checkDecoding(path, input, argv[2], codec, size);
+    } else {
+        skip("decoding", "no device given");
+    }
+
+    checkVicodec();
+
+    cout << (failures == 0 ? "all checks passed\n" : to_string(failures) + " checks failed\n");
+    return failures == 0 ? 0 : 1;
+}